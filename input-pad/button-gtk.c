@@ -300,6 +300,12 @@ input_pad_gtk_button_new_with_label_size (const gchar *label, int icon_size)
     return button;
 }
 
+GdkPixbuf *
+input_pad_gtk_button_render_label (const gchar *label, int icon_size)
+{
+    return create_pixbuf (label, icon_size);
+}
+
 GtkWidget *
 input_pad_gtk_button_new_with_unicode (guint code)
 {
@@ -555,3 +561,26 @@ input_pad_gtk_button_set_label_size (InputPadGtkButton *button,
     g_free (button->priv->label);
     button->priv->label = g_strdup (label);
 }
+
+void
+input_pad_gtk_button_set_label_pixbuf (InputPadGtkButton *button,
+                                       const gchar       *label,
+                                       GdkPixbuf         *pixbuf)
+{
+    GtkWidget *image;
+
+    g_return_if_fail (button != NULL &&
+                      INPUT_PAD_IS_GTK_BUTTON (button));
+    g_return_if_fail (GDK_IS_PIXBUF (pixbuf));
+
+    /* The image widget is reused to swap the pre-rendered pixbuf. */
+    image = gtk_button_get_image (GTK_BUTTON (button));
+    if (GTK_IS_IMAGE (image)) {
+        gtk_image_set_from_pixbuf (GTK_IMAGE (image), pixbuf);
+    } else {
+        image = gtk_image_new_from_pixbuf (pixbuf);
+        gtk_button_set_image (GTK_BUTTON (button), image);
+    }
+    g_free (button->priv->label);
+    button->priv->label = g_strdup (label);
+}
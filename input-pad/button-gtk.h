@@ -66,6 +66,9 @@ GtkWidget *         input_pad_gtk_button_new_with_label_size
                                        (const gchar           *label,
                                         int                    icon_size);
 GtkWidget *         input_pad_gtk_button_new_with_unicode (guint code);
+GdkPixbuf *         input_pad_gtk_button_render_label
+                                       (const gchar           *label,
+                                        int                    icon_size);
 void                input_pad_gtk_button_set_unicode
                                        (InputPadGtkButton      *button,
                                         guint                   code);
@@ -115,6 +118,10 @@ void                input_pad_gtk_button_set_label_size
                                        (InputPadGtkButton      *button,
                                         const gchar            *label,
                                         int                     icon_size);
+void                input_pad_gtk_button_set_label_pixbuf
+                                       (InputPadGtkButton      *button,
+                                        const gchar            *label,
+                                        GdkPixbuf              *pixbuf);
 
 G_END_DECLS
 
@@ -0,0 +1,388 @@
+/* vim:set et sts=4: */
+/* input-pad - The input pad
+ * Copyright (C) 2010-2012 Takao Fujiwara <takao.fujiwara1@gmail.com>
+ * Copyright (C) 2010-2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gio/gio.h>
+#include <signal.h> /* kill */
+#include <stdlib.h> /* atoi */
+#include <string.h> /* strlen, strchr */
+#include <unistd.h> /* setpgid */
+
+#include "command-pad.h"
+
+#define HELPER_SHELL "/bin/sh"
+
+typedef struct _HelperResult HelperResult;
+
+/* Each request is written to the shell as one line and the end of the
+ * output is marked by a line of the token and the exit status.
+ * cancel_source watches the cancellable of task. */
+struct _InputPadCommandHelper {
+    GSubprocess                *subprocess;
+    GOutputStream              *stdin_pipe;
+    GDataInputStream           *stdout_stream;
+    GCancellable               *cancellable;
+    gchar                      *token;
+    GTask                      *task;
+    GSource                    *cancel_source;
+    GString                    *output;
+};
+
+struct _HelperResult {
+    gchar                      *output;
+    int                         exit_status;
+};
+
+static void             helper_read_line        (InputPadCommandHelper *helper);
+
+static void
+helper_result_free (HelperResult *result)
+{
+    g_free (result->output);
+    g_slice_free (HelperResult, result);
+}
+
+/* The shell is the leader of its own process group so the running
+ * command is killed with it. */
+static void
+helper_stop (InputPadCommandHelper *helper)
+{
+    const gchar *identifier;
+
+    if (helper->cancellable) {
+        g_cancellable_cancel (helper->cancellable);
+        g_clear_object (&helper->cancellable);
+    }
+    if (helper->subprocess) {
+        identifier = g_subprocess_get_identifier (helper->subprocess);
+        if (identifier) {
+            kill (-(pid_t) atoi (identifier), SIGKILL);
+        }
+        g_subprocess_force_exit (helper->subprocess);
+        g_clear_object (&helper->subprocess);
+    }
+    helper->stdin_pipe = NULL;
+    g_clear_object (&helper->stdout_stream);
+    g_free (helper->token);
+    helper->token = NULL;
+}
+
+static void
+helper_child_setup (gpointer data)
+{
+    setpgid (0, 0);
+}
+
+static gboolean
+helper_start (InputPadCommandHelper *helper, GError **error)
+{
+    GSubprocessLauncher *launcher;
+
+    launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDIN_PIPE |
+                                          G_SUBPROCESS_FLAGS_STDOUT_PIPE |
+                                          G_SUBPROCESS_FLAGS_STDERR_SILENCE);
+    g_subprocess_launcher_set_child_setup (launcher, helper_child_setup,
+                                           NULL, NULL);
+    helper->subprocess = g_subprocess_launcher_spawn (launcher, error,
+                                                      HELPER_SHELL, NULL);
+    g_object_unref (launcher);
+    if (helper->subprocess == NULL) {
+        return FALSE;
+    }
+    helper->stdin_pipe = g_subprocess_get_stdin_pipe (helper->subprocess);
+    helper->stdout_stream =
+        g_data_input_stream_new (g_subprocess_get_stdout_pipe (helper->subprocess));
+    g_data_input_stream_set_newline_type (helper->stdout_stream,
+                                          G_DATA_STREAM_NEWLINE_TYPE_LF);
+    helper->cancellable = g_cancellable_new ();
+    helper->token = g_strdup_printf ("INPUT_PAD_HELPER_%08x%08x",
+                                     g_random_int (), g_random_int ());
+    return TRUE;
+}
+
+/* The task is cleared before it returns since the callback can run
+ * the next command. */
+static GTask *
+helper_steal_task (InputPadCommandHelper *helper)
+{
+    GTask *task = helper->task;
+
+    helper->task = NULL;
+    if (helper->cancel_source) {
+        g_source_destroy (helper->cancel_source);
+        g_source_unref (helper->cancel_source);
+        helper->cancel_source = NULL;
+    }
+    return task;
+}
+
+static void
+helper_return_error (InputPadCommandHelper *helper, GError *error)
+{
+    GTask *task = helper_steal_task (helper);
+
+    if (helper->output) {
+        g_string_free (helper->output, TRUE);
+        helper->output = NULL;
+    }
+    g_task_return_error (task, error);
+    g_object_unref (task);
+}
+
+static void
+helper_return_output (InputPadCommandHelper *helper, int exit_status)
+{
+    GTask *task = helper_steal_task (helper);
+    HelperResult *result;
+    GString *output = helper->output;
+
+    helper->output = NULL;
+
+    /* The status line is written after a newline of its own. */
+    if (output->len > 0) {
+        g_string_truncate (output, output->len - 1);
+    }
+    if (g_task_return_error_if_cancelled (task)) {
+        g_string_free (output, TRUE);
+    } else if (!g_utf8_validate (output->str, output->len, NULL)) {
+        g_string_free (output, TRUE);
+        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                 "The output is not UTF-8");
+    } else {
+        result = g_slice_new (HelperResult);
+        result->output = g_string_free (output, FALSE);
+        result->exit_status = exit_status;
+        g_task_return_pointer (task, result,
+                               (GDestroyNotify) helper_result_free);
+    }
+    g_object_unref (task);
+}
+
+static void
+on_helper_read_line (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      data)
+{
+    InputPadCommandHelper *helper;
+    GError *error = NULL;
+    gchar *line;
+    gsize len = 0;
+    gsize token_len;
+
+    line = g_data_input_stream_read_line_finish (G_DATA_INPUT_STREAM (source),
+                                                 result, &len, &error);
+    /* The helper is already freed when the read is cancelled. */
+    if (line == NULL &&
+        g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_error_free (error);
+        return;
+    }
+    helper = (InputPadCommandHelper *) data;
+    if (line == NULL) {
+        if (error == NULL) {
+            error = g_error_new (G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE,
+                                 "The helper %s exited", HELPER_SHELL);
+        }
+        helper_stop (helper);
+        helper_return_error (helper, error);
+        return;
+    }
+    token_len = strlen (helper->token);
+    if (len > token_len && line[token_len] == ' ' &&
+        strncmp (line, helper->token, token_len) == 0) {
+        int exit_status = atoi (line + token_len + 1);
+
+        g_free (line);
+        helper_return_output (helper, exit_status);
+        return;
+    }
+    g_string_append_len (helper->output, line, len);
+    g_string_append_c (helper->output, '\n');
+    g_free (line);
+    helper_read_line (helper);
+}
+
+static void
+helper_read_line (InputPadCommandHelper *helper)
+{
+    g_data_input_stream_read_line_async (helper->stdout_stream,
+                                         G_PRIORITY_DEFAULT,
+                                         helper->cancellable,
+                                         on_helper_read_line,
+                                         helper);
+}
+
+/* The shell and the command are killed since the output of the
+ * command cannot be told from the next one, and the task fails at
+ * once. The shell is started again by the next command. */
+static gboolean
+on_helper_task_cancelled (GCancellable *cancellable,
+                          gpointer      data)
+{
+    InputPadCommandHelper *helper = (InputPadCommandHelper *) data;
+
+    helper_stop (helper);
+    helper_return_error (helper,
+                         g_error_new (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                      "The command is cancelled"));
+    return FALSE;
+}
+
+InputPadCommandHelper *
+input_pad_command_helper_new (void)
+{
+    return g_slice_new0 (InputPadCommandHelper);
+}
+
+void
+input_pad_command_helper_destroy (InputPadCommandHelper *helper)
+{
+    g_return_if_fail (helper != NULL);
+
+    helper_stop (helper);
+    if (helper->task) {
+        helper_return_error (helper,
+                             g_error_new (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                          "The helper is destroyed"));
+    }
+    g_slice_free (InputPadCommandHelper, helper);
+}
+
+gboolean
+input_pad_command_helper_is_busy (InputPadCommandHelper *helper)
+{
+    g_return_val_if_fail (helper != NULL, FALSE);
+
+    return helper->task != NULL;
+}
+
+/* The shell forks a subshell which execs the command so the command
+ * does not change the state of the shell. The leading VAR=value of
+ * the command replaces the environment as g_spawn_sync() does and
+ * argv[0] is searched in PATH of this process since envp might not
+ * have PATH. */
+void
+input_pad_command_helper_run_async (InputPadCommandHelper *helper,
+                                    const char * const    *argv,
+                                    const char * const    *envp,
+                                    GCancellable          *cancellable,
+                                    GAsyncReadyCallback    callback,
+                                    gpointer               user_data)
+{
+    GTask *task;
+    GString *request;
+    GError *error = NULL;
+    gchar *quoted;
+    gchar *program = NULL;
+    int i;
+
+    g_return_if_fail (helper != NULL);
+    g_return_if_fail (argv != NULL && argv[0] != NULL);
+    g_return_if_fail (helper->task == NULL);
+
+    task = g_task_new (NULL, cancellable, callback, user_data);
+    if (g_task_return_error_if_cancelled (task)) {
+        g_object_unref (task);
+        return;
+    }
+    if (helper->subprocess == NULL && !helper_start (helper, &error)) {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    request = g_string_new ("( exec ");
+    if (envp) {
+        if (strchr (argv[0], '/') == NULL) {
+            program = g_find_program_in_path (argv[0]);
+        }
+        g_string_append (request, "env -i ");
+        for (i = 0; envp[i]; i++) {
+            quoted = g_shell_quote (envp[i]);
+            g_string_append (request, quoted);
+            g_string_append_c (request, ' ');
+            g_free (quoted);
+        }
+    }
+    for (i = 0; argv[i]; i++) {
+        quoted = g_shell_quote ((i == 0 && program) ? program : argv[i]);
+        g_string_append (request, quoted);
+        g_string_append_c (request, ' ');
+        g_free (quoted);
+    }
+    g_free (program);
+    g_string_append_printf (request,
+                            ") </dev/null 2>/dev/null; "
+                            "printf '\\n%%s %%d\\n' %s \"$?\"\n",
+                            helper->token);
+
+    if (!g_output_stream_write_all (helper->stdin_pipe,
+                                    request->str, request->len,
+                                    NULL, NULL, &error) ||
+        !g_output_stream_flush (helper->stdin_pipe, NULL, &error)) {
+        g_string_free (request, TRUE);
+        helper_stop (helper);
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+    g_string_free (request, TRUE);
+
+    helper->task = task;
+    helper->output = g_string_new (NULL);
+    if (cancellable) {
+        helper->cancel_source = g_cancellable_source_new (cancellable);
+        g_source_set_callback (helper->cancel_source,
+                               (GSourceFunc) on_helper_task_cancelled,
+                               helper, NULL);
+        g_source_attach (helper->cancel_source, NULL);
+    }
+    helper_read_line (helper);
+}
+
+gboolean
+input_pad_command_helper_run_finish (InputPadCommandHelper *helper,
+                                     GAsyncResult          *result,
+                                     char                 **std_output,
+                                     int                   *exit_status,
+                                     GError               **error)
+{
+    HelperResult *helper_result;
+
+    g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+    helper_result = g_task_propagate_pointer (G_TASK (result), error);
+    if (helper_result == NULL) {
+        return FALSE;
+    }
+    if (std_output) {
+        *std_output = helper_result->output;
+        helper_result->output = NULL;
+    }
+    if (exit_status) {
+        *exit_status = helper_result->exit_status;
+    }
+    helper_result_free (helper_result);
+    return TRUE;
+}
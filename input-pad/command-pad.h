@@ -0,0 +1,56 @@
+/* vim:set et sts=4: */
+/* input-pad - The input pad
+ * Copyright (C) 2010-2012 Takao Fujiwara <takao.fujiwara1@gmail.com>
+ * Copyright (C) 2010-2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#ifndef __INPUT_PAD_COMMAND_PAD_H__
+#define __INPUT_PAD_COMMAND_PAD_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* The helper is a shell which keeps running and forks the commands
+ * instead of the pad process. It runs one command at a time and
+ * the cancellable of the run kills the shell with the command. */
+typedef struct _InputPadCommandHelper InputPadCommandHelper;
+
+InputPadCommandHelper * input_pad_command_helper_new
+                                        (void);
+void                    input_pad_command_helper_destroy
+                                        (InputPadCommandHelper *helper);
+gboolean                input_pad_command_helper_is_busy
+                                        (InputPadCommandHelper *helper);
+void                    input_pad_command_helper_run_async
+                                        (InputPadCommandHelper *helper,
+                                         const char * const    *argv,
+                                         const char * const    *envp,
+                                         GCancellable          *cancellable,
+                                         GAsyncReadyCallback    callback,
+                                         gpointer               user_data);
+gboolean                input_pad_command_helper_run_finish
+                                        (InputPadCommandHelper *helper,
+                                         GAsyncResult          *result,
+                                         char                 **std_output,
+                                         int                   *exit_status,
+                                         GError               **error);
+
+G_END_DECLS
+
+#endif
@@ -38,14 +38,28 @@
 
 #ifdef HAVE_LIBXKLAVIER
 #include <libxklavier/xklavier.h>
+#include <libxml/tree.h>
+#include <libxml/parser.h>
 #else
 #include <X11/extensions/XKBrules.h>
 #endif
 
 #include <string.h> /* strlen */
 
+#ifdef HAVE_XKBCOMMON
+#include <xkbcommon/xkbcommon.h>
+#endif
+
+#include "i18n.h"
 #include "input-pad-window-gtk.h"
 #include "geometry-gdk.h"
+#include "xstats-gdk.h"
+
+#ifndef XKB_BASE
+#define XKB_BASE "/usr/share/X11/xkb"
+#endif
+#define XKB_DEFAULT_RULESET "base"
+#define XKB_CONFIG_DOMAIN "xkeyboard-config"
 
 #ifdef HAVE_LIBXKLAVIER
 #if 0
@@ -58,12 +72,32 @@ extern void xkl_engine_save_toplevel_window_state(XklEngine * engine,
 #endif
 #endif
 
+#define XKB_GEOMETRY_CACHE_VERSION 2
+
+/* The index keys are keysym or unicode with the group in the top bits
+ * and the values are the key position with the level. */
+#define XKB_INDEX_KEY(value, group) \
+    GUINT_TO_POINTER (((value) & 0x1fffffff) | ((guint) (group) << 29))
+#define XKB_INDEX_VALUE(nth, level) \
+    GUINT_TO_POINTER ((((guint) (nth) + 1) << 2) | (level))
+#define XKB_INDEX_VALUE_GET_NTH(value) ((GPOINTER_TO_UINT (value) >> 2) - 1)
+#define XKB_INDEX_VALUE_GET_LEVEL(value) (GPOINTER_TO_UINT (value) & 0x3)
+
 enum {
     XKB_GET_LAYOUTS_KEY,
     XKB_GET_VARIANTS_KEY,
     XKB_GET_OPTIONS_KEY
 };
 
+enum {
+    XKB_RULES_NAMES_RULES = 0,
+    XKB_RULES_NAMES_MODEL,
+    XKB_RULES_NAMES_LAYOUTS,
+    XKB_RULES_NAMES_VARIANTS,
+    XKB_RULES_NAMES_OPTIONS,
+    XKB_RULES_NAMES_N,
+};
+
 #ifdef HAVE_LIBXKLAVIER
 typedef struct _XklSignalData XklSignalData;
 typedef struct _XklLayoutData XklLayoutData;
@@ -83,10 +117,87 @@ struct _XklLayoutData {
 };
 #endif
 
+typedef struct _XKBBuilderKey XKBBuilderKey;
+typedef struct _XKBKeyBuilder XKBKeyBuilder;
+typedef struct _XKBConfigRegEntry XKBConfigRegEntry;
+
+/* The key rows are kept in one key array and one keysym matrix.
+ * keysyms[key * key_stride + group * group_stride + level] is the keysym
+ * and InputPadXKBKeyList and InputPadXKBKeyRow are the views of the arrays
+ * with the next pointers. */
 struct _InputPadXKBKeyListPrivate {
-    XkbFileInfo  *xkb_info;
+    XkbFileInfo          *xkb_info;
+    InputPadXKBKeyList   *rows;
+    unsigned int          n_rows;
+    unsigned int         *row_offsets;
+    InputPadXKBKeyRow    *keys;
+    unsigned int          n_keys;
+    unsigned int         *keysyms;
+    unsigned int        **groups;
+    unsigned int         *n_key_groups;
+    unsigned char        *group_infos;
+    unsigned int          max_groups;
+    unsigned int          max_levels;
+    unsigned int          key_stride;
+    unsigned int          group_stride;
+    GHashTable           *keysym_index;
+    GHashTable           *unicode_index;
+    char                 *rules;
+    char                 *model;
+};
+
+/* The registry lists are indexed by the layout name and "layout(variant)"
+ * when the registry is parsed. The search keys are indexed by "layout"
+ * and "layout(variant)" too since several layouts can share
+ * a description. */
+struct _InputPadXKBConfigRegPrivate {
+    GHashTable           *layouts;
+    GHashTable           *variants;
+    GHashTable           *entries;
+};
+
+struct _XKBConfigRegEntry {
+    InputPadXKBLayoutList  *layout;
+    InputPadXKBVariantList *variant;
+    char                   *search_key;
+};
+
+struct _XKBBuilderKey {
+    KeyCode               keycode;
+    char                 *name;
+    unsigned int          row;
+    unsigned int          n_groups;
+    unsigned char         group_info;
+    unsigned int          width_offset;
+    unsigned int          keysym_offset;
 };
 
+struct _XKBKeyBuilder {
+    GArray               *keys;
+    GArray               *widths;
+    GArray               *keysyms;
+    unsigned int          n_rows;
+};
+
+static int xkb_event_base = -1;
+
+/* The keymap changes are coalesced per window until the idle. */
+typedef struct _XKBKeymapNotify XKBKeymapNotify;
+
+struct _XKBKeymapNotify {
+    InputPadGtkWindow              *window;
+    Display                        *xdisplay;
+    InputPadXKBKeymapNotifyFunc     func;
+    guint                           idle_id;
+    unsigned int                    first_keycode;
+    unsigned int                    last_keycode;
+    gboolean                        new_keyboard;
+};
+
+static GSList *keymap_notifies;
+/* The displays whose XKB events are selected. */
+static GHashTable *keymap_notify_displays;
+
 static gboolean
 input_pad_xkb_init (InputPadGtkWindow *window)
 {
@@ -97,7 +208,7 @@ input_pad_xkb_init (InputPadGtkWindow *window)
         return retval;
     }
 
-    if (!XkbQueryExtension (xdisplay, NULL, NULL, NULL, NULL, NULL)) {
+    if (!XkbQueryExtension (xdisplay, NULL, &xkb_event_base, NULL, NULL, NULL)) {
         g_warning ("Could not init XKB");
         return FALSE;
     }
@@ -133,115 +244,336 @@ input_pad_xkb_get_file_info (InputPadGtkWindow *window)
     return xkb_info;
 }
 
-static void
-xkb_key_row_set_keycode (InputPadXKBKeyRow     *xkb_key_row,
-                         int                    keycode,
-                         char                  *name)
+static char *
+xkb_key_name_dup (char *name)
 {
     char *formatted;
 
-    g_return_if_fail (xkb_key_row != NULL && keycode != 0);
+    formatted = XkbKeyNameText (name, XkbMessage);
+    if (strlen (formatted) > 2) {
+        return g_strndup (formatted + 1, strlen (formatted) - 2);
+    }
+    return g_strdup (formatted);
+}
+
+static XKBKeyBuilder *
+xkb_key_builder_new (void)
+{
+    XKBKeyBuilder *builder = g_new0 (XKBKeyBuilder, 1);
+
+    builder->keys = g_array_new (FALSE, TRUE, sizeof (XKBBuilderKey));
+    builder->widths = g_array_new (FALSE, TRUE, sizeof (unsigned int));
+    builder->keysyms = g_array_new (FALSE, TRUE, sizeof (unsigned int));
+    return builder;
+}
+
+static void
+xkb_key_builder_free (XKBKeyBuilder *builder)
+{
+    unsigned int i;
+
+    if (builder == NULL) {
+        return;
+    }
+    for (i = 0; i < builder->keys->len; i++) {
+        g_free (g_array_index (builder->keys, XKBBuilderKey, i).name);
+    }
+    g_array_free (builder->keys, TRUE);
+    g_array_free (builder->widths, TRUE);
+    g_array_free (builder->keysyms, TRUE);
+    g_free (builder);
+}
+
+/* Appends a key at position or at the tail of the current row when
+ * position is -1. name is owned by builder. */
+static unsigned int
+xkb_key_builder_add_key (XKBKeyBuilder *builder,
+                         int            position,
+                         unsigned int   row,
+                         KeyCode        keycode,
+                         char          *name)
+{
+    XKBBuilderKey key;
+
+    key.keycode = keycode;
+    key.name = name;
+    key.row = row;
+    key.n_groups = 0;
+    key.group_info = XkbWrapIntoRange;
+    key.width_offset = builder->widths->len;
+    key.keysym_offset = builder->keysyms->len;
+    if (position < 0 || position >= (int) builder->keys->len) {
+        g_array_append_val (builder->keys, key);
+        return builder->keys->len - 1;
+    }
+    g_array_insert_val (builder->keys, position, key);
+    return position;
+}
 
-    xkb_key_row->keycode = keycode;
-    if (name) {
-        formatted = XkbKeyNameText (name, XkbMessage);
-        if (strlen (formatted) > 2) {
-            xkb_key_row->name = g_strndup (formatted + 1,
-                                           strlen (formatted) - 2);
+/* The groups of a key need to be added before the next key is added
+ * because the keysyms of a key are contiguous. */
+static void
+xkb_key_builder_add_group (XKBKeyBuilder        *builder,
+                           unsigned int          nth_key,
+                           const unsigned int   *keysyms,
+                           unsigned int          n_keysyms,
+                           unsigned int          width)
+{
+    XKBBuilderKey *key;
+    unsigned int zero = 0;
+    unsigned int i;
+
+    key = &g_array_index (builder->keys, XKBBuilderKey, nth_key);
+    key->n_groups++;
+    g_array_append_val (builder->widths, width);
+    for (i = 0; i < width; i++) {
+        if (i < n_keysyms) {
+            g_array_append_val (builder->keysyms, keysyms[i]);
         } else {
-            xkb_key_row->name = g_strdup (formatted);
+            g_array_append_val (builder->keysyms, zero);
         }
     }
 }
 
-static InputPadXKBKeyRow *
-xkb_key_row_append (InputPadXKBKeyRow *head,
-                    InputPadXKBKeyRow  *new)
+static void
+xkb_key_builder_add_xkb_keysyms (XKBKeyBuilder *builder,
+                                 unsigned int   nth_key,
+                                 XkbDescPtr     xkb,
+                                 unsigned int   keycode)
 {
-    InputPadXKBKeyRow *list = head;
+    KeySym *keysyms;
+    unsigned int *values;
+    int k, l, n_keysyms, groups, n_group, bulk;
 
-    if (list == NULL) {
-        return new;
-    }
-    while (list->next != NULL) {
-        list = list->next;
+    keysyms = XkbKeySymsPtr (xkb, keycode);
+    n_keysyms = XkbKeyNumSyms (xkb, keycode);
+    groups = XkbKeyNumGroups (xkb, keycode);
+    g_array_index (builder->keys, XKBBuilderKey, nth_key).group_info =
+        XkbKeyGroupInfo (xkb, keycode);
+    values = g_new0 (unsigned int, n_keysyms + 1);
+    bulk = 0;
+    for (k = 0; k < groups; k++) {
+        n_group = XkbKeyGroupWidth (xkb, keycode, k);
+        for (l = 0; (l < n_group) && (bulk + l < n_keysyms); l++) {
+            values[l] = (unsigned int) keysyms[bulk + l];
+        }
+        xkb_key_builder_add_group (builder, nth_key, values, l, n_group);
+        bulk += n_group;
+        while (groups > 1 && bulk < n_keysyms && keysyms[bulk] == 0) {
+            bulk++;
+        }
     }
-    list->next = new;
-    return head;
+    g_free (values);
 }
 
-static InputPadXKBKeyList *
-xkb_key_list_append (InputPadXKBKeyList *head,
-                     InputPadXKBKeyList *new)
+static int
+xkb_key_builder_find_key (XKBKeyBuilder *builder, const char *name)
 {
-    InputPadXKBKeyList *list = head;
+    unsigned int i;
 
-    if (list == NULL) {
-        return new;
-    }
-    while (list->next != NULL) {
-        list = list->next;
+    for (i = 0; i < builder->keys->len; i++) {
+        if (!g_strcmp0 (g_array_index (builder->keys, XKBBuilderKey, i).name,
+                        name)) {
+            return (int) i;
+        }
     }
-    list->next = new;
-    return head;
+    return -1;
 }
 
-static gboolean
-xkb_key_list_insert_row_with_name (InputPadXKBKeyList *head,
-                                   InputPadXKBKeyRow  *new_row,
-                                   const gchar        *find_name)
+/* Returns the group of the key which the server uses for the effective
+ * group as XkbKeyGroupInfo() tells. */
+static unsigned int
+xkb_key_list_get_key_group (InputPadXKBKeyListPrivate *priv,
+                            unsigned int               nth,
+                            unsigned int               group)
 {
-    InputPadXKBKeyList *list = head;
-    InputPadXKBKeyRow *row, *row_backup;
-    gboolean found = FALSE;
+    unsigned int n_groups = priv->n_key_groups[nth];
+    unsigned char group_info = priv->group_infos[nth];
+
+    if (n_groups == 0 || group < n_groups) {
+        return group;
+    }
+    switch (XkbOutOfRangeGroupAction (group_info)) {
+    case XkbClampIntoRange:
+        return n_groups - 1;
+    case XkbRedirectIntoRange:
+        group = XkbOutOfRangeGroupNumber (group_info);
+        return (group < n_groups) ? group : 0;
+    default:
+        break;
+    }
+    return group % n_groups;
+}
 
-    g_return_val_if_fail (head != NULL && new_row != NULL, FALSE);
-    g_return_val_if_fail (find_name != NULL, FALSE);
+static void
+xkb_index_insert (GHashTable   *index_table,
+                  unsigned int  value,
+                  unsigned int  group,
+                  unsigned int  nth,
+                  unsigned int  level)
+{
+    gpointer orig;
 
-    while (list != NULL) {
-        row = list->row;
-        while (row) {
-            if (!g_strcmp0 (row->name, find_name)) {
-                row_backup = row->next;
-                row->next = new_row;
-                new_row->next = row_backup;
-                found = TRUE;
+    /* The lower level is preferred to send less modifiers. */
+    orig = g_hash_table_lookup (index_table, XKB_INDEX_KEY (value, group));
+    if (orig != NULL && XKB_INDEX_VALUE_GET_LEVEL (orig) <= level) {
+        return;
+    }
+    g_hash_table_insert (index_table,
+                         XKB_INDEX_KEY (value, group),
+                         XKB_INDEX_VALUE (nth, level));
+}
 
-                goto end_insert_row;
+/* Maps the keysyms and the unicode chars to the keys.
+ * Only the levels 1 and 2 are indexed because the key senders
+ * can press Shift but not the level3 modifiers.
+ * The index is keyed on the effective group and the keysyms are
+ * taken from the key group which the group is normalized to. */
+static void
+xkb_key_list_build_index (InputPadXKBKeyListPrivate *priv)
+{
+    unsigned int i, g, kg, l;
+    unsigned int keysym;
+    gunichar ch;
+
+    priv->keysym_index = g_hash_table_new (g_direct_hash, g_direct_equal);
+    priv->unicode_index = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (i = 0; i < priv->n_keys; i++) {
+        for (g = 0; g < priv->max_groups && g < XkbNumKbdGroups; g++) {
+            for (l = 0; l < priv->max_levels && l < 2; l++) {
+                kg = xkb_key_list_get_key_group (priv, i, g);
+                keysym = priv->keysyms[i * priv->key_stride +
+                                       kg * priv->group_stride + l];
+                if (keysym == 0) {
+                    continue;
+                }
+                xkb_index_insert (priv->keysym_index, keysym, g, i, l);
+                if ((ch = gdk_keyval_to_unicode (keysym)) != 0) {
+                    xkb_index_insert (priv->unicode_index, ch, g, i, l);
+                }
             }
-            row = row->next;
         }
-        list = list->next;
     }
+}
 
-end_insert_row:
-    if (found) {
-        return TRUE;
+static void
+xkb_key_list_destroy_index (InputPadXKBKeyListPrivate *priv)
+{
+    if (priv->keysym_index) {
+        g_hash_table_destroy (priv->keysym_index);
+        priv->keysym_index = NULL;
     }
-    return FALSE;
+    if (priv->unicode_index) {
+        g_hash_table_destroy (priv->unicode_index);
+        priv->unicode_index = NULL;
+    }
+}
+
+/* Copies the builder into the flat storage. The returned list is
+ * the head of the row array and the rows and the keys are linked
+ * so that the list API can still walk them. */
+static InputPadXKBKeyList *
+xkb_key_builder_finish (XKBKeyBuilder *builder)
+{
+    InputPadXKBKeyListPrivate *priv;
+    InputPadXKBKeyRow *key_row;
+    XKBBuilderKey *key;
+    unsigned int n_keys = builder->keys->len;
+    unsigned int i, g, l, r;
+    unsigned int width;
+    unsigned int *src;
+    unsigned int *dest;
+
+    if (n_keys == 0) {
+        return NULL;
+    }
+
+    priv = g_new0 (InputPadXKBKeyListPrivate, 1);
+    priv->n_keys = n_keys;
+    for (i = 0; i < n_keys; i++) {
+        key = &g_array_index (builder->keys, XKBBuilderKey, i);
+        if (i == 0 ||
+            key->row != g_array_index (builder->keys, XKBBuilderKey, i - 1).row) {
+            priv->n_rows++;
+        }
+        priv->max_groups = MAX (priv->max_groups, key->n_groups);
+        for (g = 0; g < key->n_groups; g++) {
+            width = g_array_index (builder->widths, unsigned int,
+                                   key->width_offset + g);
+            priv->max_levels = MAX (priv->max_levels, width);
+        }
+    }
+    /* One more level keeps each group NULL-terminated. */
+    priv->group_stride = priv->max_levels + 1;
+    priv->key_stride = priv->max_groups * priv->group_stride;
+
+    priv->keys = g_new0 (InputPadXKBKeyRow, n_keys);
+    priv->rows = g_new0 (InputPadXKBKeyList, priv->n_rows);
+    priv->row_offsets = g_new0 (unsigned int, priv->n_rows + 1);
+    priv->keysyms = g_new0 (unsigned int, n_keys * priv->key_stride + 1);
+    priv->groups = g_new0 (unsigned int *, n_keys * (priv->max_groups + 1));
+    priv->n_key_groups = g_new0 (unsigned int, n_keys);
+    priv->group_infos = g_new0 (unsigned char, n_keys);
+
+    for (i = 0, r = 0; i < n_keys; i++) {
+        key = &g_array_index (builder->keys, XKBBuilderKey, i);
+        key_row = &priv->keys[i];
+        key_row->keycode = key->keycode;
+        key_row->name = key->name;
+        key->name = NULL;
+        key_row->keysym = &priv->groups[i * (priv->max_groups + 1)];
+        priv->n_key_groups[i] = key->n_groups;
+        priv->group_infos[i] = key->group_info;
+        src = &g_array_index (builder->keysyms, unsigned int,
+                              key->keysym_offset);
+        for (g = 0; g < key->n_groups; g++) {
+            width = g_array_index (builder->widths, unsigned int,
+                                   key->width_offset + g);
+            dest = &priv->keysyms[i * priv->key_stride +
+                                  g * priv->group_stride];
+            for (l = 0; l < width; l++) {
+                dest[l] = *src++;
+            }
+            key_row->keysym[g] = dest;
+        }
+        if (i == 0 ||
+            key->row != g_array_index (builder->keys, XKBBuilderKey, i - 1).row) {
+            if (i > 0) {
+                priv->rows[r].next = &priv->rows[r + 1];
+                r++;
+            }
+            priv->rows[r].row = key_row;
+            priv->row_offsets[r] = i;
+        } else {
+            priv->keys[i - 1].next = key_row;
+        }
+    }
+    priv->row_offsets[priv->n_rows] = n_keys;
+    priv->rows[0].priv = priv;
+    xkb_key_list_build_index (priv);
+
+    return &priv->rows[0];
 }
 
 static void
-get_xkb_section (InputPadXKBKeyList   **xkb_key_listp,
+get_xkb_section (XKBKeyBuilder         *builder,
                  XkbDescPtr             xkb,
                  XkbSectionPtr          section)
 {
-    InputPadXKBKeyRow *xkb_key_row, *xkb_key_row_head;
-    InputPadXKBKeyList *list;
     XkbDrawablePtr draw, draw_head;
     XkbRowPtr   row;
     XkbKeyPtr   key;
 #if 0
     XkbShapePtr shape;
 #endif
-    int i, j, k, l, keycode, n_keysyms, groups, n_group, bulk;
-    KeySym *keysyms;
+    int i, j, keycode;
+    unsigned int nth_key, n_keys;
 
     if (section->doodads) {
         draw_head = XkbGetOrderedDrawables(NULL, section);
         for (draw = draw_head; draw; draw = draw->next) {
             if (draw->type == XkbDW_Section) {
-                get_xkb_section (xkb_key_listp, xkb, draw->u.section);
+                get_xkb_section (builder, xkb, draw->u.section);
             }
         }
         XkbFreeOrderedDrawables (draw_head);
@@ -249,7 +581,7 @@ get_xkb_section (InputPadXKBKeyList   **xkb_key_listp,
 
     row = section->rows;
     for (i = 0; i < section->num_rows; i++) {
-        xkb_key_row_head = NULL;
+        n_keys = builder->keys->len;
         key = row->keys;
         for (j = 0; j < row->num_keys; j++) {
 #if 0
@@ -266,56 +598,37 @@ get_xkb_section (InputPadXKBKeyList   **xkb_key_listp,
                            XkbKeyNameText (key->name.name, XkbMessage));
                 goto next_key;
             }
-            keysyms = XkbKeySymsPtr (xkb, keycode);
-            n_keysyms = XkbKeyNumSyms (xkb, keycode);
-            if (n_keysyms == 0) {
+            if (XkbKeyNumSyms (xkb, keycode) == 0) {
                 g_debug ("%s is not included in your keyboard.",
                          XkbKeyNameText (key->name.name, XkbMessage));
                 goto next_key;
             }
-            xkb_key_row = g_new0 (InputPadXKBKeyRow, 1);
-            xkb_key_row_head = xkb_key_row_append (xkb_key_row_head,
-                                                   xkb_key_row);
-            xkb_key_row_set_keycode (xkb_key_row, keycode, key->name.name);
-            groups = XkbKeyNumGroups (xkb, keycode);
-            xkb_key_row->keysym = g_new0 (unsigned int *, groups + 1);
-            bulk = 0;
-            for (k = 0; k < groups; k++) {
-                n_group = XkbKeyGroupWidth (xkb, keycode, k);
-                xkb_key_row->keysym[k] = g_new0 (unsigned int, n_group + 1);
-                for (l = 0; (l < n_group) && (bulk + l < n_keysyms); l++) {
-                    xkb_key_row->keysym[k][l] = (unsigned int) keysyms[bulk + l];
-                }
-                bulk += n_group;
-                while (groups > 1 && keysyms[bulk] == 0) {
-                    bulk++;
-                }
-            }
+            nth_key = xkb_key_builder_add_key (builder, -1,
+                                               builder->n_rows,
+                                               keycode,
+                                               xkb_key_name_dup (key->name.name));
+            xkb_key_builder_add_xkb_keysyms (builder, nth_key, xkb, keycode);
 next_key:
             key++;
         }
-        if (xkb_key_row_head) {
-            list = g_new0 (InputPadXKBKeyList, 1);
-            list->row = xkb_key_row_head;
-            (*xkb_key_listp) = xkb_key_list_append (*xkb_key_listp,
-                                                    list);
+        if (builder->keys->len > n_keys) {
+            builder->n_rows++;
         }
         row++;
     }
 }
 
 static void
-add_xkb_key (InputPadXKBKeyList        *xkb_key_list,
+add_xkb_key (XKBKeyBuilder             *builder,
              XkbDescPtr                 xkb,
              const gchar               *new_key_name,
              const gchar               *prev_key_name)
 {
     XkbKeyRec key_buff;
     XkbKeyPtr key;
-    int k, l, n_keysyms, groups, n_group, bulk;
     unsigned int keycode;
-    KeySym *keysyms;
-    InputPadXKBKeyRow *xkb_key_row;
+    unsigned int nth_key;
+    int prev;
 
     g_return_if_fail (new_key_name != NULL && prev_key_name != NULL);
 
@@ -333,32 +646,21 @@ add_xkb_key (InputPadXKBKeyList        *xkb_key_list,
         return;
     }
 
-    keysyms = XkbKeySymsPtr (xkb, keycode);
-    n_keysyms = XkbKeyNumSyms (xkb, keycode);
-    if (n_keysyms == 0) {
+    if (XkbKeyNumSyms (xkb, keycode) == 0) {
         g_debug ("%s is not included in your keyboard.",
                  XkbKeyNameText (key->name.name, XkbMessage));
         return;
     }
-    xkb_key_row = g_new0 (InputPadXKBKeyRow, 1);
-    xkb_key_list_insert_row_with_name (xkb_key_list,
-                                       xkb_key_row,
-                                       prev_key_name);
-    xkb_key_row_set_keycode (xkb_key_row, keycode, key->name.name);
-    groups = XkbKeyNumGroups (xkb, keycode);
-    xkb_key_row->keysym = g_new0 (unsigned int *, groups + 1);
-    bulk = 0;
-    for (k = 0; k < groups; k++) {
-        n_group = XkbKeyGroupWidth (xkb, keycode, k);
-        xkb_key_row->keysym[k] = g_new0 (unsigned int, n_group + 1);
-        for (l = 0; (l < n_group) && (bulk + l < n_keysyms); l++) {
-            xkb_key_row->keysym[k][l] = (unsigned int) keysyms[bulk + l];
-        }
-        bulk += n_group;
-        while (groups > 1 && keysyms[bulk] == 0) {
-            bulk++;
-        }
+    if ((prev = xkb_key_builder_find_key (builder, prev_key_name)) < 0) {
+        return;
     }
+    nth_key = xkb_key_builder_add_key (builder, prev + 1,
+                                       g_array_index (builder->keys,
+                                                      XKBBuilderKey,
+                                                      prev).row,
+                                       keycode,
+                                       xkb_key_name_dup (key->name.name));
+    xkb_key_builder_add_xkb_keysyms (builder, nth_key, xkb, keycode);
 }
 
 #ifdef HAVE_LIBXKLAVIER
@@ -399,6 +701,7 @@ init_xkl_engine (InputPadGtkWindow     *window,
     return xklengine;
 }
 
+#if 0
 static XklConfigRegistry *
 init_xkl_config_registry (InputPadGtkWindow *window)
 {
@@ -410,10 +713,10 @@ init_xkl_config_registry (InputPadGtkWindow *window)
         return xklconfig_registry;
     }
     xklconfig_registry = xkl_config_registry_get_instance (xklengine);
-    xkl_config_registry_load (xklconfig_registry, FALSE);
     return xklconfig_registry;
 }
 #endif
+#endif
 
 #if 0
 static void
@@ -453,11 +756,49 @@ update_keysym_mapping (Display *xdisplay,
 #endif
 
 #ifdef HAVE_LIBXKLAVIER
+/* The number of the X events which reached on_filter_x_evt() and
+ * were passed to libxklavier. */
+static unsigned int xkl_filter_n_received;
+static unsigned int xkl_filter_n_forwarded;
+
+/* libxklavier ignores XkbStateNotify without the group changes and
+ * the window events with XKLL_TRACK_KEYBOARD_STATE. The other XKB
+ * events, MappingNotify and the property changes of the root window
+ * are passed. */
+static gboolean
+xkl_filter_is_wanted_event (XEvent *xevent)
+{
+    XkbEvent *xkbev = (XkbEvent *) xevent;
+
+    if (xevent->type == PropertyNotify) {
+        return xevent->xproperty.window ==
+            GDK_WINDOW_XID (gdk_get_default_root_window ());
+    }
+    if (xevent->type == MappingNotify) {
+        return TRUE;
+    }
+    if (xkb_event_base < 0 || xevent->type != xkb_event_base) {
+        return FALSE;
+    }
+    if (xkbev->any.xkb_type == XkbStateNotify) {
+        return (xkbev->state.changed & (XkbGroupStateMask |
+                                        XkbGroupBaseMask |
+                                        XkbGroupLatchMask |
+                                        XkbGroupLockMask)) != 0;
+    }
+    return TRUE;
+}
+
 static GdkFilterReturn
 on_filter_x_evt (GdkXEvent * xev, GdkEvent * event, gpointer data)
 {
     XEvent *xevent = (XEvent *) xev;
 
+    xkl_filter_n_received++;
+    if (!xkl_filter_is_wanted_event (xevent)) {
+        return GDK_FILTER_CONTINUE;
+    }
+    xkl_filter_n_forwarded++;
     xkl_engine_filter_events (xklengine, xevent);
     return GDK_FILTER_CONTINUE;
 }
@@ -500,20 +841,34 @@ xkl_setup_events (XklEngine            *xklengine,
                   guint                 signal_id)
 {
     static XklSignalData signal_data;
+    static gboolean listening = FALSE;
+    Display *xdisplay = GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET (window)));
 
     signal_data.object = G_OBJECT (window);
     signal_data.signal_id = signal_id;
 
+    /* This is called whenever the signal is emitted. */
+    if (listening) {
+        return;
+    }
+    listening = TRUE;
+
     g_signal_connect (xklengine, "X-state-changed",
                       G_CALLBACK (on_state_changed),
                       (gpointer) &signal_data);
 
+    /* The default filter also receives the events of the root window
+     * so the root window does not need the filter. */
     gdk_window_add_filter (NULL, (GdkFilterFunc)
                            on_filter_x_evt, NULL);
-    gdk_window_add_filter (gdk_get_default_root_window (), (GdkFilterFunc)
-                           on_filter_x_evt, NULL);
     xkl_engine_start_listen (xklengine,
                              XKLL_TRACK_KEYBOARD_STATE);
+    /* libxklavier selects the group state only but the selection is
+     * shared with GdkKeymap on the same connection, so the modifier
+     * state which GDK tracks is selected again. */
+    XkbSelectEventDetails (xdisplay, XkbUseCoreKbd, XkbStateNotify,
+                           XkbAllStateComponentsMask,
+                           XkbModifierStateMask | XkbGroupStateMask);
 }
 #endif
 
@@ -783,6 +1138,7 @@ end_append_group_option:
     ;
 }
 
+#if 0
 static void
 add_variant (XklConfigRegistry   *xklconfig_registry,
              const XklConfigItem *item,
@@ -874,6 +1230,7 @@ get_reg_option_with_xkl_config_registry (InputPadXKBConfigReg  **config_regp,
                                               add_option_group, config_regp);
     return TRUE;
 }
+#endif
 
 static int
 find_layouts_index (gchar **all_layouts, const gchar *sub_layouts,
@@ -1028,23 +1385,22 @@ set_xkb_rules (Display *xdisplay,
     XChangeProperty (xdisplay, root_window,
                     rules_atom, XA_STRING, 8, PropModeReplace,
                     (unsigned char *) pval, len);
-    XSync(xdisplay, False);
 
     return TRUE;
 }
 #endif
 
+/* Returns the NULL-terminated array of rules, model, layouts, variants
+ * and options in _XKB_RULES_NAMES. The missing values are empty. */
 static char **
-xkb_get_group_layouts_from_key (InputPadGtkWindow      *window, 
-                                InputPadXKBKeyList     *xkb_key_list,
-                                int                     get_key)
+xkb_get_rules_names (InputPadGtkWindow *window)
 {
     Display *xdisplay;
     char **names;
+    const char *p;
     Atom xkb_rules_name, type;
-    int format;
-    unsigned long l, nitems, bytes_after;
-    unsigned char *orig_prop;
+    int format, i;
+    unsigned long nitems, bytes_after;
     unsigned char *prop = NULL;
 
     xdisplay = GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET (window)));
@@ -1061,197 +1417,889 @@ xkb_get_group_layouts_from_key (InputPadGtkWindow      *window,
         g_warning ("Could not get X property");
         return NULL;
     }
-    orig_prop = prop;
-    if (nitems < 3) {
+    if (prop == NULL || nitems < 3) {
         g_warning ("Could not get group layout from X property");
-        if (orig_prop != NULL)
-            XFree (orig_prop);
+        if (prop != NULL)
+            XFree (prop);
         return NULL;
     }
-    for (l = 0; l < 2; l++) {
-        prop += strlen ((const char *) prop) + 1;
-    }
-    if (prop == NULL || *prop == '\0') {
-        g_warning ("No layouts form X property");
-        if (orig_prop != NULL)
-            XFree (orig_prop);
-        return NULL;
+    names = g_new0 (char *, XKB_RULES_NAMES_N + 1);
+    p = (const char *) prop;
+    for (i = 0; i < XKB_RULES_NAMES_N; i++) {
+        if (p < (const char *) prop + nitems) {
+            names[i] = g_strndup (p, (const char *) prop + nitems - p);
+            p += strlen (names[i]) + 1;
+        } else {
+            names[i] = g_strdup ("");
+        }
     }
-    if (get_key == XKB_GET_LAYOUTS_KEY) {
-        names = g_strsplit ((gchar *) prop, ",", -1);
-        debug_print_group_layout_list (names);
-        XFree (orig_prop);
+    XFree (prop);
 
-        return names;
-    }
-    prop += strlen ((const char *) prop) + 1;
-    if (prop == NULL) {
-        g_warning ("No variants form X property");
-        XFree (orig_prop);
-        return NULL;
-    }
-    if (get_key == XKB_GET_VARIANTS_KEY) {
-        names = g_strsplit ((gchar *) prop, ",", -1);
-        debug_print_group_layout_list (names);
-        XFree (orig_prop);
+    return names;
+}
+
+static char **
+xkb_get_group_layouts_from_key (InputPadGtkWindow      *window, 
+                                InputPadXKBKeyList     *xkb_key_list,
+                                int                     get_key)
+{
+    char **rules_names;
+    char **names;
+    const char *value;
 
-        return names;
+    rules_names = xkb_get_rules_names (window);
+    if (rules_names == NULL) {
+        return NULL;
     }
-    prop += strlen ((const char *) prop) + 1;
-    if (prop == NULL) {
-        g_warning ("No options form X property");
-        XFree (orig_prop);
+    if (*rules_names[XKB_RULES_NAMES_LAYOUTS] == '\0') {
+        g_warning ("No layouts form X property");
+        g_strfreev (rules_names);
         return NULL;
     }
-    if (get_key == XKB_GET_OPTIONS_KEY) {
-        names = g_strsplit ((gchar *) prop, ",", -1);
-        debug_print_group_layout_list (names);
-        XFree (orig_prop);
-
-        return names;
+    switch (get_key) {
+    case XKB_GET_LAYOUTS_KEY:
+        value = rules_names[XKB_RULES_NAMES_LAYOUTS];
+        break;
+    case XKB_GET_VARIANTS_KEY:
+        value = rules_names[XKB_RULES_NAMES_VARIANTS];
+        break;
+    case XKB_GET_OPTIONS_KEY:
+        value = rules_names[XKB_RULES_NAMES_OPTIONS];
+        break;
+    default:
+        g_assert_not_reached ();
+        g_strfreev (rules_names);
+        return NULL;
     }
+    names = g_strsplit (value, ",", -1);
+    debug_print_group_layout_list (names);
+    g_strfreev (rules_names);
 
-    g_assert_not_reached ();
-    XFree (orig_prop);
-    return NULL;
+    return names;
 }
 
-void
-input_pad_gdk_xkb_destroy_keyboard_layouts (InputPadGtkWindow   *window,
-                                            InputPadXKBKeyList  *xkb_key_list)
+static char *
+xkb_geometry_cache_get_path (char **rules_names)
 {
-    InputPadXKBKeyList *list = xkb_key_list;
-    InputPadXKBKeyRow *row;
-    int i, j;
+    char *joined;
+    char *checksum;
+    char *filename;
+    char *path;
+
+    joined = g_strjoinv ("\n", rules_names);
+    checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, joined, -1);
+    filename = g_strdup_printf ("%s.geometry", checksum);
+    path = g_build_filename (g_get_user_cache_dir (), PACKAGE,
+                             filename, NULL);
+    g_free (filename);
+    g_free (checksum);
+    g_free (joined);
+
+    return path;
+}
 
-    if (xkb_key_list == NULL) {
-        return;
+/* Only the key names and the keycodes are cached and the keysyms are
+ * always read from the server because xmodmap or a new XKB data
+ * can change them without changing the rules names. */
+static InputPadXKBKeyList *
+xkb_geometry_cache_load (InputPadGtkWindow *window,
+                         const char        *path,
+                         char             **rules_names)
+{
+    Display *xdisplay;
+    XkbDescPtr xkb = NULL;
+    GKeyFile *key_file;
+    GError *error = NULL;
+    InputPadXKBKeyList *xkb_key_list = NULL;
+    XKBKeyBuilder *builder;
+    char **cached_names = NULL;
+    char **values;
+    char *group_name;
+    char *key_name;
+    unsigned int nth_key, keycode;
+    gsize n_values;
+    int n_rows, n_keys, i, j;
+    int version;
+
+    key_file = g_key_file_new ();
+    if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &error)) {
+        if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_warning ("Could not load %s: %s", path, error->message);
+        }
+        g_error_free (error);
+        g_key_file_free (key_file);
+        return NULL;
     }
 
-    for (i = 1; list; i++) {
-        row = list->row;
-        while (row) {
-            g_free (row->name);
-            row->name = NULL;
-            for (j = 0; row->keysym && row->keysym[j]; j++) {
-                g_free (row->keysym[j]);
-                row->keysym[j] = NULL;
-            }
-            g_free (row->keysym);
-            row->keysym = NULL;
-            row = row->next;
+    /* The file name is a checksum and the rules names are compared
+     * to avoid the collision. */
+    version = g_key_file_get_integer (key_file, "Geometry", "Version", NULL);
+    cached_names = g_key_file_get_string_list (key_file, "Geometry",
+                                               "RulesNames", &n_values, NULL);
+    if (version != XKB_GEOMETRY_CACHE_VERSION ||
+        cached_names == NULL ||
+        n_values != g_strv_length (rules_names)) {
+        goto end_cache_load;
+    }
+    for (i = 0; rules_names[i]; i++) {
+        if (g_strcmp0 (cached_names[i], rules_names[i]) != 0) {
+            goto end_cache_load;
         }
-        list = list->next;
     }
 
-    list = xkb_key_list;
-    for (i = 1; list; i++) {
-        while (1) {
-            row = list->row;
-            if (row == NULL) {
-                break;
-            }
-            while (row) {
-                if (row && row->next && row->next->next == NULL) {
-                    break;
-                } else if (row && row->next == NULL) {
-                    break;
-                }
-                row = row->next;
+    xdisplay = GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET (window)));
+    xkb = XkbGetMap (xdisplay, XkbKeySymsMask, XkbUseCoreKbd);
+    if (xkb == NULL) {
+        goto end_cache_load;
+    }
+
+    builder = xkb_key_builder_new ();
+    n_rows = g_key_file_get_integer (key_file, "Geometry", "Rows", NULL);
+    for (i = 0; i < n_rows; i++) {
+        group_name = g_strdup_printf ("Row %d", i);
+        n_keys = g_key_file_get_integer (key_file, group_name, "Keys", NULL);
+        for (j = 0; j < n_keys; j++) {
+            key_name = g_strdup_printf ("Key%d", j);
+            values = g_key_file_get_string_list (key_file, group_name,
+                                                 key_name, &n_values, NULL);
+            g_free (key_name);
+            if (values == NULL || n_values < 2) {
+                g_strfreev (values);
+                continue;
             }
-            if (row && row->next) {
-                g_free (row->next);
-                row->next = NULL;
-            } else if (row) {
-                g_free (list->row);
-                list->row = NULL;
-                break;
+            keycode = (unsigned int) g_ascii_strtoull (values[1], NULL, 10);
+            if (keycode < (unsigned int) xkb->min_key_code ||
+                keycode > (unsigned int) xkb->max_key_code ||
+                XkbKeyNumSyms (xkb, keycode) == 0) {
+                g_strfreev (values);
+                continue;
             }
+            nth_key = xkb_key_builder_add_key (builder, -1, i,
+                                               (KeyCode) keycode,
+                                               g_strdup (values[0]));
+            xkb_key_builder_add_xkb_keysyms (builder, nth_key, xkb, keycode);
+            g_strfreev (values);
         }
-        list = list->next;
+        g_free (group_name);
     }
-    while (1) {
-        list = xkb_key_list;
-        if (list == NULL) {
-            break;
-        }
-        for (i = 1; list; i++) {
-            if (list && list->next && list->next->next == NULL) {
-                break;
-            } else if (list && list->next == NULL) {
-                break;
-            }
-            list = list->next;
-        }
-        if (list && list->next) {
-            g_free (list->next);
-            list->next = NULL;
-        } else if (list) {
-            g_free (xkb_key_list);
-            xkb_key_list = NULL;
-            break;
-        }
+    xkb_key_list = xkb_key_builder_finish (builder);
+    xkb_key_builder_free (builder);
+
+end_cache_load:
+    if (xkb) {
+        XkbFreeKeyboard (xkb, 0, True);
     }
+    g_strfreev (cached_names);
+    g_key_file_free (key_file);
+
+    return xkb_key_list;
 }
 
-InputPadXKBKeyList *
-input_pad_gdk_xkb_parse_keyboard_layouts (InputPadGtkWindow   *window)
+static void
+xkb_geometry_cache_save (const char            *path,
+                         char                 **rules_names,
+                         InputPadXKBKeyList    *xkb_key_list)
 {
-    XkbFileInfo *xkb_info;
-    XkbDrawablePtr draw, draw_head;
-    InputPadXKBKeyList *xkb_key_list = NULL;
-    
-    g_return_val_if_fail (window != NULL &&
-                          INPUT_PAD_IS_GTK_WINDOW (window), NULL);
+    GKeyFile *key_file;
+    GError *error = NULL;
+    InputPadXKBKeyList *list;
+    InputPadXKBKeyRow *row;
+    const char *values[2];
+    char *keycode;
+    char *dirname;
+    char *group_name;
+    char *key_name;
+    char *contents;
+    gsize length;
+    int i, j;
 
-    if (!input_pad_xkb_init (window)) {
-        return NULL;
-    }
-    if ((xkb_info = input_pad_xkb_get_file_info (window)) == NULL) {
-        return NULL;
+    dirname = g_path_get_dirname (path);
+    if (g_mkdir_with_parents (dirname, 0700) != 0) {
+        g_warning ("Could not create %s", dirname);
+        g_free (dirname);
+        return;
     }
-    draw_head = XkbGetOrderedDrawables(xkb_info->xkb->geom, NULL);
-    for (draw = draw_head; draw; draw = draw->next) {
-        if (draw->type == XkbDW_Section) {
-            get_xkb_section (&xkb_key_list, xkb_info->xkb, draw->u.section);
+    g_free (dirname);
+
+    key_file = g_key_file_new ();
+    g_key_file_set_integer (key_file, "Geometry", "Version",
+                            XKB_GEOMETRY_CACHE_VERSION);
+    g_key_file_set_string_list (key_file, "Geometry", "RulesNames",
+                                (const gchar * const *) rules_names,
+                                g_strv_length (rules_names));
+
+    /* Each key is saved as "name;keycode". */
+    for (i = 0, list = xkb_key_list; list; i++, list = list->next) {
+        group_name = g_strdup_printf ("Row %d", i);
+        for (j = 0, row = list->row; row; j++, row = row->next) {
+            keycode = g_strdup_printf ("%u", row->keycode);
+            values[0] = row->name ? row->name : "";
+            values[1] = keycode;
+            key_name = g_strdup_printf ("Key%d", j);
+            g_key_file_set_string_list (key_file, group_name, key_name,
+                                        values, 2);
+            g_free (key_name);
+            g_free (keycode);
         }
+        g_key_file_set_integer (key_file, group_name, "Keys", j);
+        g_free (group_name);
     }
-    XkbFreeOrderedDrawables (draw_head);
-    /* Japanese extension */
-    add_xkb_key (xkb_key_list, xkb_info->xkb, "AE13", "AE12");
-    add_xkb_key (xkb_key_list, xkb_info->xkb, "AB11", "AB10");
-    debug_print_key_list (xkb_key_list);
-
-    if (xkb_key_list) {
-        xkb_key_list->priv = g_new0 (InputPadXKBKeyListPrivate, 1);
-        xkb_key_list->priv->xkb_info = xkb_info;
-    }
+    g_key_file_set_integer (key_file, "Geometry", "Rows", i);
 
-#ifdef HAVE_LIBXKLAVIER
-    if (xklengine == NULL) {
-        xklengine = init_xkl_engine (window, &initial_xkl_rec, &initial_group);
+    contents = g_key_file_to_data (key_file, &length, NULL);
+    if (!g_file_set_contents (path, contents, length, &error)) {
+        g_warning ("Could not save %s: %s", path, error->message);
+        g_error_free (error);
     }
-#endif
-
-    return xkb_key_list;
+    g_free (contents);
+    g_key_file_free (key_file);
 }
 
 void
-input_pad_gdk_xkb_signal_emit (InputPadGtkWindow   *window, guint signal_id)
+input_pad_gdk_xkb_destroy_keyboard_layouts (InputPadGtkWindow   *window,
+                                            InputPadXKBKeyList  *xkb_key_list)
 {
-    g_return_if_fail (window != NULL && INPUT_PAD_IS_GTK_WINDOW (window));
+    InputPadXKBKeyListPrivate *priv;
+    unsigned int i;
 
-    xkb_setup_events (window, signal_id);
+    if (xkb_key_list == NULL) {
+        return;
+    }
+    g_return_if_fail (xkb_key_list->priv != NULL);
+
+    /* The rows and the keys are the views of the arrays in priv. */
+    priv = xkb_key_list->priv;
+    for (i = 0; i < priv->n_keys; i++) {
+        g_free (priv->keys[i].name);
+    }
+    g_free (priv->keys);
+    g_free (priv->groups);
+    g_free (priv->n_key_groups);
+    g_free (priv->group_infos);
+    g_free (priv->keysyms);
+    g_free (priv->row_offsets);
+    g_free (priv->rows);
+    xkb_key_list_destroy_index (priv);
+    g_free (priv->rules);
+    g_free (priv->model);
+    g_free (priv);
 }
 
-char **
-input_pad_gdk_xkb_get_group_layouts (InputPadGtkWindow   *window, 
-                                     InputPadXKBKeyList  *xkb_key_list)
+unsigned int
+input_pad_gdk_xkb_key_list_get_n_keys (InputPadXKBKeyList *xkb_key_list)
 {
-    g_return_val_if_fail (window != NULL && INPUT_PAD_IS_GTK_WINDOW (window),
-                          NULL);
+    g_return_val_if_fail (xkb_key_list != NULL &&
+                          xkb_key_list->priv != NULL, 0);
 
-    return xkb_get_group_layouts_from_key (window, xkb_key_list,
+    return xkb_key_list->priv->n_keys;
+}
+
+InputPadXKBKeyRow *
+input_pad_gdk_xkb_key_list_get_nth_key (InputPadXKBKeyList    *xkb_key_list,
+                                        unsigned int           nth)
+{
+    g_return_val_if_fail (xkb_key_list != NULL &&
+                          xkb_key_list->priv != NULL, NULL);
+    g_return_val_if_fail (nth < xkb_key_list->priv->n_keys, NULL);
+
+    return &xkb_key_list->priv->keys[nth];
+}
+
+unsigned int
+input_pad_gdk_xkb_key_list_get_keysym (InputPadXKBKeyList      *xkb_key_list,
+                                       unsigned int             nth,
+                                       unsigned int             group,
+                                       unsigned int             level)
+{
+    InputPadXKBKeyListPrivate *priv;
+
+    g_return_val_if_fail (xkb_key_list != NULL &&
+                          xkb_key_list->priv != NULL, 0);
+
+    priv = xkb_key_list->priv;
+    if (nth >= priv->n_keys ||
+        group >= priv->max_groups ||
+        level >= priv->max_levels) {
+        return 0;
+    }
+    return priv->keysyms[nth * priv->key_stride +
+                         group * priv->group_stride + level];
+}
+
+static gboolean
+xkb_key_list_lookup (InputPadXKBKeyList    *xkb_key_list,
+                     GHashTable            *index_table,
+                     unsigned int           value,
+                     unsigned int           group,
+                     unsigned int          *keycodep,
+                     unsigned int          *keysymp,
+                     unsigned int          *statep)
+{
+    InputPadXKBKeyListPrivate *priv = xkb_key_list->priv;
+    gpointer found;
+    unsigned int nth, level;
+
+    found = g_hash_table_lookup (index_table, XKB_INDEX_KEY (value, group));
+    if (found == NULL) {
+        return FALSE;
+    }
+    nth = XKB_INDEX_VALUE_GET_NTH (found);
+    level = XKB_INDEX_VALUE_GET_LEVEL (found);
+    if (keycodep) {
+        *keycodep = priv->keys[nth].keycode;
+    }
+    if (keysymp) {
+        group = xkb_key_list_get_key_group (priv, nth, group);
+        *keysymp = priv->keysyms[nth * priv->key_stride +
+                                 group * priv->group_stride + level];
+    }
+    if (statep) {
+        *statep = (level == 1) ? ShiftMask : 0;
+    }
+    return TRUE;
+}
+
+gboolean
+input_pad_gdk_xkb_key_list_lookup_keysym (InputPadXKBKeyList   *xkb_key_list,
+                                          unsigned int          keysym,
+                                          unsigned int          group,
+                                          unsigned int         *keycodep,
+                                          unsigned int         *statep)
+{
+    g_return_val_if_fail (xkb_key_list != NULL &&
+                          xkb_key_list->priv != NULL, FALSE);
+
+    return xkb_key_list_lookup (xkb_key_list,
+                                xkb_key_list->priv->keysym_index,
+                                keysym, group,
+                                keycodep, NULL, statep);
+}
+
+gboolean
+input_pad_gdk_xkb_key_list_lookup_unicode (InputPadXKBKeyList  *xkb_key_list,
+                                           gunichar             ch,
+                                           unsigned int         group,
+                                           unsigned int        *keycodep,
+                                           unsigned int        *keysymp,
+                                           unsigned int        *statep)
+{
+    g_return_val_if_fail (xkb_key_list != NULL &&
+                          xkb_key_list->priv != NULL, FALSE);
+
+    return xkb_key_list_lookup (xkb_key_list,
+                                xkb_key_list->priv->unicode_index,
+                                (unsigned int) ch, group,
+                                keycodep, keysymp, statep);
+}
+
+static InputPadXKBKeyList *
+xkb_parse_keyboard_layouts (InputPadGtkWindow   *window)
+{
+    XkbFileInfo *xkb_info;
+    XkbDrawablePtr draw, draw_head;
+    InputPadXKBKeyList *xkb_key_list = NULL;
+    XKBKeyBuilder *builder;
+    char **rules_names;
+    char *cache_path = NULL;
+    
+    g_return_val_if_fail (window != NULL &&
+                          INPUT_PAD_IS_GTK_WINDOW (window), NULL);
+
+    if (!input_pad_xkb_init (window)) {
+        return NULL;
+    }
+
+    /* The key rows depend on the rules names only so the geometry
+     * download and the section walk are skipped with the cache.
+     * The keysyms are read with XkbGetMap in any case. */
+    rules_names = xkb_get_rules_names (window);
+    if (rules_names != NULL && !g_getenv ("INPUT_PAD_NO_GEOMETRY_CACHE")) {
+        cache_path = xkb_geometry_cache_get_path (rules_names);
+        xkb_key_list = xkb_geometry_cache_load (window, cache_path,
+                                                rules_names);
+    }
+    if (xkb_key_list) {
+        debug_print_key_list (xkb_key_list);
+        goto end_parse_keyboard_layouts;
+    }
+
+    if ((xkb_info = input_pad_xkb_get_file_info (window)) == NULL) {
+        g_free (cache_path);
+        g_strfreev (rules_names);
+        return NULL;
+    }
+    builder = xkb_key_builder_new ();
+    draw_head = XkbGetOrderedDrawables(xkb_info->xkb->geom, NULL);
+    for (draw = draw_head; draw; draw = draw->next) {
+        if (draw->type == XkbDW_Section) {
+            get_xkb_section (builder, xkb_info->xkb, draw->u.section);
+        }
+    }
+    XkbFreeOrderedDrawables (draw_head);
+    /* Japanese extension */
+    add_xkb_key (builder, xkb_info->xkb, "AE13", "AE12");
+    add_xkb_key (builder, xkb_info->xkb, "AB11", "AB10");
+    xkb_key_list = xkb_key_builder_finish (builder);
+    xkb_key_builder_free (builder);
+    debug_print_key_list (xkb_key_list);
+
+    if (xkb_key_list) {
+        xkb_key_list->priv->xkb_info = xkb_info;
+        if (cache_path) {
+            xkb_geometry_cache_save (cache_path, rules_names, xkb_key_list);
+        }
+    }
+
+end_parse_keyboard_layouts:
+    if (xkb_key_list && rules_names) {
+        xkb_key_list->priv->rules =
+            g_strdup (rules_names[XKB_RULES_NAMES_RULES]);
+        xkb_key_list->priv->model =
+            g_strdup (rules_names[XKB_RULES_NAMES_MODEL]);
+    }
+    g_free (cache_path);
+    g_strfreev (rules_names);
+
+#ifdef HAVE_LIBXKLAVIER
+    if (xklengine == NULL) {
+        xklengine = init_xkl_engine (window, &initial_xkl_rec, &initial_group);
+    }
+#endif
+
+    return xkb_key_list;
+}
+
+InputPadXKBKeyList *
+input_pad_gdk_xkb_parse_keyboard_layouts (InputPadGtkWindow   *window)
+{
+    InputPadXStatsScope scope;
+    InputPadXKBKeyList *xkb_key_list;
+
+    input_pad_gdk_xstats_scope_begin (&scope,
+                                      INPUT_PAD_XSTATS_OP_LAYOUT_BUILD);
+    xkb_key_list = xkb_parse_keyboard_layouts (window);
+    input_pad_gdk_xstats_scope_end (&scope);
+    return xkb_key_list;
+}
+
+/* Compiles the keymap of layouts, variants and options with libxkbcommon
+ * and returns a new key list which has the key rows of xkb_key_list.
+ * The rules and the model of xkb_key_list are used so this does not
+ * access the X server nor change the session keymap.
+ * Returns NULL when input-pad is built without libxkbcommon. */
+InputPadXKBKeyList *
+input_pad_gdk_xkb_compile_keyboard_layouts (InputPadXKBKeyList *xkb_key_list,
+                                            const char         *layouts,
+                                            const char         *variants,
+                                            const char         *options)
+{
+#ifdef HAVE_XKBCOMMON
+    static struct xkb_context *context = NULL;
+    struct xkb_keymap *keymap;
+    struct xkb_rule_names names;
+    InputPadXKBKeyListPrivate *priv;
+    InputPadXKBKeyList *retval;
+    InputPadXKBKeyRow *key_row;
+    XKBKeyBuilder *builder;
+    const xkb_keysym_t *syms;
+    xkb_keycode_t keycode;
+    xkb_layout_index_t g, n_layouts;
+    xkb_level_index_t l, n_levels;
+    unsigned int *values;
+    unsigned int i, r, nth_key;
+
+    g_return_val_if_fail (xkb_key_list != NULL &&
+                          xkb_key_list->priv != NULL, NULL);
+    g_return_val_if_fail (layouts != NULL, NULL);
+
+    if (context == NULL) {
+        context = xkb_context_new (XKB_CONTEXT_NO_FLAGS);
+        if (context == NULL) {
+            g_warning ("Could not create xkbcommon context");
+            return NULL;
+        }
+    }
+    priv = xkb_key_list->priv;
+    names.rules = priv->rules;
+    names.model = priv->model;
+    names.layout = layouts;
+    names.variant = variants;
+    names.options = options;
+    keymap = xkb_keymap_new_from_names (context, &names,
+                                        XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if (keymap == NULL) {
+        g_warning ("Could not compile keymap %s(%s)",
+                   layouts, variants ? variants : "");
+        return NULL;
+    }
+
+    builder = xkb_key_builder_new ();
+    for (i = 0, r = 0; i < priv->n_keys; i++) {
+        while (r + 1 < priv->n_rows && i >= priv->row_offsets[r + 1]) {
+            r++;
+        }
+        key_row = &priv->keys[i];
+        keycode = xkb_keymap_key_by_name (keymap, key_row->name);
+        if (keycode == XKB_KEYCODE_INVALID) {
+            keycode = key_row->keycode;
+        }
+        n_layouts = xkb_keymap_num_layouts_for_key (keymap, keycode);
+        if (n_layouts == 0 || keycode > 255) {
+            continue;
+        }
+        nth_key = xkb_key_builder_add_key (builder, -1, r, (KeyCode) keycode,
+                                           g_strdup (key_row->name));
+        for (g = 0; g < n_layouts; g++) {
+            n_levels = xkb_keymap_num_levels_for_key (keymap, keycode, g);
+            values = g_new0 (unsigned int, n_levels + 1);
+            for (l = 0; l < n_levels; l++) {
+                if (xkb_keymap_key_get_syms_by_level (keymap, keycode,
+                                                      g, l, &syms) > 0) {
+                    values[l] = (unsigned int) syms[0];
+                }
+            }
+            xkb_key_builder_add_group (builder, nth_key,
+                                       values, n_levels, n_levels);
+            g_free (values);
+        }
+    }
+    xkb_keymap_unref (keymap);
+    retval = xkb_key_builder_finish (builder);
+    xkb_key_builder_free (builder);
+    if (retval) {
+        retval->priv->rules = g_strdup (priv->rules);
+        retval->priv->model = g_strdup (priv->model);
+    }
+    debug_print_key_list (retval);
+    return retval;
+#else
+    return NULL;
+#endif
+}
+
+/* The geometry is decided by the keyboard model in the rules names. */
+Bool
+input_pad_gdk_xkb_key_list_geometry_changed (InputPadGtkWindow  *window,
+                                             InputPadXKBKeyList *xkb_key_list)
+{
+    char **rules_names;
+    Bool retval;
+
+    g_return_val_if_fail (window != NULL &&
+                          INPUT_PAD_IS_GTK_WINDOW (window), True);
+    g_return_val_if_fail (xkb_key_list != NULL &&
+                          xkb_key_list->priv != NULL, True);
+
+    rules_names = xkb_get_rules_names (window);
+    if (rules_names == NULL) {
+        return True;
+    }
+    retval = g_strcmp0 (rules_names[XKB_RULES_NAMES_MODEL],
+                        xkb_key_list->priv->model) != 0;
+    g_strfreev (rules_names);
+    return retval;
+}
+
+/* Reloads the keysyms of the keycodes from first_keycode in place.
+ * Returns False when the new keysyms do not fit in the flat arrays
+ * and the key list needs to be parsed again. */
+Bool
+input_pad_gdk_xkb_key_list_update_keysyms (InputPadGtkWindow  *window,
+                                           InputPadXKBKeyList *xkb_key_list,
+                                           unsigned int        first_keycode,
+                                           unsigned int        n_keycodes)
+{
+    Display *xdisplay;
+    InputPadXKBKeyListPrivate *priv;
+    XkbDescPtr xkb;
+    KeySym *keysyms;
+    unsigned int *dest;
+    unsigned int i, g, l;
+    unsigned int keycode, last_keycode;
+    int groups, width, bulk, n_keysyms;
+    Bool retval = True;
+
+    g_return_val_if_fail (window != NULL &&
+                          INPUT_PAD_IS_GTK_WINDOW (window), False);
+    g_return_val_if_fail (xkb_key_list != NULL &&
+                          xkb_key_list->priv != NULL, False);
+
+    if (n_keycodes == 0) {
+        return True;
+    }
+    priv = xkb_key_list->priv;
+    xdisplay = GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET (window)));
+    xkb = XkbGetMap (xdisplay, 0, XkbUseCoreKbd);
+    if (xkb == NULL) {
+        return False;
+    }
+    first_keycode = MAX (first_keycode, (unsigned int) xkb->min_key_code);
+    last_keycode = MIN (first_keycode + n_keycodes - 1,
+                        (unsigned int) xkb->max_key_code);
+    if (first_keycode > last_keycode ||
+        XkbGetKeySyms (xdisplay, first_keycode,
+                       last_keycode - first_keycode + 1, xkb) != Success) {
+        XkbFreeKeyboard (xkb, 0, True);
+        return False;
+    }
+
+    /* Check all the keys before the arrays are changed. */
+    for (i = 0; i < priv->n_keys && retval; i++) {
+        keycode = priv->keys[i].keycode;
+        if (keycode < first_keycode || keycode > last_keycode) {
+            continue;
+        }
+        groups = XkbKeyNumGroups (xkb, keycode);
+        if ((unsigned int) groups > priv->max_groups) {
+            retval = False;
+        }
+        for (g = 0; (int) g < groups && retval; g++) {
+            if ((unsigned int) XkbKeyGroupWidth (xkb, keycode, g) > priv->max_levels) {
+                retval = False;
+            }
+        }
+    }
+    if (!retval) {
+        XkbFreeKeyboard (xkb, 0, True);
+        return False;
+    }
+
+    for (i = 0; i < priv->n_keys; i++) {
+        keycode = priv->keys[i].keycode;
+        if (keycode < first_keycode || keycode > last_keycode) {
+            continue;
+        }
+        dest = &priv->keysyms[i * priv->key_stride];
+        memset (dest, 0, sizeof (unsigned int) * priv->key_stride);
+        keysyms = XkbKeySymsPtr (xkb, keycode);
+        n_keysyms = XkbKeyNumSyms (xkb, keycode);
+        groups = XkbKeyNumGroups (xkb, keycode);
+        priv->n_key_groups[i] = groups;
+        priv->group_infos[i] = XkbKeyGroupInfo (xkb, keycode);
+        bulk = 0;
+        for (g = 0; g < priv->max_groups; g++) {
+            if ((int) g >= groups) {
+                priv->keys[i].keysym[g] = NULL;
+                continue;
+            }
+            width = XkbKeyGroupWidth (xkb, keycode, g);
+            for (l = 0; (int) l < width && bulk + (int) l < n_keysyms; l++) {
+                dest[g * priv->group_stride + l] = (unsigned int) keysyms[bulk + l];
+            }
+            priv->keys[i].keysym[g] = &dest[g * priv->group_stride];
+            bulk += width;
+            while (groups > 1 && bulk < n_keysyms && keysyms[bulk] == 0) {
+                bulk++;
+            }
+        }
+    }
+    XkbFreeKeyboard (xkb, 0, True);
+
+    xkb_key_list_destroy_index (priv);
+    xkb_key_list_build_index (priv);
+    return True;
+}
+
+static gboolean
+xkb_keymap_notify_idle (gpointer data)
+{
+    XKBKeymapNotify *notify = (XKBKeymapNotify *) data;
+    unsigned int first_keycode = notify->first_keycode;
+    unsigned int last_keycode = notify->last_keycode;
+    gboolean new_keyboard = notify->new_keyboard;
+
+    notify->idle_id = 0;
+    notify->first_keycode = 0;
+    notify->last_keycode = 0;
+    notify->new_keyboard = FALSE;
+    if (first_keycode > last_keycode) {
+        return FALSE;
+    }
+    notify->func (notify->window,
+                  first_keycode,
+                  last_keycode - first_keycode + 1,
+                  new_keyboard);
+    return FALSE;
+}
+
+static void
+xkb_keymap_notify_queue (XKBKeymapNotify *notify,
+                         unsigned int     first_keycode,
+                         unsigned int     n_keycodes,
+                         gboolean         new_keyboard)
+{
+    unsigned int last_keycode;
+
+    if (n_keycodes == 0) {
+        return;
+    }
+    last_keycode = first_keycode + n_keycodes - 1;
+    if (notify->idle_id == 0) {
+        notify->first_keycode = first_keycode;
+        notify->last_keycode = last_keycode;
+        notify->idle_id =
+            gdk_threads_add_idle (xkb_keymap_notify_idle, notify);
+    } else {
+        notify->first_keycode = MIN (notify->first_keycode,
+                                     first_keycode);
+        notify->last_keycode = MAX (notify->last_keycode,
+                                    last_keycode);
+    }
+    notify->new_keyboard |= new_keyboard;
+}
+
+static GdkFilterReturn
+on_filter_xkb_keymap_evt (GdkXEvent * xev, GdkEvent * event, gpointer data)
+{
+    XkbEvent *xkbev = (XkbEvent *) xev;
+    XKBKeymapNotify *notify;
+    GSList *list;
+
+    if (xkb_event_base < 0 || xkbev->type != xkb_event_base) {
+        return GDK_FILTER_CONTINUE;
+    }
+    for (list = keymap_notifies; list; list = list->next) {
+        notify = (XKBKeymapNotify *) list->data;
+        if (notify->xdisplay != xkbev->any.display) {
+            continue;
+        }
+        switch (xkbev->any.xkb_type) {
+        case XkbMapNotify:
+            if (xkbev->map.changed & XkbKeySymsMask) {
+                xkb_keymap_notify_queue (notify,
+                                         xkbev->map.first_key_sym,
+                                         xkbev->map.num_key_syms,
+                                         FALSE);
+            }
+            break;
+        case XkbNewKeyboardNotify:
+            xkb_keymap_notify_queue (notify,
+                                     xkbev->new_kbd.min_key_code,
+                                     xkbev->new_kbd.max_key_code -
+                                     xkbev->new_kbd.min_key_code + 1,
+                                     (xkbev->new_kbd.changed &
+                                      (XkbNKN_KeycodesMask | XkbNKN_GeometryMask)) != 0);
+            break;
+        default:
+            break;
+        }
+    }
+    return GDK_FILTER_CONTINUE;
+}
+
+static XKBKeymapNotify *
+xkb_keymap_notify_find (InputPadGtkWindow *window)
+{
+    GSList *list;
+
+    for (list = keymap_notifies; list; list = list->next) {
+        if (((XKBKeymapNotify *) list->data)->window == window) {
+            return (XKBKeymapNotify *) list->data;
+        }
+    }
+    return NULL;
+}
+
+/* func is called with the changed keycode range after XkbMapNotify
+ * and XkbNewKeyboardNotify. new_keyboard is True when the keycodes or
+ * the geometry may be changed. Each window has its own registration
+ * and the filter is removed with the last one. */
+void
+input_pad_gdk_xkb_set_keymap_notify (InputPadGtkWindow          *window,
+                                     InputPadXKBKeymapNotifyFunc func)
+{
+    XKBKeymapNotify *notify;
+    Display *xdisplay;
+
+    g_return_if_fail (window != NULL && INPUT_PAD_IS_GTK_WINDOW (window));
+
+    notify = xkb_keymap_notify_find (window);
+    if (func == NULL) {
+        if (notify == NULL) {
+            return;
+        }
+        if (notify->idle_id) {
+            g_source_remove (notify->idle_id);
+        }
+        keymap_notifies = g_slist_remove (keymap_notifies, notify);
+        g_slice_free (XKBKeymapNotify, notify);
+        if (keymap_notifies == NULL) {
+            gdk_window_remove_filter (NULL, (GdkFilterFunc)
+                                      on_filter_xkb_keymap_evt, NULL);
+            g_hash_table_destroy (keymap_notify_displays);
+            keymap_notify_displays = NULL;
+        }
+        return;
+    }
+    if (!input_pad_xkb_init (window)) {
+        return;
+    }
+    if (notify) {
+        notify->func = func;
+        return;
+    }
+    xdisplay = GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET (window)));
+    if (keymap_notifies == NULL) {
+        keymap_notify_displays = g_hash_table_new (g_direct_hash,
+                                                   g_direct_equal);
+        gdk_window_add_filter (NULL, (GdkFilterFunc)
+                               on_filter_xkb_keymap_evt, NULL);
+    }
+    notify = g_slice_new0 (XKBKeymapNotify);
+    notify->window = window;
+    notify->xdisplay = xdisplay;
+    notify->func = func;
+    keymap_notifies = g_slist_prepend (keymap_notifies, notify);
+    if (g_hash_table_contains (keymap_notify_displays, xdisplay)) {
+        return;
+    }
+    /* on_filter_xkb_keymap_evt() uses the keysym changes only but
+     * GdkKeymap on the same connection needs the other map changes. */
+    XkbSelectEventDetails (xdisplay, XkbUseCoreKbd, XkbMapNotify,
+                           XkbAllMapComponentsMask, XkbAllMapComponentsMask);
+    XkbSelectEventDetails (xdisplay, XkbUseCoreKbd, XkbNewKeyboardNotify,
+                           XkbAllNewKeyboardEventsMask,
+                           XkbAllNewKeyboardEventsMask);
+    g_hash_table_add (keymap_notify_displays, xdisplay);
+}
+
+void
+input_pad_gdk_xkb_signal_emit (InputPadGtkWindow   *window, guint signal_id)
+{
+    g_return_if_fail (window != NULL && INPUT_PAD_IS_GTK_WINDOW (window));
+
+    xkb_setup_events (window, signal_id);
+}
+
+void
+input_pad_gdk_xkb_get_filter_event_counts (unsigned int *n_receivedp,
+                                           unsigned int *n_forwardedp)
+{
+#ifdef HAVE_LIBXKLAVIER
+    if (n_receivedp) {
+        *n_receivedp = xkl_filter_n_received;
+    }
+    if (n_forwardedp) {
+        *n_forwardedp = xkl_filter_n_forwarded;
+    }
+#else
+    if (n_receivedp) {
+        *n_receivedp = 0;
+    }
+    if (n_forwardedp) {
+        *n_forwardedp = 0;
+    }
+#endif
+}
+
+char **
+input_pad_gdk_xkb_get_group_layouts (InputPadGtkWindow   *window, 
+                                     InputPadXKBKeyList  *xkb_key_list)
+{
+    g_return_val_if_fail (window != NULL && INPUT_PAD_IS_GTK_WINDOW (window),
+                          NULL);
+
+    return xkb_get_group_layouts_from_key (window, xkb_key_list,
                                            XKB_GET_LAYOUTS_KEY);
 }
 
@@ -1277,52 +2325,515 @@ input_pad_gdk_xkb_get_group_options (InputPadGtkWindow   *window,
                                            XKB_GET_OPTIONS_KEY);
 }
 
+#ifdef HAVE_LIBXKLAVIER
+static void
+xkb_config_reg_entry_free (gpointer data)
+{
+    XKBConfigRegEntry *entry = (XKBConfigRegEntry *) data;
+
+    g_free (entry->search_key);
+    g_slice_free (XKBConfigRegEntry, entry);
+}
+
+static char *
+xkb_config_reg_entry_key_new (const char *layout, const char *variant)
+{
+    if (variant == NULL || *variant == '\0') {
+        return g_strdup (layout);
+    }
+    return g_strdup_printf ("%s(%s)", layout, variant);
+}
+
+static void
+xkb_config_reg_add_entry (InputPadXKBConfigReg   *config_reg,
+                          InputPadXKBLayoutList  *layout,
+                          InputPadXKBVariantList *variant)
+{
+    XKBConfigRegEntry *entry;
+    const char *desc = variant ? variant->desc : layout->desc;
+    gchar *key;
+    gchar *text;
+
+    if (desc == NULL) {
+        return;
+    }
+    key = xkb_config_reg_entry_key_new (layout->layout,
+                                        variant ? variant->variant : NULL);
+    if (g_hash_table_contains (config_reg->priv->entries, key)) {
+        g_free (key);
+        return;
+    }
+    entry = g_slice_new0 (XKBConfigRegEntry);
+    entry->layout = layout;
+    entry->variant = variant;
+    /* The filter of the layout list matches the description and
+     * the names so the folded text is prepared here. */
+    if (variant) {
+        text = g_strdup_printf ("%s %s(%s)", desc,
+                                layout->layout, variant->variant);
+    } else {
+        text = g_strdup_printf ("%s %s", desc, layout->layout);
+    }
+    entry->search_key = g_utf8_casefold (text, -1);
+    g_free (text);
+    g_hash_table_insert (config_reg->priv->entries, key, entry);
+}
+
+static void
+xkb_config_reg_build_index (InputPadXKBConfigReg *config_reg)
+{
+    InputPadXKBLayoutList *layouts;
+    InputPadXKBVariantList *variants;
+
+    config_reg->priv = g_new0 (InputPadXKBConfigRegPrivate, 1);
+    config_reg->priv->layouts = g_hash_table_new (g_str_hash, g_str_equal);
+    config_reg->priv->variants = g_hash_table_new_full (g_str_hash,
+                                                        g_str_equal,
+                                                        g_free,
+                                                        NULL);
+    config_reg->priv->entries = g_hash_table_new_full (g_str_hash,
+                                                       g_str_equal,
+                                                       g_free,
+                                                       xkb_config_reg_entry_free);
+    for (layouts = config_reg->layouts; layouts; layouts = layouts->next) {
+        if (layouts->layout == NULL) {
+            continue;
+        }
+        if (!g_hash_table_contains (config_reg->priv->layouts,
+                                    layouts->layout)) {
+            g_hash_table_insert (config_reg->priv->layouts,
+                                 layouts->layout, layouts);
+        }
+        xkb_config_reg_add_entry (config_reg, layouts, NULL);
+        for (variants = layouts->variants; variants;
+             variants = variants->next) {
+            if (variants->variant == NULL) {
+                continue;
+            }
+            g_hash_table_insert (config_reg->priv->variants,
+                                 g_strdup_printf ("%s(%s)",
+                                                  layouts->layout,
+                                                  variants->variant),
+                                 variants);
+            xkb_config_reg_add_entry (config_reg, layouts, variants);
+        }
+    }
+}
+
+/* xkl_config_registry_load() asks the ruleset to the X server
+ * with the engine but the GDK display is not thread safe.
+ * So the rules file is looked up by the caller and only the XML
+ * file is parsed here, which can run on a worker thread. */
+static gchar *
+xkb_config_registry_get_file (InputPadGtkWindow *window)
+{
+    char **rules_names;
+    const char *ruleset = XKB_DEFAULT_RULESET;
+    gchar *file;
+
+    rules_names = xkb_get_rules_names (window);
+    if (rules_names && *rules_names[XKB_RULES_NAMES_RULES] != '\0') {
+        ruleset = rules_names[XKB_RULES_NAMES_RULES];
+    }
+    if (g_path_is_absolute (ruleset)) {
+        file = g_strdup_printf ("%s.xml", ruleset);
+    } else {
+        file = g_strdup_printf ("%s/rules/%s.xml", XKB_BASE, ruleset);
+    }
+    g_strfreev (rules_names);
+    return file;
+}
+
+static xmlNodePtr
+xkb_config_xml_find_child (xmlNodePtr node, const char *name)
+{
+    for (node = node->children; node; node = node->next) {
+        if (node->type == XML_ELEMENT_NODE &&
+            !g_strcmp0 ((const char *) node->name, name)) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static void
+xkb_config_xml_copy_text (xmlNodePtr   node,
+                          const char  *name,
+                          gchar       *buff,
+                          gsize        size,
+                          gboolean     translate)
+{
+    xmlChar *text;
+
+    buff[0] = '\0';
+    if ((node = xkb_config_xml_find_child (node, name)) == NULL) {
+        return;
+    }
+    text = xmlNodeGetContent (node);
+    if (text == NULL) {
+        return;
+    }
+    if (translate && *text != '\0') {
+        g_strlcpy (buff, D_(XKB_CONFIG_DOMAIN, (const char *) text), size);
+    } else {
+        g_strlcpy (buff, (const char *) text, size);
+    }
+    xmlFree (text);
+}
+
+/* Sets the configItem of the layout, variant, group or option node
+ * to item as libxklavier does. */
+static gboolean
+xkb_config_xml_get_item (xmlNodePtr node, XklConfigItem *item)
+{
+    if ((node = xkb_config_xml_find_child (node, "configItem")) == NULL) {
+        return FALSE;
+    }
+    xkb_config_xml_copy_text (node, "name",
+                              item->name, sizeof (item->name), FALSE);
+    xkb_config_xml_copy_text (node, "shortDescription",
+                              item->short_description,
+                              sizeof (item->short_description), TRUE);
+    xkb_config_xml_copy_text (node, "description",
+                              item->description,
+                              sizeof (item->description), TRUE);
+    return (item->name[0] != '\0');
+}
+
+static void
+xkb_config_xml_parse_layouts (xmlNodePtr             layout_list,
+                              InputPadXKBConfigReg **config_regp)
+{
+    xmlNodePtr node, variant_list, variant_node;
+    XklConfigItem *layout = xkl_config_item_new ();
+    XklConfigItem *variant = xkl_config_item_new ();
+
+    for (node = layout_list->children; node; node = node->next) {
+        if (node->type != XML_ELEMENT_NODE ||
+            g_strcmp0 ((const char *) node->name, "layout") ||
+            !xkb_config_xml_get_item (node, layout)) {
+            continue;
+        }
+        if ((variant_list = xkb_config_xml_find_child (node,
+                                                       "variantList")) == NULL) {
+            continue;
+        }
+        for (variant_node = variant_list->children; variant_node;
+             variant_node = variant_node->next) {
+            if (variant_node->type != XML_ELEMENT_NODE ||
+                g_strcmp0 ((const char *) variant_node->name, "variant") ||
+                !xkb_config_xml_get_item (variant_node, variant)) {
+                continue;
+            }
+            if (*config_regp == NULL) {
+                *config_regp = g_new0 (InputPadXKBConfigReg, 1);
+            }
+            if ((*config_regp)->layouts == NULL) {
+                (*config_regp)->layouts = g_new0 (InputPadXKBLayoutList, 1);
+            }
+            input_pad_xkb_layout_list_append_layout_variant ((*config_regp)->layouts,
+                                                            layout,
+                                                            variant);
+        }
+    }
+    g_object_unref (layout);
+    g_object_unref (variant);
+}
+
+static void
+xkb_config_xml_parse_options (xmlNodePtr             option_list,
+                              InputPadXKBConfigReg **config_regp)
+{
+    xmlNodePtr node, option_node;
+    XklConfigItem *group = xkl_config_item_new ();
+    XklConfigItem *option = xkl_config_item_new ();
+
+    for (node = option_list->children; node; node = node->next) {
+        if (node->type != XML_ELEMENT_NODE ||
+            g_strcmp0 ((const char *) node->name, "group") ||
+            !xkb_config_xml_get_item (node, group)) {
+            continue;
+        }
+        for (option_node = node->children; option_node;
+             option_node = option_node->next) {
+            if (option_node->type != XML_ELEMENT_NODE ||
+                g_strcmp0 ((const char *) option_node->name, "option") ||
+                !xkb_config_xml_get_item (option_node, option)) {
+                continue;
+            }
+            if (*config_regp == NULL) {
+                *config_regp = g_new0 (InputPadXKBConfigReg, 1);
+            }
+            if ((*config_regp)->option_groups == NULL) {
+                (*config_regp)->option_groups = g_new0 (InputPadXKBOptionGroupList, 1);
+            }
+            input_pad_xkb_option_group_list_append_group_option ((*config_regp)->option_groups,
+                                                                 group,
+                                                                 option);
+        }
+    }
+    g_object_unref (group);
+    g_object_unref (option);
+}
+
+/* Does not call X so this is called on a worker thread by
+ * input_pad_gdk_xkb_parse_config_registry_async(). */
+static InputPadXKBConfigReg *
+parse_xkb_config_registry_file (const gchar *file)
+{
+    InputPadXKBConfigReg  *config_reg = NULL;
+    xmlDocPtr doc;
+    xmlNodePtr root, node;
+
+    doc = xmlReadFile (file, NULL, XML_PARSE_NONET);
+    if (doc == NULL) {
+        g_warning ("Could not parse %s", file);
+        return NULL;
+    }
+    root = xmlDocGetRootElement (doc);
+    if (root == NULL ||
+        g_strcmp0 ((const char *) root->name, "xkbConfigRegistry")) {
+        g_warning ("%s is not XKB config registry", file);
+        xmlFreeDoc (doc);
+        return NULL;
+    }
+    if ((node = xkb_config_xml_find_child (root, "layoutList")) != NULL) {
+        xkb_config_xml_parse_layouts (node, &config_reg);
+    }
+    if ((node = xkb_config_xml_find_child (root, "optionList")) != NULL) {
+        xkb_config_xml_parse_options (node, &config_reg);
+    }
+    xmlFreeDoc (doc);
+
+    if (config_reg) {
+        xkb_config_reg_build_index (config_reg);
+        debug_print_layout_list (config_reg->layouts);
+        debug_print_option_group_list (config_reg->option_groups);
+    }
+    return config_reg;
+}
+
+static void
+parse_config_registry_thread (GTask        *task,
+                              gpointer      source_object,
+                              gpointer      task_data,
+                              GCancellable *cancellable)
+{
+    const gchar *file = (const gchar *) task_data;
+
+    if (g_task_return_error_if_cancelled (task)) {
+        return;
+    }
+    g_task_return_pointer (task,
+                           parse_xkb_config_registry_file (file),
+                           (GDestroyNotify) input_pad_gdk_xkb_destroy_config_registry);
+}
+#endif
+
 InputPadXKBConfigReg *
 input_pad_gdk_xkb_parse_config_registry (InputPadGtkWindow   *window,
                                          InputPadXKBKeyList  *xkb_key_list)
 {
 #ifdef HAVE_LIBXKLAVIER
-    InputPadXKBConfigReg  *config_reg = NULL;
-    XklConfigRegistry *xklconfig_registry;
+    InputPadXKBConfigReg *config_reg;
+    gchar *file;
 
     g_return_val_if_fail (window != NULL && INPUT_PAD_IS_GTK_WINDOW (window), NULL);
 
     if (xklengine == NULL) {
         xklengine = init_xkl_engine (window, &initial_xkl_rec, &initial_group);
     }
-    xklconfig_registry = init_xkl_config_registry (window);
-    get_reg_layout_with_xkl_config_registry (&config_reg,
-                                             xklconfig_registry);
-    get_reg_option_with_xkl_config_registry (&config_reg,
-                                             xklconfig_registry);
-
-    debug_print_layout_list (config_reg->layouts);
-    debug_print_option_group_list (config_reg->option_groups);
+    file = xkb_config_registry_get_file (window);
+    config_reg = parse_xkb_config_registry_file (file);
+    g_free (file);
     return config_reg;
 #else
     return NULL;
 #endif
 }
 
-Bool
-input_pad_gdk_xkb_set_layout (InputPadGtkWindow        *window,
-                              InputPadXKBKeyList       *xkb_key_list,
-                              const char               *layouts,
-                              const char               *variants,
-                              const char               *options)
+/* The XKB engine and the rules file are looked up on the caller thread
+ * and the XML file is parsed on a worker thread. */
+void
+input_pad_gdk_xkb_parse_config_registry_async (InputPadGtkWindow   *window,
+                                               InputPadXKBKeyList  *xkb_key_list,
+                                               GCancellable        *cancellable,
+                                               GAsyncReadyCallback  callback,
+                                               gpointer             user_data)
+{
+    GTask *task;
+
+    g_return_if_fail (window != NULL && INPUT_PAD_IS_GTK_WINDOW (window));
+
+    task = g_task_new (window, cancellable, callback, user_data);
+    g_task_set_source_tag (task,
+                           input_pad_gdk_xkb_parse_config_registry_async);
+#ifdef HAVE_LIBXKLAVIER
+    if (xklengine == NULL) {
+        xklengine = init_xkl_engine (window, &initial_xkl_rec, &initial_group);
+    }
+    g_task_set_task_data (task,
+                          xkb_config_registry_get_file (window),
+                          g_free);
+    g_task_run_in_thread (task, parse_config_registry_thread);
+#else
+    g_task_return_pointer (task, NULL, NULL);
+#endif
+    g_object_unref (task);
+}
+
+InputPadXKBConfigReg *
+input_pad_gdk_xkb_parse_config_registry_finish (InputPadGtkWindow   *window,
+                                                GAsyncResult        *result,
+                                                GError             **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, window), NULL);
+
+    return (InputPadXKBConfigReg *) g_task_propagate_pointer (G_TASK (result),
+                                                              error);
+}
+
+void
+input_pad_gdk_xkb_destroy_config_registry (InputPadXKBConfigReg *config_reg)
+{
+    InputPadXKBLayoutList *layouts, *next_layout;
+    InputPadXKBVariantList *variants, *next_variant;
+    InputPadXKBOptionGroupList *groups, *next_group;
+    InputPadXKBOptionList *options, *next_option;
+
+    if (config_reg == NULL) {
+        return;
+    }
+    /* The indexes point to the lists so they are destroyed first. */
+    if (config_reg->priv) {
+        g_hash_table_destroy (config_reg->priv->layouts);
+        g_hash_table_destroy (config_reg->priv->variants);
+        g_hash_table_destroy (config_reg->priv->entries);
+        g_free (config_reg->priv);
+    }
+    for (layouts = config_reg->layouts; layouts; layouts = next_layout) {
+        next_layout = layouts->next;
+        for (variants = layouts->variants; variants; variants = next_variant) {
+            next_variant = variants->next;
+            g_free (variants->variant);
+            g_free (variants->desc);
+            g_free (variants);
+        }
+        g_free (layouts->layout);
+        g_free (layouts->desc);
+        g_free (layouts);
+    }
+    for (groups = config_reg->option_groups; groups; groups = next_group) {
+        next_group = groups->next;
+        for (options = groups->options; options; options = next_option) {
+            next_option = options->next;
+            g_free (options->option);
+            g_free (options->desc);
+            g_free (options);
+        }
+        g_free (groups->option_group);
+        g_free (groups->desc);
+        g_free (groups);
+    }
+    g_free (config_reg);
+}
+
+InputPadXKBLayoutList *
+input_pad_gdk_xkb_config_reg_lookup_layout (InputPadXKBConfigReg *config_reg,
+                                            const char           *layout)
+{
+    g_return_val_if_fail (config_reg != NULL, NULL);
+
+    if (layout == NULL || config_reg->priv == NULL) {
+        return NULL;
+    }
+    return (InputPadXKBLayoutList *) g_hash_table_lookup (config_reg->priv->layouts,
+                                                          layout);
+}
+
+InputPadXKBVariantList *
+input_pad_gdk_xkb_config_reg_lookup_variant (InputPadXKBConfigReg *config_reg,
+                                             const char           *layout,
+                                             const char           *variant)
 {
+    InputPadXKBVariantList *retval;
+    gchar *key;
+
+    g_return_val_if_fail (config_reg != NULL, NULL);
+
+    if (layout == NULL || variant == NULL || config_reg->priv == NULL) {
+        return NULL;
+    }
+    key = g_strdup_printf ("%s(%s)", layout, variant);
+    retval = (InputPadXKBVariantList *) g_hash_table_lookup (config_reg->priv->variants,
+                                                             key);
+    g_free (key);
+    return retval;
+}
+
+/* Returns the case folded description and names of the layout
+ * or the variant for the search. */
+const char *
+input_pad_gdk_xkb_config_reg_get_search_key (InputPadXKBConfigReg *config_reg,
+                                             const char           *layout,
+                                             const char           *variant)
+{
+    XKBConfigRegEntry *entry;
+    gchar *key;
+
+    g_return_val_if_fail (config_reg != NULL, NULL);
+
+    if (layout == NULL || config_reg->priv == NULL) {
+        return NULL;
+    }
+    key = xkb_config_reg_entry_key_new (layout, variant);
+    entry = (XKBConfigRegEntry *) g_hash_table_lookup (config_reg->priv->entries,
+                                                       key);
+    g_free (key);
+    return entry ? entry->search_key : NULL;
+}
+
 #ifdef HAVE_LIBXKLAVIER
+/* True after a config other than initial_xkl_rec is activated. */
+static gboolean xkl_rec_modified = FALSE;
+
+/* Returns the config to activate or NULL if the keymap does not need
+ * to be changed. *groupp is the group to lock or -1. */
+static XklConfigRec *
+xkl_config_rec_new_for_layout (const char *layouts,
+                               const char *variants,
+                               const char *options,
+                               int        *groupp)
+{
     XklConfigRec *xkl_rec;
     XklState *state;
+    XklState win_state;
     int layout_index = -1;
 
-    g_return_val_if_fail (initial_xkl_rec != NULL, FALSE);
-    g_return_val_if_fail (xklengine != NULL, FALSE);
-
+    *groupp = -1;
     if (layouts == NULL && variants == NULL && options == NULL) {
-        xkl_config_rec_activate (initial_xkl_rec, xklengine);
-        xkl_engine_lock_group (xklengine, initial_group);
-        return TRUE;
+        *groupp = initial_group;
+        return g_object_ref (initial_xkl_rec);
+    }
+
+    if (initial_xkl_rec->layouts != NULL) {
+        layout_index = find_layouts_index (initial_xkl_rec->layouts, layouts,
+                                           initial_xkl_rec->variants, variants);
+    }
+    /* The layout is one of the groups of the session keymap so only
+     * the group is locked and the server does not send XkbMapNotify. */
+    if (layout_index >= 0 && options == NULL && !xkl_rec_modified) {
+        if (xkl_engine_get_state (xklengine,
+                                  xkl_engine_get_current_window (xklengine),
+                                  &win_state)) {
+            state = &win_state;
+        } else {
+            state = xkl_engine_get_current_state (xklengine);
+        }
+        if (state->group != layout_index) {
+            *groupp = layout_index;
+        }
+        return NULL;
     }
 
     xkl_rec = xkl_config_rec_new ();
@@ -1330,23 +2841,7 @@ input_pad_gdk_xkb_set_layout (InputPadGtkWindow        *window,
                       g_strdup (initial_xkl_rec->model) :
                       g_strdup ("pc105");
     if (initial_xkl_rec->layouts != NULL) {
-        layout_index = find_layouts_index (initial_xkl_rec->layouts, layouts,
-                                           initial_xkl_rec->variants, variants);
         if (layout_index >= 0) {
-            XklState win_state;
-            if (xkl_engine_get_state (xklengine,
-                                      xkl_engine_get_current_window (xklengine),
-                                      &win_state)) {
-                state = &win_state;
-            } else {
-                state = xkl_engine_get_current_state (xklengine);
-            }
-            if (state->group == layout_index && options == NULL) {
-                g_free (xkl_rec->model);
-                xkl_rec->model = NULL;
-                g_object_unref (xkl_rec);
-                return TRUE;
-            }
             xkl_rec->layouts = g_strdupv (initial_xkl_rec->layouts);
             if (initial_xkl_rec->variants) {
                 xkl_rec->variants = g_strdupv (initial_xkl_rec->variants);
@@ -1372,23 +2867,145 @@ input_pad_gdk_xkb_set_layout (InputPadGtkWindow        *window,
     } else {
         xkl_rec->options = g_strsplit (options , ",", -1);
     }
+    *groupp = (layout_index >= 0) ? layout_index : 0;
+    return xkl_rec;
+}
+
+static void
+xkl_config_rec_activated (XklConfigRec *xkl_rec, int group)
+{
+    if (xkl_rec != NULL) {
+        xkl_rec_modified = (xkl_rec != initial_xkl_rec);
+    }
+    if (group >= 0) {
+        xkl_engine_lock_group (xklengine, group);
+    }
+}
+
+/* setxkbmap compiles and uploads the keymap and sets _XKB_RULES_NAMES
+ * as xkl_config_rec_activate() does but in the other process so that
+ * the main loop does not wait for the compile. */
+static GSubprocess *
+xkl_config_rec_spawn_setxkbmap (XklConfigRec *xkl_rec,
+                                Display      *xdisplay,
+                                GError      **error)
+{
+    GSubprocessLauncher *launcher;
+    GSubprocess *subprocess;
+    GPtrArray *argv;
+    gchar *value;
+
+    argv = g_ptr_array_new_with_free_func (g_free);
+    g_ptr_array_add (argv, g_strdup ("setxkbmap"));
+    if (xkl_rec->model) {
+        g_ptr_array_add (argv, g_strdup ("-model"));
+        g_ptr_array_add (argv, g_strdup (xkl_rec->model));
+    }
+    if (xkl_rec->layouts) {
+        g_ptr_array_add (argv, g_strdup ("-layout"));
+        g_ptr_array_add (argv, g_strjoinv (",", xkl_rec->layouts));
+    }
+    g_ptr_array_add (argv, g_strdup ("-variant"));
+    value = xkl_rec->variants ? g_strjoinv (",", xkl_rec->variants) : NULL;
+    g_ptr_array_add (argv, value ? value : g_strdup (""));
+    /* The empty -option clears the current options. */
+    g_ptr_array_add (argv, g_strdup ("-option"));
+    g_ptr_array_add (argv, g_strdup (""));
+    if (xkl_rec->options && xkl_rec->options[0]) {
+        g_ptr_array_add (argv, g_strdup ("-option"));
+        g_ptr_array_add (argv, g_strjoinv (",", xkl_rec->options));
+    }
+    g_ptr_array_add (argv, NULL);
+
+    launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_SILENCE |
+                                          G_SUBPROCESS_FLAGS_STDERR_SILENCE);
+    g_subprocess_launcher_setenv (launcher, "DISPLAY",
+                                  DisplayString (xdisplay), TRUE);
+    subprocess = g_subprocess_launcher_spawnv (launcher,
+                                               (const gchar * const *) argv->pdata,
+                                               error);
+    g_object_unref (launcher);
+    g_ptr_array_free (argv, TRUE);
+    return subprocess;
+}
+
+typedef struct _XKBSetLayoutData XKBSetLayoutData;
+
+struct _XKBSetLayoutData {
+    XklConfigRec         *xkl_rec;
+    int                   group;
+};
+
+static void
+xkb_set_layout_data_free (XKBSetLayoutData *data)
+{
+    g_object_unref (data->xkl_rec);
+    g_slice_free (XKBSetLayoutData, data);
+}
+
+static void
+on_setxkbmap_exited (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+    GTask *task = G_TASK (user_data);
+    XKBSetLayoutData *data = (XKBSetLayoutData *) g_task_get_task_data (task);
+    GError *error = NULL;
+
+    if (!g_subprocess_wait_check_finish (G_SUBPROCESS (source),
+                                         result, &error)) {
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_task_return_error (task, error);
+            g_object_unref (task);
+            return;
+        }
+        g_warning ("Could not run setxkbmap: %s", error->message);
+        g_error_free (error);
+        xkl_config_rec_activate (data->xkl_rec, xklengine);
+    }
+    xkl_config_rec_activated (data->xkl_rec, data->group);
+    g_task_return_int (task, TRUE);
+    g_object_unref (task);
+}
+#endif
+
+static Bool
+xkb_set_layout (InputPadGtkWindow        *window,
+                InputPadXKBKeyList       *xkb_key_list,
+                const char               *layouts,
+                const char               *variants,
+                const char               *options,
+                gboolean                 *keymap_changedp)
+{
+#ifdef HAVE_LIBXKLAVIER
+    XklConfigRec *xkl_rec;
+    int group = -1;
 
+    g_return_val_if_fail (initial_xkl_rec != NULL, FALSE);
+    g_return_val_if_fail (xklengine != NULL, FALSE);
+
+    *keymap_changedp = FALSE;
+    xkl_rec = xkl_config_rec_new_for_layout (layouts, variants, options,
+                                             &group);
+    if (xkl_rec == NULL) {
+        xkl_config_rec_activated (NULL, group);
+        return TRUE;
+    }
     xkl_config_rec_activate (xkl_rec, xklengine);
+    xkl_config_rec_activated (xkl_rec, group);
     g_object_unref (xkl_rec);
-    if (layout_index >= 0) {
-        xkl_engine_lock_group (xklengine, layout_index);
-    } else {
-        xkl_engine_lock_group (xklengine, 0);
-    }
+    *keymap_changedp = TRUE;
 #else
     Display *xdisplay;
     guint group;
     gchar **group_layouts;
 
     g_return_val_if_fail (window != NULL &&
-                          INPUT_PAD_IS_GTK_WINDOW (window), NULL);
+                          INPUT_PAD_IS_GTK_WINDOW (window), FALSE);
     g_return_val_if_fail (layouts != NULL, FALSE);
 
+    /* Only _XKB_RULES_NAMES is changed so no keymap notify comes. */
+    *keymap_changedp = FALSE;
     xdisplay = GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET(window)));
     group = xkb_get_current_group (window);
     group_layouts = input_pad_gdk_xkb_get_group_layouts (window, 
@@ -1405,3 +3022,120 @@ input_pad_gdk_xkb_set_layout (InputPadGtkWindow        *window,
 
     return TRUE;
 }
+
+Bool
+input_pad_gdk_xkb_set_layout (InputPadGtkWindow        *window,
+                              InputPadXKBKeyList       *xkb_key_list,
+                              const char               *layouts,
+                              const char               *variants,
+                              const char               *options)
+{
+    InputPadXStatsScope scope;
+    gboolean keymap_changed = FALSE;
+    Bool retval;
+
+    input_pad_gdk_xstats_scope_begin (&scope,
+                                      INPUT_PAD_XSTATS_OP_LAYOUT_SWITCH);
+    retval = xkb_set_layout (window, xkb_key_list,
+                             layouts, variants, options, &keymap_changed);
+    input_pad_gdk_xstats_scope_end (&scope);
+    return retval;
+}
+
+/* The keymap is compiled by setxkbmap without blocking the main loop.
+ * The result of input_pad_gdk_xkb_set_layout_finish() tells if
+ * the keymap is changed. If not, e.g. only the group is locked,
+ * XkbMapNotify is not sent. */
+void
+input_pad_gdk_xkb_set_layout_async (InputPadGtkWindow   *window,
+                                    InputPadXKBKeyList  *xkb_key_list,
+                                    const char          *layouts,
+                                    const char          *variants,
+                                    const char          *options,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
+    GTask *task;
+    InputPadXStatsScope scope;
+    gboolean keymap_changed = FALSE;
+#ifdef HAVE_LIBXKLAVIER
+    XklConfigRec *xkl_rec;
+    XKBSetLayoutData *data;
+    Display *xdisplay;
+    GSubprocess *subprocess;
+    GError *error = NULL;
+    int group = -1;
+#endif
+
+    g_return_if_fail (window != NULL && INPUT_PAD_IS_GTK_WINDOW (window));
+
+    task = g_task_new (window, cancellable, callback, user_data);
+    g_task_set_source_tag (task, input_pad_gdk_xkb_set_layout_async);
+    input_pad_gdk_xstats_scope_begin (&scope,
+                                      INPUT_PAD_XSTATS_OP_LAYOUT_SWITCH);
+#ifdef HAVE_LIBXKLAVIER
+    if (initial_xkl_rec == NULL || xklengine == NULL) {
+        input_pad_gdk_xstats_scope_end (&scope);
+        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED,
+                                 "The XKB engine is not initialized");
+        g_object_unref (task);
+        return;
+    }
+    xkl_rec = xkl_config_rec_new_for_layout (layouts, variants, options,
+                                             &group);
+    if (xkl_rec != NULL) {
+        xdisplay = GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET (window)));
+        subprocess = xkl_config_rec_spawn_setxkbmap (xkl_rec, xdisplay,
+                                                     &error);
+        if (subprocess != NULL) {
+            data = g_slice_new0 (XKBSetLayoutData);
+            data->xkl_rec = xkl_rec;
+            data->group = group;
+            g_task_set_task_data (task, data,
+                                  (GDestroyNotify) xkb_set_layout_data_free);
+            g_subprocess_wait_check_async (subprocess, cancellable,
+                                           on_setxkbmap_exited, task);
+            g_object_unref (subprocess);
+            input_pad_gdk_xstats_scope_end (&scope);
+            return;
+        }
+        g_warning ("Could not run setxkbmap: %s", error->message);
+        g_error_free (error);
+        xkl_config_rec_activate (xkl_rec, xklengine);
+        xkl_config_rec_activated (xkl_rec, group);
+        g_object_unref (xkl_rec);
+        keymap_changed = TRUE;
+    } else {
+        xkl_config_rec_activated (NULL, group);
+    }
+#else
+    xkb_set_layout (window, xkb_key_list, layouts, variants, options,
+                    &keymap_changed);
+#endif
+    input_pad_gdk_xstats_scope_end (&scope);
+    g_task_return_int (task, keymap_changed);
+    g_object_unref (task);
+}
+
+gboolean
+input_pad_gdk_xkb_set_layout_finish (InputPadGtkWindow   *window,
+                                     GAsyncResult        *result,
+                                     gboolean            *keymap_changedp,
+                                     GError             **error)
+{
+    GError *task_error = NULL;
+    gssize retval;
+
+    g_return_val_if_fail (g_task_is_valid (result, window), FALSE);
+
+    retval = g_task_propagate_int (G_TASK (result), &task_error);
+    if (task_error != NULL) {
+        g_propagate_error (error, task_error);
+        return FALSE;
+    }
+    if (keymap_changedp) {
+        *keymap_changedp = (retval != 0);
+    }
+    return TRUE;
+}
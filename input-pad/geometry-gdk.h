@@ -25,14 +25,62 @@
 #include "input-pad-window-gtk.h"
 #include "geometry-xkb.h"
 
+typedef void (*InputPadXKBKeymapNotifyFunc) (InputPadGtkWindow *window,
+                                             unsigned int       first_keycode,
+                                             unsigned int       n_keycodes,
+                                             gboolean           new_keyboard);
+
 void                    input_pad_gdk_xkb_destroy_keyboard_layouts
                                         (InputPadGtkWindow     *window,
                                          InputPadXKBKeyList    *xkb_key_list);
 InputPadXKBKeyList *    input_pad_gdk_xkb_parse_keyboard_layouts
                                         (InputPadGtkWindow     *window);
+unsigned int            input_pad_gdk_xkb_key_list_get_n_keys
+                                        (InputPadXKBKeyList    *xkb_key_list);
+InputPadXKBKeyRow *     input_pad_gdk_xkb_key_list_get_nth_key
+                                        (InputPadXKBKeyList    *xkb_key_list,
+                                         unsigned int           nth);
+unsigned int            input_pad_gdk_xkb_key_list_get_keysym
+                                        (InputPadXKBKeyList    *xkb_key_list,
+                                         unsigned int           nth,
+                                         unsigned int           group,
+                                         unsigned int           level);
+gboolean                input_pad_gdk_xkb_key_list_lookup_keysym
+                                        (InputPadXKBKeyList    *xkb_key_list,
+                                         unsigned int           keysym,
+                                         unsigned int           group,
+                                         unsigned int          *keycodep,
+                                         unsigned int          *statep);
+gboolean                input_pad_gdk_xkb_key_list_lookup_unicode
+                                        (InputPadXKBKeyList    *xkb_key_list,
+                                         gunichar               ch,
+                                         unsigned int           group,
+                                         unsigned int          *keycodep,
+                                         unsigned int          *keysymp,
+                                         unsigned int          *statep);
+InputPadXKBKeyList *    input_pad_gdk_xkb_compile_keyboard_layouts
+                                        (InputPadXKBKeyList    *xkb_key_list,
+                                         const char            *layouts,
+                                         const char            *variants,
+                                         const char            *options);
+Bool                    input_pad_gdk_xkb_key_list_geometry_changed
+                                        (InputPadGtkWindow     *window,
+                                         InputPadXKBKeyList    *xkb_key_list);
+Bool                    input_pad_gdk_xkb_key_list_update_keysyms
+                                        (InputPadGtkWindow     *window,
+                                         InputPadXKBKeyList    *xkb_key_list,
+                                         unsigned int           first_keycode,
+                                         unsigned int           n_keycodes);
+void                    input_pad_gdk_xkb_set_keymap_notify
+                                        (InputPadGtkWindow     *window,
+                                         InputPadXKBKeymapNotifyFunc
+                                                                func);
 void                    input_pad_gdk_xkb_signal_emit
                                         (InputPadGtkWindow     *window,
                                          guint                  signal_id);
+void                    input_pad_gdk_xkb_get_filter_event_counts
+                                        (unsigned int          *n_receivedp,
+                                         unsigned int          *n_forwardedp);
 char **                 input_pad_gdk_xkb_get_group_layouts
                                         (InputPadGtkWindow     *window,
                                          InputPadXKBKeyList    *xkb_key_list);
@@ -45,10 +93,48 @@ char **                 input_pad_gdk_xkb_get_group_options
 InputPadXKBConfigReg *  input_pad_gdk_xkb_parse_config_registry
                                         (InputPadGtkWindow     *window,
                                          InputPadXKBKeyList    *xkb_key_list);
+void                    input_pad_gdk_xkb_parse_config_registry_async
+                                        (InputPadGtkWindow     *window,
+                                         InputPadXKBKeyList    *xkb_key_list,
+                                         GCancellable          *cancellable,
+                                         GAsyncReadyCallback    callback,
+                                         gpointer               user_data);
+InputPadXKBConfigReg *  input_pad_gdk_xkb_parse_config_registry_finish
+                                        (InputPadGtkWindow     *window,
+                                         GAsyncResult          *result,
+                                         GError               **error);
+void                    input_pad_gdk_xkb_destroy_config_registry
+                                        (InputPadXKBConfigReg  *config_reg);
+InputPadXKBLayoutList * input_pad_gdk_xkb_config_reg_lookup_layout
+                                        (InputPadXKBConfigReg  *config_reg,
+                                         const char            *layout);
+InputPadXKBVariantList *
+                        input_pad_gdk_xkb_config_reg_lookup_variant
+                                        (InputPadXKBConfigReg  *config_reg,
+                                         const char            *layout,
+                                         const char            *variant);
+const char *            input_pad_gdk_xkb_config_reg_get_search_key
+                                        (InputPadXKBConfigReg  *config_reg,
+                                         const char            *layout,
+                                         const char            *variant);
 Bool                    input_pad_gdk_xkb_set_layout
                                         (InputPadGtkWindow     *window,
                                          InputPadXKBKeyList    *xkb_key_list,
                                          const char            *layouts,
                                          const char            *variants,
                                          const char            *options);
+void                    input_pad_gdk_xkb_set_layout_async
+                                        (InputPadGtkWindow     *window,
+                                         InputPadXKBKeyList    *xkb_key_list,
+                                         const char            *layouts,
+                                         const char            *variants,
+                                         const char            *options,
+                                         GCancellable          *cancellable,
+                                         GAsyncReadyCallback    callback,
+                                         gpointer               user_data);
+gboolean                input_pad_gdk_xkb_set_layout_finish
+                                        (InputPadGtkWindow     *window,
+                                         GAsyncResult          *result,
+                                         gboolean              *keymap_changedp,
+                                         GError               **error);
 #endif
@@ -44,6 +44,9 @@ typedef struct _InputPadXKBOptionGroupListPrivate  InputPadXKBOptionGroupListPri
 typedef struct _InputPadXKBOptionList  InputPadXKBOptionList;
 typedef struct _InputPadXKBOptionListPrivate  InputPadXKBOptionListPrivate;
 
+/* The key rows and the row list are the views of the flat arrays which
+ * are created by input_pad_gdk_xkb_parse_keyboard_layouts() and
+ * the elements cannot be freed or relinked separately. */
 struct _InputPadXKBKeyRow {
     KeyCode                     keycode;
     char                       *name;
@@ -0,0 +1,305 @@
+/* vim:set et sts=4: */
+/* input-pad - The input pad
+ * Copyright (C) 2010-2012 Takao Fujiwara <takao.fujiwara1@gmail.com>
+ * Copyright (C) 2010-2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <stdlib.h> /* qsort */
+#include <string.h> /* strcmp */
+
+#include "input-pad-group.h"
+
+/* Each word maps to a sorted list of entry ids and the words are
+ * also kept in a sorted array so that a query word is matched as
+ * a prefix with a binary search instead of scanning all the tables. */
+struct _InputPadGroupIndex {
+    GHashTable                 *words;
+    char                      **sorted_words;
+    unsigned int                n_words;
+    GArray                     *entries;
+};
+
+static void
+free_posting (gpointer data)
+{
+    g_array_free ((GArray *) data, TRUE);
+}
+
+static int
+cmp_word (const void *a, const void *b)
+{
+    return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+static void
+index_add_word (InputPadGroupIndex *group_index,
+                const gchar        *word,
+                gssize              len,
+                guint               id)
+{
+    GArray *posting;
+    gchar *folded;
+
+    folded = g_utf8_casefold (word, len);
+    posting = (GArray *) g_hash_table_lookup (group_index->words, folded);
+    if (posting == NULL) {
+        posting = g_array_new (FALSE, FALSE, sizeof (guint));
+        g_hash_table_insert (group_index->words, folded, posting);
+    } else {
+        g_free (folded);
+        /* Entries are added in order so a duplicated word in the same
+         * entry is always at the tail. */
+        if (posting->len > 0 &&
+            g_array_index (posting, guint, posting->len - 1) == id) {
+            return;
+        }
+    }
+    g_array_append_val (posting, id);
+}
+
+static void
+index_add_text (InputPadGroupIndex *group_index,
+                const gchar        *text,
+                guint               id)
+{
+    const gchar *p;
+    const gchar *start = NULL;
+    gunichar ch;
+
+    if (text == NULL || !g_utf8_validate (text, -1, NULL)) {
+        return;
+    }
+    for (p = text; *p; p = g_utf8_next_char (p)) {
+        ch = g_utf8_get_char (p);
+        if (g_unichar_isalnum (ch)) {
+            if (start == NULL) {
+                start = p;
+            }
+            continue;
+        }
+        if (start) {
+            index_add_word (group_index, start, p - start, id);
+            start = NULL;
+        }
+        /* Symbol labels, e.g. emoji, are searchable by themselves. */
+        if (!g_unichar_isspace (ch) && !g_unichar_ispunct (ch)) {
+            index_add_word (group_index, p, g_utf8_next_char (p) - p, id);
+        }
+    }
+    if (start) {
+        index_add_word (group_index, start, p - start, id);
+    }
+}
+
+static void
+index_add_entry (InputPadGroupIndex    *group_index,
+                 InputPadGroup         *group,
+                 InputPadTable         *table,
+                 int                    nth)
+{
+    InputPadGroupIndexHit entry;
+    guint id = group_index->entries->len;
+
+    entry.group = group;
+    entry.table = table;
+    entry.nth = nth;
+    g_array_append_val (group_index->entries, entry);
+
+    if (table->type == INPUT_PAD_TABLE_TYPE_STRINGS) {
+        index_add_text (group_index, table->data.strs[nth].label, id);
+        index_add_text (group_index, table->data.strs[nth].comment, id);
+        index_add_text (group_index, table->data.strs[nth].rawtext, id);
+    } else if (table->type == INPUT_PAD_TABLE_TYPE_COMMANDS) {
+        if (table->data.cmds[nth].label) {
+            index_add_text (group_index, table->data.cmds[nth].label, id);
+        } else {
+            index_add_text (group_index, table->data.cmds[nth].execl, id);
+        }
+    }
+}
+
+static unsigned int
+index_lower_bound (InputPadGroupIndex *group_index, const char *word)
+{
+    unsigned int lo = 0;
+    unsigned int hi = group_index->n_words;
+    unsigned int mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp (group_index->sorted_words[mid], word) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+InputPadGroupIndex *
+input_pad_group_index_new (InputPadGroup *group_data)
+{
+    InputPadGroupIndex *group_index;
+    InputPadGroup *group;
+    InputPadTable *table;
+    GHashTableIter iter;
+    gpointer key;
+    unsigned int i;
+    int j;
+
+    group_index = g_new0 (InputPadGroupIndex, 1);
+    group_index->words = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, free_posting);
+    group_index->entries = g_array_new (FALSE, FALSE,
+                                        sizeof (InputPadGroupIndexHit));
+
+    for (group = group_data; group; group = group->next) {
+        for (table = group->table; table; table = table->next) {
+            if (table->type == INPUT_PAD_TABLE_TYPE_STRINGS &&
+                table->data.strs) {
+                for (j = 0; table->data.strs[j].label; j++) {
+                    index_add_entry (group_index, group, table, j);
+                }
+            } else if (table->type == INPUT_PAD_TABLE_TYPE_COMMANDS &&
+                       table->data.cmds) {
+                for (j = 0; table->data.cmds[j].execl; j++) {
+                    index_add_entry (group_index, group, table, j);
+                }
+            }
+        }
+    }
+
+    group_index->n_words = g_hash_table_size (group_index->words);
+    group_index->sorted_words = g_new0 (char *, group_index->n_words + 1);
+    i = 0;
+    g_hash_table_iter_init (&iter, group_index->words);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        group_index->sorted_words[i++] = (char *) key;
+    }
+    qsort (group_index->sorted_words, group_index->n_words,
+           sizeof (char *), cmp_word);
+
+    return group_index;
+}
+
+InputPadGroupIndexHit *
+input_pad_group_index_query (InputPadGroupIndex    *group_index,
+                             const char            *query,
+                             int                    max_hits)
+{
+    InputPadGroupIndexHit *retval;
+    GArray *posting;
+    gchar **words;
+    gchar *folded;
+    guint *matched;
+    guint *stamp;
+    unsigned int i, k;
+    int j, n_words, n_hits;
+    guint id;
+
+    g_return_val_if_fail (group_index != NULL, NULL);
+
+    if (query == NULL || !g_utf8_validate (query, -1, NULL)) {
+        return NULL;
+    }
+    folded = g_utf8_casefold (query, -1);
+    words = g_strsplit_set (folded, " \t\n", -1);
+    g_free (folded);
+
+    /* matched[id] counts the query words which hit the entry and
+     * stamp[id] avoids to count a query word twice via two index words. */
+    matched = g_new0 (guint, group_index->entries->len + 1);
+    stamp = g_new0 (guint, group_index->entries->len + 1);
+    n_words = 0;
+    for (j = 0; words[j]; j++) {
+        if (*words[j] == '\0') {
+            continue;
+        }
+        n_words++;
+        for (i = index_lower_bound (group_index, words[j]);
+             i < group_index->n_words &&
+             g_str_has_prefix (group_index->sorted_words[i], words[j]);
+             i++) {
+            posting = (GArray *) g_hash_table_lookup (group_index->words,
+                                                      group_index->sorted_words[i]);
+            for (k = 0; k < posting->len; k++) {
+                id = g_array_index (posting, guint, k);
+                if (stamp[id] == (guint) n_words) {
+                    continue;
+                }
+                stamp[id] = n_words;
+                matched[id]++;
+            }
+        }
+    }
+    g_strfreev (words);
+
+    if (n_words == 0) {
+        g_free (matched);
+        g_free (stamp);
+        return NULL;
+    }
+
+    n_hits = 0;
+    for (i = 0; i < group_index->entries->len; i++) {
+        if (matched[i] == (guint) n_words) {
+            n_hits++;
+        }
+    }
+    if (max_hits > 0 && n_hits > max_hits) {
+        n_hits = max_hits;
+    }
+    retval = g_new0 (InputPadGroupIndexHit, n_hits + 1);
+    for (i = 0, j = 0; i < group_index->entries->len && j < n_hits; i++) {
+        if (matched[i] == (guint) n_words) {
+            retval[j++] = g_array_index (group_index->entries,
+                                         InputPadGroupIndexHit, i);
+        }
+    }
+    g_free (matched);
+    g_free (stamp);
+
+    return retval;
+}
+
+void
+input_pad_group_index_free_hits (InputPadGroupIndexHit *hits)
+{
+    g_free (hits);
+}
+
+void
+input_pad_group_index_destroy (InputPadGroupIndex *group_index)
+{
+    if (group_index == NULL) {
+        return;
+    }
+    /* The words are owned by the hash table. */
+    g_free (group_index->sorted_words);
+    group_index->sorted_words = NULL;
+    g_hash_table_destroy (group_index->words);
+    group_index->words = NULL;
+    g_array_free (group_index->entries, TRUE);
+    group_index->entries = NULL;
+    g_free (group_index);
+}
@@ -0,0 +1,545 @@
+/* vim:set et sts=4: */
+/* input-pad - The input pad
+ * Copyright (C) 2010-2014 Takao Fujiwara <takao.fujiwara1@gmail.com>
+ * Copyright (C) 2010-2014 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+/* Measures how fast the key events of the "button-pressed" signal
+ * reach another client.
+ *
+ *   % make input-pad-benchmark
+ *   % ./input-pad-benchmark [--count=COUNT] [--display=DISPLAY]
+ *
+ * A new Xvfb is started unless --display is given and the benchmark
+ * is run once for XSendEvent and once for the XTEST module in child
+ * processes because the path is chosen in input_pad_window_init().
+ * The XTEST path needs the installed XTEST module. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gtk/gtk.h>
+#include <gdk/gdkx.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <signal.h> /* kill */
+#include <string.h> /* strcmp */
+#include <unistd.h> /* read */
+
+#include "input-pad.h"
+#include "input-pad-group.h"
+#include "input-pad-window-gtk.h"
+#include "xstats-gdk.h"
+
+#define BENCHMARK_COUNT_DEFAULT 200
+#define BENCHMARK_TIMEOUT (2 * G_TIME_SPAN_SECOND)
+#define BENCHMARK_STRING "thequickbrownfoxjumpsoverthelazydog" \
+                         "packmyboxwithfivedozenliquorjugs"
+
+typedef struct _BenchmarkCase BenchmarkCase;
+typedef struct _Receiver Receiver;
+
+struct _BenchmarkCase {
+    const gchar                *name;
+    const gchar                *str;
+    guint                       type;
+    guint                       keysym;
+    guint                       state;
+    gboolean                    xtest_only;
+};
+
+/* The receiver is another X client and records the time of each
+ * KeyPress except the modifier keys. */
+struct _Receiver {
+    Display                    *display;
+    Window                      window;
+    Atom                        quit_atom;
+    GThread                    *thread;
+    GMutex                      mutex;
+    GCond                       cond;
+    GArray                     *times;
+};
+
+static const BenchmarkCase benchmark_cases[] = {
+    { "char", "a", INPUT_PAD_TABLE_TYPE_KEYSYMS, XK_a, 0, FALSE },
+    { "chord", "a", INPUT_PAD_TABLE_TYPE_KEYSYMS, XK_a,
+      ControlMask | ShiftMask, FALSE },
+    /* The default handler prints the strings without XTEST. */
+    { "string", BENCHMARK_STRING, INPUT_PAD_TABLE_TYPE_STRINGS, 0, 0, TRUE },
+};
+
+static gchar           *opt_path = NULL;
+static gchar           *opt_display = NULL;
+static gint             opt_count = BENCHMARK_COUNT_DEFAULT;
+static int              benchmark_retval = 0;
+
+static GOptionEntry entries[] = {
+  { "path", 'p', 0, G_OPTION_ARG_STRING, &opt_path,
+    "Run PATH only. The available PATH=xsendevent, xtest", "PATH"},
+  { "display", 'd', 0, G_OPTION_ARG_STRING, &opt_display,
+    "Use DISPLAY instead of starting Xvfb", "DISPLAY"},
+  { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count,
+    "Press the button COUNT times in each case", "COUNT"},
+  { NULL }
+};
+
+static gpointer
+receiver_thread (gpointer data)
+{
+    Receiver *receiver = (Receiver *) data;
+    XEvent xevent;
+    KeySym keysym;
+    gint64 now;
+
+    while (TRUE) {
+        XNextEvent (receiver->display, &xevent);
+        if (xevent.type == ClientMessage &&
+            xevent.xclient.message_type == receiver->quit_atom) {
+            break;
+        }
+        if (xevent.type == MappingNotify) {
+            XRefreshKeyboardMapping (&xevent.xmapping);
+            continue;
+        }
+        if (xevent.type != KeyPress) {
+            continue;
+        }
+        now = g_get_monotonic_time ();
+        keysym = XLookupKeysym (&xevent.xkey, 0);
+        if (IsModifierKey (keysym)) {
+            continue;
+        }
+        g_mutex_lock (&receiver->mutex);
+        g_array_append_val (receiver->times, now);
+        g_cond_broadcast (&receiver->cond);
+        g_mutex_unlock (&receiver->mutex);
+    }
+    return NULL;
+}
+
+static Receiver *
+receiver_start (const gchar *display_name)
+{
+    Receiver *receiver;
+    Display *display;
+    XEvent xevent;
+    int screen;
+
+    if ((display = XOpenDisplay (display_name)) == NULL) {
+        g_warning ("Could not open display %s", display_name);
+        return NULL;
+    }
+    receiver = g_new0 (Receiver, 1);
+    receiver->display = display;
+    receiver->times = g_array_new (FALSE, FALSE, sizeof (gint64));
+    receiver->quit_atom = XInternAtom (display,
+                                       "INPUT_PAD_BENCHMARK_QUIT",
+                                       False);
+    g_mutex_init (&receiver->mutex);
+    g_cond_init (&receiver->cond);
+
+    screen = DefaultScreen (display);
+    receiver->window = XCreateSimpleWindow (display,
+                                            RootWindow (display, screen),
+                                            0, 0, 200, 100, 0,
+                                            BlackPixel (display, screen),
+                                            WhitePixel (display, screen));
+    XSelectInput (display, receiver->window,
+                  KeyPressMask | StructureNotifyMask);
+    XMapRaised (display, receiver->window);
+    do {
+        XWindowEvent (display, receiver->window, StructureNotifyMask,
+                      &xevent);
+    } while (xevent.type != MapNotify);
+    XSetInputFocus (display, receiver->window, RevertToParent, CurrentTime);
+    XSync (display, False);
+
+    receiver->thread = g_thread_new ("receiver", receiver_thread, receiver);
+    return receiver;
+}
+
+static void
+receiver_stop (Receiver *receiver, Display *sender)
+{
+    XEvent xevent;
+
+    /* An empty mask sends the event to the creator of the window. */
+    memset (&xevent, 0, sizeof (xevent));
+    xevent.xclient.type = ClientMessage;
+    xevent.xclient.window = receiver->window;
+    xevent.xclient.message_type = receiver->quit_atom;
+    xevent.xclient.format = 32;
+    XSendEvent (sender, receiver->window, False, NoEventMask, &xevent);
+    XFlush (sender);
+
+    g_thread_join (receiver->thread);
+    XDestroyWindow (receiver->display, receiver->window);
+    XCloseDisplay (receiver->display);
+    g_array_free (receiver->times, TRUE);
+    g_cond_clear (&receiver->cond);
+    g_mutex_clear (&receiver->mutex);
+    g_free (receiver);
+}
+
+static void
+receiver_clear (Receiver *receiver)
+{
+    g_mutex_lock (&receiver->mutex);
+    g_array_set_size (receiver->times, 0);
+    g_mutex_unlock (&receiver->mutex);
+}
+
+static gint64
+receiver_get_time (Receiver *receiver, guint nth)
+{
+    gint64 time;
+
+    g_mutex_lock (&receiver->mutex);
+    time = g_array_index (receiver->times, gint64, nth);
+    g_mutex_unlock (&receiver->mutex);
+    return time;
+}
+
+/* The main loop keeps running while waiting because the keymap
+ * notify of the window needs it. */
+static gboolean
+receiver_wait (Receiver *receiver, guint n_keys)
+{
+    gint64 deadline = g_get_monotonic_time () + BENCHMARK_TIMEOUT;
+    gboolean retval = FALSE;
+
+    while (TRUE) {
+        while (g_main_context_iteration (NULL, FALSE));
+        g_mutex_lock (&receiver->mutex);
+        if (receiver->times->len >= n_keys) {
+            retval = TRUE;
+        } else if (g_get_monotonic_time () < deadline) {
+            g_cond_wait_until (&receiver->cond, &receiver->mutex,
+                               g_get_monotonic_time () +
+                               G_TIME_SPAN_MILLISECOND);
+            g_mutex_unlock (&receiver->mutex);
+            continue;
+        }
+        g_mutex_unlock (&receiver->mutex);
+        break;
+    }
+    return retval;
+}
+
+static void
+press_button (InputPadGtkWindow   *window,
+              const BenchmarkCase *bcase)
+{
+    InputPadXStatsScope scope;
+    gboolean retval = FALSE;
+
+    input_pad_gdk_xstats_scope_begin (&scope, INPUT_PAD_XSTATS_OP_KEY_PRESS);
+    g_signal_emit_by_name (window, "button-pressed",
+                           bcase->str, bcase->type, bcase->keysym, 0,
+                           bcase->state, &retval);
+    input_pad_gdk_xstats_scope_end (&scope);
+}
+
+static gint
+compare_double (gconstpointer a, gconstpointer b)
+{
+    gdouble da = *(const gdouble *) a;
+    gdouble db = *(const gdouble *) b;
+
+    return (da > db) - (da < db);
+}
+
+static gdouble
+get_percentile (GArray *latencies, guint percentile)
+{
+    guint nth = (latencies->len - 1) * percentile / 100;
+
+    return g_array_index (latencies, gdouble, nth);
+}
+
+static gboolean
+run_case (InputPadGtkWindow   *window,
+          Receiver            *receiver,
+          const BenchmarkCase *bcase)
+{
+    GArray *latencies;
+    InputPadXStats stats;
+    guint n_keys;
+    guint total;
+    guint i;
+    gint64 start;
+    gdouble rate;
+
+    n_keys = bcase->type == INPUT_PAD_TABLE_TYPE_STRINGS ?
+        g_utf8_strlen (bcase->str, -1) : 1;
+    latencies = g_array_sized_new (FALSE, FALSE, sizeof (gdouble), opt_count);
+
+    /* The latency is measured by one press at a time until the last
+     * key of the press arrives. */
+    receiver_clear (receiver);
+    input_pad_gdk_xstats_reset ();
+    for (i = 0; i < opt_count; i++) {
+        gdouble latency;
+
+        start = g_get_monotonic_time ();
+        press_button (window, bcase);
+        if (!receiver_wait (receiver, (i + 1) * n_keys)) {
+            g_print ("%-10s %-6s timed out after %u presses\n",
+                     opt_path, bcase->name, i);
+            g_array_free (latencies, TRUE);
+            return FALSE;
+        }
+        latency = (receiver_get_time (receiver, (i + 1) * n_keys - 1) -
+                   start) / 1000.;
+        g_array_append_val (latencies, latency);
+    }
+    input_pad_gdk_xstats_get (INPUT_PAD_XSTATS_OP_KEY_PRESS, &stats);
+
+    /* The rate is measured by pressing all without waiting. */
+    receiver_clear (receiver);
+    total = opt_count * n_keys;
+    start = g_get_monotonic_time ();
+    for (i = 0; i < opt_count; i++) {
+        press_button (window, bcase);
+    }
+    if (!receiver_wait (receiver, total)) {
+        g_print ("%-10s %-6s timed out in the burst\n",
+                 opt_path, bcase->name);
+        g_array_free (latencies, TRUE);
+        return FALSE;
+    }
+    rate = total * (gdouble) G_TIME_SPAN_SECOND /
+        MAX (receiver_get_time (receiver, total - 1) - start, 1);
+
+    g_array_sort (latencies, compare_double);
+    g_print ("%-10s %-6s %6u %8.3f %8.3f %8.3f %8.3f %10.1f %6.2f\n",
+             opt_path, bcase->name, opt_count,
+             get_percentile (latencies, 50),
+             get_percentile (latencies, 90),
+             get_percentile (latencies, 99),
+             g_array_index (latencies, gdouble, latencies->len - 1),
+             rate,
+             (gdouble) stats.n_round_trips / opt_count);
+    g_array_free (latencies, TRUE);
+    return TRUE;
+}
+
+static gboolean
+run_benchmark (gpointer data)
+{
+    InputPadGtkApplication *app = INPUT_PAD_GTK_APPLICATION (data);
+    InputPadGtkWindow *window;
+    Display *xdisplay;
+    Receiver *receiver;
+    gboolean use_xtest;
+    gboolean has_handler;
+    guint signal_id;
+    guint i;
+
+    window = input_pad_gtk_application_get_window (app);
+    xdisplay = GDK_DISPLAY_XDISPLAY (gtk_widget_get_display (GTK_WIDGET (window)));
+    use_xtest = (g_strcmp0 (opt_path, "xtest") == 0);
+
+    /* The XTEST module connects a handler to the signal. */
+    signal_id = g_signal_lookup ("button-pressed", G_OBJECT_TYPE (window));
+    has_handler = g_signal_has_handler_pending (window, signal_id, 0, FALSE);
+    if (use_xtest != has_handler) {
+        g_print ("%-10s skipped: the XTEST module is %s\n",
+                 opt_path, has_handler ? "loaded" : "not loaded");
+        g_application_quit (G_APPLICATION (app));
+        return FALSE;
+    }
+
+    if ((receiver = receiver_start (DisplayString (xdisplay))) == NULL) {
+        benchmark_retval = 1;
+        g_application_quit (G_APPLICATION (app));
+        return FALSE;
+    }
+    for (i = 0; i < G_N_ELEMENTS (benchmark_cases); i++) {
+        if (benchmark_cases[i].xtest_only && !use_xtest) {
+            continue;
+        }
+        if (!run_case (window, receiver, &benchmark_cases[i])) {
+            benchmark_retval = 1;
+        }
+    }
+    receiver_stop (receiver, xdisplay);
+
+    g_application_quit (G_APPLICATION (app));
+    return FALSE;
+}
+
+static void
+on_app_activated (InputPadGtkApplication *app,
+                  gpointer                data)
+{
+    gdk_threads_add_idle (run_benchmark, app);
+}
+
+static int
+run_path (int *argc, char ***argv)
+{
+    InputPadGtkApplication *app;
+    int do_exit = 0;
+    int retval;
+
+    /* Type the strings instead of pasting them. */
+    g_setenv ("INPUT_PAD_PASTE_THRESHOLD", "0", TRUE);
+    input_pad_gdk_xstats_set_enabled (TRUE);
+
+    retval = input_pad_window_init (argc, argv, INPUT_PAD_WINDOW_TYPE_GTK,
+                                    &do_exit);
+    if (do_exit) {
+        return retval;
+    }
+
+    app = input_pad_gtk_application_new ();
+    g_signal_connect (G_OBJECT (app), "activated",
+                      G_CALLBACK (on_app_activated), NULL);
+    g_application_run (G_APPLICATION (app), 0, NULL);
+    g_object_unref (app);
+
+    return benchmark_retval;
+}
+
+static gchar *
+start_xvfb (GPid *pidp)
+{
+    gchar *argv[] = { "Xvfb", "-displayfd", "1", "-nolisten", "tcp",
+                      "-screen", "0", "1024x768x24", NULL };
+    GError *error = NULL;
+    gchar buff[32];
+    gint fd;
+    gssize n;
+    gssize len = 0;
+
+    if (!g_spawn_async_with_pipes (NULL, argv, NULL,
+                                   G_SPAWN_SEARCH_PATH |
+                                   G_SPAWN_DO_NOT_REAP_CHILD |
+                                   G_SPAWN_STDERR_TO_DEV_NULL,
+                                   NULL, NULL, pidp,
+                                   NULL, &fd, NULL, &error)) {
+        g_warning ("Could not start Xvfb: %s", error->message);
+        g_error_free (error);
+        return NULL;
+    }
+
+    /* Xvfb writes the display number when it is ready. */
+    while (len < (gssize) sizeof (buff) - 1 &&
+           (n = read (fd, buff + len, sizeof (buff) - 1 - len)) > 0) {
+        len += n;
+        if (memchr (buff, '\n', len)) {
+            break;
+        }
+    }
+    close (fd);
+    buff[len] = '\0';
+    g_strstrip (buff);
+    if (*buff == '\0') {
+        g_warning ("Xvfb did not report the display");
+        kill (*pidp, SIGTERM);
+        g_spawn_close_pid (*pidp);
+        return NULL;
+    }
+    return g_strdup_printf (":%s", buff);
+}
+
+static int
+run_all_paths (const char *argv0)
+{
+    const gchar *paths[] = { "xsendevent", "xtest" };
+    GPid xvfb_pid = 0;
+    gchar *display;
+    gchar **envp;
+    gchar *count;
+    GError *error = NULL;
+    int retval = 0;
+    int status;
+    guint i;
+
+    if (opt_display) {
+        display = g_strdup (opt_display);
+    } else if ((display = start_xvfb (&xvfb_pid)) == NULL) {
+        return 1;
+    }
+    envp = g_environ_setenv (g_get_environ (), "DISPLAY", display, TRUE);
+    count = g_strdup_printf ("%d", opt_count);
+
+    g_print ("%-10s %-6s %6s %8s %8s %8s %8s %10s %6s\n",
+             "path", "case", "count", "p50 ms", "p90 ms", "p99 ms",
+             "max ms", "events/s", "rt/key");
+    for (i = 0; i < G_N_ELEMENTS (paths); i++) {
+        gchar *argv[] = { (gchar *) argv0,
+                          "--path", (gchar *) paths[i],
+                          "--count", count,
+                          NULL, NULL };
+
+        /* -x toggles the default of the XTEST module. */
+        if (strcmp (paths[i], "xsendevent") == 0) {
+            argv[5] = "-x";
+        }
+        if (!g_spawn_sync (NULL, argv, envp, G_SPAWN_SEARCH_PATH,
+                           NULL, NULL, NULL, NULL, &status, &error)) {
+            g_warning ("Could not run %s: %s", argv0, error->message);
+            g_clear_error (&error);
+            retval = 1;
+            continue;
+        }
+        if (!g_spawn_check_exit_status (status, NULL)) {
+            retval = 1;
+        }
+    }
+
+    if (xvfb_pid) {
+        kill (xvfb_pid, SIGTERM);
+        g_spawn_close_pid (xvfb_pid);
+    }
+    g_free (count);
+    g_strfreev (envp);
+    g_free (display);
+    return retval;
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+
+    context = g_option_context_new ("- benchmark of the key events");
+    g_option_context_add_main_entries (context, entries, NULL);
+    g_option_context_set_ignore_unknown_options (context, TRUE);
+    g_option_context_set_help_enabled (context, FALSE);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        g_option_context_free (context);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (opt_count <= 0) {
+        opt_count = BENCHMARK_COUNT_DEFAULT;
+    }
+    if (opt_path == NULL) {
+        return run_all_paths (argv[0]);
+    }
+    return run_path (&argc, &argv);
+}
@@ -29,6 +29,8 @@ typedef struct _InputPadTable InputPadTable;
 typedef struct _InputPadTableStr InputPadTableStr;
 typedef struct _InputPadTableCmd InputPadTableCmd;
 typedef struct _InputPadTableXXX InputPadTableXXX;
+typedef struct _InputPadGroupIndex InputPadGroupIndex;
+typedef struct _InputPadGroupIndexHit InputPadGroupIndexHit;
 
 typedef enum
 {
@@ -74,6 +76,14 @@ struct _InputPadTableCmd {
     char                       *execl;
 };
 
+/* A hit of input_pad_group_index_query() points to the nth entry of
+ * table->data.strs or table->data.cmds. */
+struct _InputPadGroupIndexHit {
+    InputPadGroup              *group;
+    InputPadTable              *table;
+    int                         nth;
+};
+
 struct _InputPadTableXXX {
     /* Padding for future expansion */
     void                       *reserved1;
@@ -92,5 +102,18 @@ InputPadGroup * input_pad_group_parse_all_files
                                 const char           *domain);
 void            input_pad_group_destroy
                                (InputPadGroup        *group_data);
+InputPadGroupIndex *
+                input_pad_group_index_new
+                               (InputPadGroup        *group_data);
+InputPadGroupIndexHit *
+                input_pad_group_index_query
+                               (InputPadGroupIndex   *group_index,
+                                const char           *query,
+                                int                   max_hits);
+void            input_pad_group_index_free_hits
+                               (InputPadGroupIndexHit
+                                                     *hits);
+void            input_pad_group_index_destroy
+                               (InputPadGroupIndex   *group_index);
 
 #endif
@@ -26,9 +26,23 @@ struct _InputPadGroupPrivate {
     void                *signal_window;
 };
 
+typedef struct _InputPadTableCmdPrivate InputPadTableCmdPrivate;
+
+/* cache_ttl is 0 without the cache. */
+#define INPUT_PAD_TABLE_CMD_CACHE_RELOAD -1
+
+struct _InputPadTableCmdPrivate {
+    char              **argv;
+    char              **envp;
+    int                 cache_ttl;
+};
+
+/* cmds[i] is the prepared command of data.cmds[i] in the COMMANDS
+ * table. InputPadTableCmd is public so it cannot be extended. */
 struct _InputPadTablePrivate {
     guint               inited : 1;
     void               *signal_window;
+    InputPadTableCmdPrivate *cmds;
 };
 
 #endif
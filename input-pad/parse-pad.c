@@ -199,11 +199,86 @@ parse_string (xmlNodePtr node, InputPadTableStr *str)
     }
 }
 
+/* The argv is parsed once when the file is loaded and the leading
+ * VAR=value arguments are the environment of the command. */
 static void
-parse_command (xmlNodePtr node, InputPadTableCmd *cmd)
+prepare_command (InputPadTableCmd *cmd, InputPadTableCmdPrivate *cmd_priv)
+{
+    GError  *error;
+    char   **argv;
+    char   **envp = NULL;
+    char    *p;
+    char    *end;
+    char    *name;
+    const char *value;
+    char    *extracted;
+    char    *new_arg;
+    int      i, n;
+
+    error = NULL;
+    if (!g_shell_parse_argv (cmd->execl, NULL, &argv, &error)) {
+        g_warning ("Could not parse command: %s", error->message);
+        g_error_free (error);
+        return;
+    }
+    n = 0;
+    for (i = 0; argv[i]; i++) {
+        if (g_strstr_len (argv[i], -1, "=") != NULL) {
+            n++;
+        } else {
+            break;
+        }
+    }
+    if (argv[n] == NULL) {
+        g_warning ("Could not find the program in command: %s", cmd->execl);
+        g_strfreev (argv);
+        return;
+    }
+    if (n > 0) {
+        envp = g_new0 (char *, n + 1);
+    }
+    for (i = 0; i < n; i++) {
+        envp[i] = g_strdup (argv[i]);
+    }
+    for (i = n; argv[i]; i++) {
+        if ((p = g_strstr_len (argv[i], -1, "$")) != NULL &&
+            *(p + 1) != '\0') {
+            end = g_strstr_len (p + 1, -1, " ");
+            if (end) {
+                name = g_strndup (p, end - p);
+            } else {
+                name = g_strdup (p);
+            }
+            value = g_getenv (name + 1);
+            g_free (name);
+            if (value != NULL) {
+                extracted = g_strdup (value);
+            } else {
+                extracted = g_strdup ("");
+            }
+            *p = '\0';
+            if (end) {
+                new_arg = g_strconcat (argv[i], extracted, end, NULL);
+            } else {
+                new_arg = g_strconcat (argv[i], extracted, NULL);
+            }
+            g_free (argv[i]);
+            argv[i] = new_arg;
+        }
+    }
+    cmd_priv->argv = g_strdupv (&argv[n]);
+    cmd_priv->envp = envp;
+    g_strfreev (argv);
+}
+
+static void
+parse_command (xmlNodePtr               node,
+               InputPadTableCmd        *cmd,
+               InputPadTableCmdPrivate *cmd_priv)
 {
     xmlNodePtr current;
     gboolean has_execl = FALSE;
+    char *cache = NULL;
 
     for (current = node; current; current = current->next) {
         if (current->type == XML_ELEMENT_NODE) {
@@ -226,6 +301,16 @@ parse_command (xmlNodePtr node, InputPadTableCmd *cmd)
                              xml_file);
                 }
             }
+            if (!g_strcmp0 ((char *) current->name, "cache")) {
+                if (current->children) {
+                    g_free (cache);
+                    get_content (current->children, &cache, FALSE);
+                } else {
+                    g_error ("tag %s does not have child tags in the file %s",
+                             (char *) current->name,
+                             xml_file);
+                }
+            }
         }
     }
     if (!has_execl) {
@@ -233,6 +318,21 @@ parse_command (xmlNodePtr node, InputPadTableCmd *cmd)
                  node->parent ? node->parent->name ? (char *) node->parent->name : "(null)" : "(null)",
                  xml_file);
     }
+    prepare_command (cmd, cmd_priv);
+
+    /* <cache> is the seconds to keep the output or "reload". */
+    if (cache) {
+        g_strstrip (cache);
+        if (!g_strcmp0 (cache, "reload")) {
+            cmd_priv->cache_ttl = INPUT_PAD_TABLE_CMD_CACHE_RELOAD;
+        } else if (g_ascii_isdigit (*cache)) {
+            cmd_priv->cache_ttl = (int) g_ascii_strtoll (cache, NULL, 10);
+        } else {
+            g_warning ("tag cache has the invalid value %s in file %s",
+                       cache, xml_file);
+        }
+        g_free (cache);
+    }
 }
 
 #define GET_TABLE_SUB_ARRAY_LEN(type_name, TypeName, label)             \
@@ -273,7 +373,7 @@ free_string_array (InputPadTableStr *strs)
 }
 
 static void
-free_command_array (InputPadTableCmd *cmds)
+free_command_array (InputPadTableCmd *cmds, InputPadTableCmdPrivate *cmd_privs)
 {
     int i = 0;
     if (cmds == NULL) {
@@ -282,10 +382,15 @@ free_command_array (InputPadTableCmd *cmds)
     for (i = 0; cmds[i].execl; i++) {
         g_free (cmds[i].execl);
         g_free (cmds[i].label);
+        if (cmd_privs) {
+            g_strfreev (cmd_privs[i].argv);
+            g_strfreev (cmd_privs[i].envp);
+        }
         cmds[i].label = NULL;
         cmds[i].execl = NULL;
     }
     g_free (cmds);
+    g_free (cmd_privs);
 }
 
 static void
@@ -315,14 +420,22 @@ parse_table_sub_command (xmlNodePtr node, InputPadTable **ptable)
     len = get_command_array_len ((*ptable)->data.cmds);
     if (len == 0) {
         (*ptable)->data.cmds = g_new0 (InputPadTableCmd, 2);
+        (*ptable)->priv->cmds = g_new0 (InputPadTableCmdPrivate, 2);
     } else {
         (*ptable)->data.cmds = g_renew (InputPadTableCmd,
                                        (*ptable)->data.cmds,
                                        len + 2);
         (*ptable)->data.cmds[len + 1].label= NULL;
         (*ptable)->data.cmds[len + 1].execl = NULL;
+        (*ptable)->priv->cmds = g_renew (InputPadTableCmdPrivate,
+                                        (*ptable)->priv->cmds,
+                                        len + 2);
+        (*ptable)->priv->cmds[len + 1].argv = NULL;
+        (*ptable)->priv->cmds[len + 1].envp = NULL;
+        (*ptable)->priv->cmds[len + 1].cache_ttl = 0;
     }
-    parse_command (node, &(*ptable)->data.cmds[len]);
+    parse_command (node, &(*ptable)->data.cmds[len],
+                   &(*ptable)->priv->cmds[len]);
 }
 
 static void
@@ -671,8 +784,12 @@ input_pad_group_destroy (InputPadGroup *group_data)
                 free_string_array (table->data.strs);
                 table->data.strs = NULL;
             } else if (table->type == INPUT_PAD_TABLE_TYPE_COMMANDS) {
-                free_command_array (table->data.cmds);
+                free_command_array (table->data.cmds,
+                                    table->priv ? table->priv->cmds : NULL);
                 table->data.cmds = NULL;
+                if (table->priv) {
+                    table->priv->cmds = NULL;
+                }
             } else {
                 g_warning ("Free is not defined in type %d", table->type);
             }
@@ -0,0 +1,544 @@
+/* vim:set et sts=4: */
+/* input-pad - The input pad
+ * Copyright (C) 2010-2012 Takao Fujiwara <takao.fujiwara1@gmail.com>
+ * Copyright (C) 2010-2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gtk/gtk.h>
+#include <stdlib.h> /* qsort */
+
+#include "i18n.h"
+#include "treemodel-gtk.h"
+#include "unicode_block.h"
+
+typedef enum {
+    MODEL_TYPE_GROUPS = 0,
+    MODEL_TYPE_TABLES,
+    MODEL_TYPE_UNICODE_BLOCKS,
+} ModelType;
+
+/* The model does not copy any names. GtkTreeIter.user_data is
+ * the InputPadGroup or InputPadTable of the row and user_data2 is
+ * the row number. */
+struct _InputPadGtkTreeModelPrivate
+{
+    ModelType           type;
+    /* The first group for MODEL_TYPE_GROUPS and the parent group of
+     * the tables for MODEL_TYPE_TABLES. */
+    InputPadGroup      *group;
+    int                 n_rows;
+    /* input_pad_unicode_block_table indexes sorted by start. */
+    int                *block_order;
+    int                 stamp;
+};
+
+static void input_pad_gtk_tree_model_iface_init (GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (InputPadGtkTreeModel, input_pad_gtk_tree_model,
+                         G_TYPE_OBJECT,
+                         G_ADD_PRIVATE (InputPadGtkTreeModel)
+                         G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_MODEL,
+                         input_pad_gtk_tree_model_iface_init))
+
+static int
+sort_block_start (const void *a, const void *b)
+{
+    unsigned int start_a = input_pad_unicode_block_table[*(const int *) a].start;
+    unsigned int start_b = input_pad_unicode_block_table[*(const int *) b].start;
+
+    if (start_a < start_b) {
+        return -1;
+    }
+    return (start_a > start_b) ? 1 : 0;
+}
+
+static int
+count_rows (InputPadGtkTreeModel *model)
+{
+    InputPadGtkTreeModelPrivate *priv = model->priv;
+    InputPadGroup *group;
+    InputPadTable *table;
+    int n = 0;
+
+    switch (priv->type) {
+    case MODEL_TYPE_GROUPS:
+        for (group = priv->group; group; group = group->next) {
+            n++;
+        }
+        break;
+    case MODEL_TYPE_TABLES:
+        if (priv->group == NULL) {
+            break;
+        }
+        for (table = priv->group->table; table; table = table->next) {
+            n++;
+        }
+        break;
+    case MODEL_TYPE_UNICODE_BLOCKS:
+        while (input_pad_unicode_block_table[n].label) {
+            n++;
+        }
+        break;
+    default:
+        g_assert_not_reached ();
+    }
+    return n;
+}
+
+static gboolean
+model_iter_nth (InputPadGtkTreeModel *model,
+                GtkTreeIter          *iter,
+                int                   nth)
+{
+    InputPadGtkTreeModelPrivate *priv = model->priv;
+    InputPadGroup *group = NULL;
+    InputPadTable *table = NULL;
+    gpointer node = NULL;
+    int i;
+
+    if (nth < 0 || nth >= priv->n_rows) {
+        return FALSE;
+    }
+    switch (priv->type) {
+    case MODEL_TYPE_GROUPS:
+        group = priv->group;
+        for (i = 0; group && i < nth; i++) {
+            group = group->next;
+        }
+        node = group;
+        break;
+    case MODEL_TYPE_TABLES:
+        table = priv->group ? priv->group->table : NULL;
+        for (i = 0; table && i < nth; i++) {
+            table = table->next;
+        }
+        node = table;
+        break;
+    case MODEL_TYPE_UNICODE_BLOCKS:
+        node = (gpointer) &input_pad_unicode_block_table[priv->block_order[nth]];
+        break;
+    default:
+        g_assert_not_reached ();
+    }
+    if (node == NULL) {
+        return FALSE;
+    }
+    iter->stamp = priv->stamp;
+    iter->user_data = node;
+    iter->user_data2 = GINT_TO_POINTER (nth);
+    iter->user_data3 = NULL;
+    return TRUE;
+}
+
+static char *
+utf8_hex_string (unsigned int code)
+{
+    gchar buff[7];
+    GString *string;
+    int i, len;
+
+    len = g_unichar_to_utf8 ((gunichar) code, buff);
+    if (code == 0) {
+        return g_strdup ("0x00");
+    }
+    string = g_string_new (NULL);
+    for (i = 0; i < len; i++) {
+        g_string_append_printf (string, "0x%02X ", (unsigned char) buff[i]);
+    }
+    return g_string_free (string, FALSE);
+}
+
+static GtkTreeModelFlags
+input_pad_gtk_tree_model_get_flags (GtkTreeModel *tree_model)
+{
+    return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint
+input_pad_gtk_tree_model_get_n_columns (GtkTreeModel *tree_model)
+{
+    return CHAR_BLOCK_N_COLS;
+}
+
+static GType
+input_pad_gtk_tree_model_get_column_type (GtkTreeModel *tree_model,
+                                          gint          index)
+{
+    switch (index) {
+    case CHAR_BLOCK_LABEL_COL:
+    case CHAR_BLOCK_UNICODE_COL:
+    case CHAR_BLOCK_UTF8_COL:
+        return G_TYPE_STRING;
+    case CHAR_BLOCK_START_COL:
+    case CHAR_BLOCK_END_COL:
+        return G_TYPE_UINT;
+    case CHAR_BLOCK_VISIBLE_COL:
+        return G_TYPE_BOOLEAN;
+    default:
+        g_return_val_if_reached (G_TYPE_INVALID);
+    }
+}
+
+static gboolean
+input_pad_gtk_tree_model_get_iter (GtkTreeModel *tree_model,
+                                   GtkTreeIter  *iter,
+                                   GtkTreePath  *path)
+{
+    InputPadGtkTreeModel *model = INPUT_PAD_GTK_TREE_MODEL (tree_model);
+
+    if (gtk_tree_path_get_depth (path) != 1) {
+        return FALSE;
+    }
+    return model_iter_nth (model, iter, gtk_tree_path_get_indices (path)[0]);
+}
+
+static GtkTreePath *
+input_pad_gtk_tree_model_get_path (GtkTreeModel *tree_model,
+                                   GtkTreeIter  *iter)
+{
+    InputPadGtkTreeModel *model = INPUT_PAD_GTK_TREE_MODEL (tree_model);
+
+    g_return_val_if_fail (iter->stamp == model->priv->stamp, NULL);
+
+    return gtk_tree_path_new_from_indices (GPOINTER_TO_INT (iter->user_data2),
+                                           -1);
+}
+
+static void
+input_pad_gtk_tree_model_get_value (GtkTreeModel *tree_model,
+                                    GtkTreeIter  *iter,
+                                    gint          column,
+                                    GValue       *value)
+{
+    InputPadGtkTreeModel *model = INPUT_PAD_GTK_TREE_MODEL (tree_model);
+    InputPadGtkTreeModelPrivate *priv = model->priv;
+    const InputPadUnicodeBlockTable *block = NULL;
+    const char *name = NULL;
+    char *start_str;
+    char *end_str;
+    unsigned int row;
+
+    g_return_if_fail (iter->stamp == priv->stamp);
+
+    g_value_init (value,
+                  input_pad_gtk_tree_model_get_column_type (tree_model, column));
+    row = (unsigned int) GPOINTER_TO_INT (iter->user_data2);
+    if (priv->type == MODEL_TYPE_GROUPS) {
+        name = ((InputPadGroup *) iter->user_data)->name;
+    } else if (priv->type == MODEL_TYPE_TABLES) {
+        name = ((InputPadTable *) iter->user_data)->name;
+    } else {
+        block = (const InputPadUnicodeBlockTable *) iter->user_data;
+        name = _(block->label);
+    }
+
+    switch (column) {
+    case CHAR_BLOCK_LABEL_COL:
+        g_value_set_string (value, name);
+        break;
+    case CHAR_BLOCK_UNICODE_COL:
+        if (block) {
+            g_value_take_string (value,
+                                 g_strdup_printf ("U+%06X - U+%06X",
+                                                  block->start, block->end));
+        }
+        break;
+    case CHAR_BLOCK_UTF8_COL:
+        if (block) {
+            start_str = utf8_hex_string (block->start);
+            end_str = utf8_hex_string (block->end);
+            g_value_take_string (value,
+                                 g_strdup_printf ("%s - %s",
+                                                  start_str, end_str));
+            g_free (start_str);
+            g_free (end_str);
+        }
+        break;
+    case CHAR_BLOCK_START_COL:
+        g_value_set_uint (value, block ? block->start : row);
+        break;
+    case CHAR_BLOCK_END_COL:
+        g_value_set_uint (value, block ? block->end : 0);
+        break;
+    case CHAR_BLOCK_VISIBLE_COL:
+        g_value_set_boolean (value, TRUE);
+        break;
+    default:
+        g_assert_not_reached ();
+    }
+}
+
+static gboolean
+input_pad_gtk_tree_model_iter_next (GtkTreeModel *tree_model,
+                                    GtkTreeIter  *iter)
+{
+    InputPadGtkTreeModel *model = INPUT_PAD_GTK_TREE_MODEL (tree_model);
+    InputPadGtkTreeModelPrivate *priv = model->priv;
+    gpointer node = NULL;
+    int row;
+
+    g_return_val_if_fail (iter->stamp == priv->stamp, FALSE);
+
+    row = GPOINTER_TO_INT (iter->user_data2) + 1;
+    if (row >= priv->n_rows) {
+        iter->stamp = 0;
+        return FALSE;
+    }
+    if (priv->type == MODEL_TYPE_GROUPS) {
+        node = ((InputPadGroup *) iter->user_data)->next;
+    } else if (priv->type == MODEL_TYPE_TABLES) {
+        node = ((InputPadTable *) iter->user_data)->next;
+    } else {
+        node = (gpointer) &input_pad_unicode_block_table[priv->block_order[row]];
+    }
+    if (node == NULL) {
+        iter->stamp = 0;
+        return FALSE;
+    }
+    iter->user_data = node;
+    iter->user_data2 = GINT_TO_POINTER (row);
+    return TRUE;
+}
+
+static gboolean
+input_pad_gtk_tree_model_iter_children (GtkTreeModel *tree_model,
+                                        GtkTreeIter  *iter,
+                                        GtkTreeIter  *parent)
+{
+    if (parent != NULL) {
+        iter->stamp = 0;
+        return FALSE;
+    }
+    return model_iter_nth (INPUT_PAD_GTK_TREE_MODEL (tree_model), iter, 0);
+}
+
+static gboolean
+input_pad_gtk_tree_model_iter_has_child (GtkTreeModel *tree_model,
+                                         GtkTreeIter  *iter)
+{
+    return FALSE;
+}
+
+static gint
+input_pad_gtk_tree_model_iter_n_children (GtkTreeModel *tree_model,
+                                          GtkTreeIter  *iter)
+{
+    if (iter != NULL) {
+        return 0;
+    }
+    return INPUT_PAD_GTK_TREE_MODEL (tree_model)->priv->n_rows;
+}
+
+static gboolean
+input_pad_gtk_tree_model_iter_nth_child (GtkTreeModel *tree_model,
+                                         GtkTreeIter  *iter,
+                                         GtkTreeIter  *parent,
+                                         gint          n)
+{
+    if (parent != NULL) {
+        iter->stamp = 0;
+        return FALSE;
+    }
+    return model_iter_nth (INPUT_PAD_GTK_TREE_MODEL (tree_model), iter, n);
+}
+
+static gboolean
+input_pad_gtk_tree_model_iter_parent (GtkTreeModel *tree_model,
+                                      GtkTreeIter  *iter,
+                                      GtkTreeIter  *child)
+{
+    iter->stamp = 0;
+    return FALSE;
+}
+
+static void
+input_pad_gtk_tree_model_iface_init (GtkTreeModelIface *iface)
+{
+    iface->get_flags = input_pad_gtk_tree_model_get_flags;
+    iface->get_n_columns = input_pad_gtk_tree_model_get_n_columns;
+    iface->get_column_type = input_pad_gtk_tree_model_get_column_type;
+    iface->get_iter = input_pad_gtk_tree_model_get_iter;
+    iface->get_path = input_pad_gtk_tree_model_get_path;
+    iface->get_value = input_pad_gtk_tree_model_get_value;
+    iface->iter_next = input_pad_gtk_tree_model_iter_next;
+    iface->iter_children = input_pad_gtk_tree_model_iter_children;
+    iface->iter_has_child = input_pad_gtk_tree_model_iter_has_child;
+    iface->iter_n_children = input_pad_gtk_tree_model_iter_n_children;
+    iface->iter_nth_child = input_pad_gtk_tree_model_iter_nth_child;
+    iface->iter_parent = input_pad_gtk_tree_model_iter_parent;
+}
+
+static void
+input_pad_gtk_tree_model_finalize (GObject *object)
+{
+    InputPadGtkTreeModel *model = INPUT_PAD_GTK_TREE_MODEL (object);
+
+    g_free (model->priv->block_order);
+    model->priv->block_order = NULL;
+    model->priv->group = NULL;
+
+    G_OBJECT_CLASS (input_pad_gtk_tree_model_parent_class)->finalize (object);
+}
+
+static void
+input_pad_gtk_tree_model_class_init (InputPadGtkTreeModelClass *class)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (class);
+
+    gobject_class->finalize = input_pad_gtk_tree_model_finalize;
+}
+
+static void
+input_pad_gtk_tree_model_init (InputPadGtkTreeModel *model)
+{
+    model->priv = input_pad_gtk_tree_model_get_instance_private (model);
+    do {
+        model->priv->stamp = g_random_int ();
+    } while (model->priv->stamp == 0);
+}
+
+GtkTreeModel *
+input_pad_gtk_tree_model_new_with_groups (InputPadGroup *group)
+{
+    InputPadGtkTreeModel *model;
+
+    model = g_object_new (INPUT_PAD_TYPE_GTK_TREE_MODEL, NULL);
+    model->priv->type = MODEL_TYPE_GROUPS;
+    model->priv->group = group;
+    model->priv->n_rows = count_rows (model);
+    return GTK_TREE_MODEL (model);
+}
+
+GtkTreeModel *
+input_pad_gtk_tree_model_new_with_tables (InputPadGroup *group)
+{
+    InputPadGtkTreeModel *model;
+
+    model = g_object_new (INPUT_PAD_TYPE_GTK_TREE_MODEL, NULL);
+    model->priv->type = MODEL_TYPE_TABLES;
+    model->priv->group = group;
+    model->priv->n_rows = count_rows (model);
+    return GTK_TREE_MODEL (model);
+}
+
+GtkTreeModel *
+input_pad_gtk_tree_model_new_with_unicode_blocks (void)
+{
+    InputPadGtkTreeModel *model;
+    int i;
+
+    model = g_object_new (INPUT_PAD_TYPE_GTK_TREE_MODEL, NULL);
+    model->priv->type = MODEL_TYPE_UNICODE_BLOCKS;
+    model->priv->n_rows = count_rows (model);
+    model->priv->block_order = g_new0 (int, model->priv->n_rows + 1);
+    for (i = 0; i < model->priv->n_rows; i++) {
+        model->priv->block_order[i] = i;
+    }
+    qsort (model->priv->block_order, model->priv->n_rows, sizeof (int),
+           sort_block_start);
+    return GTK_TREE_MODEL (model);
+}
+
+void
+input_pad_gtk_tree_model_set_group (InputPadGtkTreeModel *model,
+                                    InputPadGroup        *group)
+{
+    InputPadGtkTreeModelPrivate *priv;
+    GtkTreePath *path;
+    GtkTreeIter iter;
+    int i, n_old, n_new;
+
+    g_return_if_fail (INPUT_PAD_IS_GTK_TREE_MODEL (model));
+    g_return_if_fail (model->priv->type == MODEL_TYPE_TABLES);
+
+    priv = model->priv;
+    if (priv->group == group) {
+        return;
+    }
+    n_old = priv->n_rows;
+    priv->group = group;
+    n_new = count_rows (model);
+    priv->stamp++;
+    if (priv->stamp == 0) {
+        priv->stamp++;
+    }
+
+    /* The rows are only the table names so the common rows are
+     * notified with row-changed and the difference is removed from
+     * or appended to the tail. */
+    for (i = n_old - 1; i >= n_new; i--) {
+        priv->n_rows = i;
+        path = gtk_tree_path_new_from_indices (i, -1);
+        gtk_tree_model_row_deleted (GTK_TREE_MODEL (model), path);
+        gtk_tree_path_free (path);
+    }
+    priv->n_rows = MIN (n_old, n_new);
+    for (i = 0; i < priv->n_rows; i++) {
+        if (!model_iter_nth (model, &iter, i)) {
+            break;
+        }
+        path = gtk_tree_path_new_from_indices (i, -1);
+        gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
+        gtk_tree_path_free (path);
+    }
+    for (i = n_old; i < n_new; i++) {
+        priv->n_rows = i + 1;
+        if (!model_iter_nth (model, &iter, i)) {
+            break;
+        }
+        path = gtk_tree_path_new_from_indices (i, -1);
+        gtk_tree_model_row_inserted (GTK_TREE_MODEL (model), path, &iter);
+        gtk_tree_path_free (path);
+    }
+    priv->n_rows = n_new;
+}
+
+InputPadGroup *
+input_pad_gtk_tree_model_iter_get_group (InputPadGtkTreeModel *model,
+                                         GtkTreeIter          *iter)
+{
+    g_return_val_if_fail (INPUT_PAD_IS_GTK_TREE_MODEL (model), NULL);
+    g_return_val_if_fail (iter != NULL && iter->stamp == model->priv->stamp,
+                          NULL);
+
+    if (model->priv->type == MODEL_TYPE_GROUPS) {
+        return (InputPadGroup *) iter->user_data;
+    }
+    if (model->priv->type == MODEL_TYPE_TABLES) {
+        return model->priv->group;
+    }
+    return NULL;
+}
+
+InputPadTable *
+input_pad_gtk_tree_model_iter_get_table (InputPadGtkTreeModel *model,
+                                         GtkTreeIter          *iter)
+{
+    g_return_val_if_fail (INPUT_PAD_IS_GTK_TREE_MODEL (model), NULL);
+    g_return_val_if_fail (iter != NULL && iter->stamp == model->priv->stamp,
+                          NULL);
+
+    if (model->priv->type == MODEL_TYPE_TABLES) {
+        return (InputPadTable *) iter->user_data;
+    }
+    return NULL;
+}
@@ -0,0 +1,92 @@
+/* vim:set et sts=4: */
+/* input-pad - The input pad
+ * Copyright (C) 2010-2012 Takao Fujiwara <takao.fujiwara1@gmail.com>
+ * Copyright (C) 2010-2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#ifndef __INPUT_PAD_TREE_MODEL_GTK_H__
+#define __INPUT_PAD_TREE_MODEL_GTK_H__
+
+#include <gtk/gtk.h>
+
+#include "input-pad-group.h"
+
+G_BEGIN_DECLS
+
+#define INPUT_PAD_TYPE_GTK_TREE_MODEL            (input_pad_gtk_tree_model_get_type ())
+#define INPUT_PAD_GTK_TREE_MODEL(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), INPUT_PAD_TYPE_GTK_TREE_MODEL, InputPadGtkTreeModel))
+#define INPUT_PAD_GTK_TREE_MODEL_CLASS(class)    (G_TYPE_CHECK_CLASS_CAST ((class), INPUT_PAD_TYPE_GTK_TREE_MODEL, InputPadGtkTreeModelClass))
+#define INPUT_PAD_IS_GTK_TREE_MODEL(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), INPUT_PAD_TYPE_GTK_TREE_MODEL))
+
+/* The columns are shared by the custom char views and the all char
+ * view. START_COL is the row number for the pad groups and tables. */
+enum {
+    CHAR_BLOCK_LABEL_COL = 0,
+    CHAR_BLOCK_UNICODE_COL,
+    CHAR_BLOCK_UTF8_COL,
+    CHAR_BLOCK_START_COL,
+    CHAR_BLOCK_END_COL,
+    CHAR_BLOCK_VISIBLE_COL,
+    CHAR_BLOCK_N_COLS,
+};
+
+typedef struct _InputPadGtkTreeModel InputPadGtkTreeModel;
+typedef struct _InputPadGtkTreeModelPrivate InputPadGtkTreeModelPrivate;
+typedef struct _InputPadGtkTreeModelClass InputPadGtkTreeModelClass;
+
+struct _InputPadGtkTreeModel
+{
+    GObject parent;
+
+    /*< private >*/
+    InputPadGtkTreeModelPrivate        *priv;
+};
+
+struct _InputPadGtkTreeModelClass
+{
+    GObjectClass parent_class;
+
+    /*< private >*/
+
+    /* Padding for future expansion */
+    void (*_gtk_reserved1) (void);
+    void (*_gtk_reserved2) (void);
+    void (*_gtk_reserved3) (void);
+    void (*_gtk_reserved4) (void);
+};
+
+GType               input_pad_gtk_tree_model_get_type (void);
+GtkTreeModel *      input_pad_gtk_tree_model_new_with_groups
+                                       (InputPadGroup           *group);
+GtkTreeModel *      input_pad_gtk_tree_model_new_with_tables
+                                       (InputPadGroup           *group);
+GtkTreeModel *      input_pad_gtk_tree_model_new_with_unicode_blocks
+                                       (void);
+void                input_pad_gtk_tree_model_set_group
+                                       (InputPadGtkTreeModel    *model,
+                                        InputPadGroup           *group);
+InputPadGroup *     input_pad_gtk_tree_model_iter_get_group
+                                       (InputPadGtkTreeModel    *model,
+                                        GtkTreeIter             *iter);
+InputPadTable *     input_pad_gtk_tree_model_iter_get_table
+                                       (InputPadGtkTreeModel    *model,
+                                        GtkTreeIter             *iter);
+
+G_END_DECLS
+
+#endif
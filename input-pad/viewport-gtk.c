@@ -50,6 +50,13 @@ struct _InputPadGtkViewportPrivate
     unsigned int    table_code_min;
     unsigned int    table_code_max;
 
+    /* The custom tables have table_n_columns buttons in a row and
+     * fill_func sets the item of the scrolled position to the buttons. */
+    unsigned int    table_n_columns;
+    InputPadGtkViewportFillFunc
+                    fill_func;
+    gpointer        fill_data;
+
     /* Do not use gtk_adjustment_configure() directly.
      * When input_pad_gtk_viewport_new() is called,
      * input_pad_gtk_viewport_set_vadjustment() is called with set_property
@@ -136,6 +143,23 @@ input_pad_gtk_viewport_vadjustment_value_changed_cb (GtkAdjustment *vadjustment,
         return;
 
     row = (int) (value / step);
+    if (priv->fill_func) {
+        num = row * priv->table_n_columns;
+        list = gtk_container_get_children (GTK_CONTAINER (table));
+        list = g_list_reverse (list);
+        orig_list = list;
+        while (list != NULL) {
+            GtkWidget *button = list->data;
+            if (num >= max)
+                priv->fill_func (button, -1, priv->fill_data);
+            else
+                priv->fill_func (button, (int) num++, priv->fill_data);
+            list = list->next;
+        }
+        g_list_free (orig_list);
+        return;
+    }
+
     start = min + row * INPUT_PAD_MAX_COLUMN;
 #if 0
     end = start + INPUT_PAD_MAX_COLUMN * INPUT_PAD_MAX_WINDOW_ROW - 1;
@@ -344,6 +368,9 @@ input_pad_gtk_viewport_table_configure (InputPadGtkViewport *viewport,
     priv->table = table;
     priv->table_code_min = min;
     priv->table_code_max = max;
+    priv->table_n_columns = INPUT_PAD_MAX_COLUMN;
+    priv->fill_func = NULL;
+    priv->fill_data = NULL;
 
     upper = (priv->table_code_max - priv->table_code_min + 1)
             / INPUT_PAD_MAX_COLUMN;
@@ -362,3 +389,46 @@ input_pad_gtk_viewport_table_configure (InputPadGtkViewport *viewport,
 
     update_scrollbar_adjustment (viewport);
 }
+
+void
+input_pad_gtk_viewport_table_configure_with_func (InputPadGtkViewport *viewport,
+                                                  GtkWidget           *table,
+                                                  unsigned int         n_items,
+                                                  unsigned int         n_columns,
+                                                  InputPadGtkViewportFillFunc
+                                                                       fill_func,
+                                                  gpointer             data)
+{
+    InputPadGtkViewportPrivate *priv;
+    unsigned int rows;
+
+    g_return_if_fail (INPUT_PAD_IS_GTK_VIEWPORT (viewport));
+    g_return_if_fail (GTK_IS_GRID (table));
+    g_return_if_fail (n_columns > 0);
+    g_return_if_fail (fill_func != NULL);
+
+    priv = viewport->priv;
+
+    /* The table has INPUT_PAD_MAX_WINDOW_ROW rows of buttons only and
+     * the buttons are refilled when the view is scrolled. */
+    priv->table = table;
+    priv->table_code_min = 0;
+    priv->table_code_max = n_items;
+    priv->table_n_columns = n_columns;
+    priv->fill_func = fill_func;
+    priv->fill_data = data;
+
+    rows = n_items / n_columns;
+    if (n_items % n_columns > 0)
+        rows++;
+    if (rows >= INPUT_PAD_MAX_WINDOW_ROW)
+        priv->upper = (double) ((rows - INPUT_PAD_MAX_WINDOW_ROW + 1)
+                                * INPUT_PAD_STEP_INCREMENT
+                                + INPUT_PAD_PAGE_INCREMENT);
+
+    priv->step_increment = INPUT_PAD_STEP_INCREMENT;
+    priv->page_increment = INPUT_PAD_PAGE_INCREMENT;
+    priv->page_size = INPUT_PAD_PAGE_SIZE;
+
+    update_scrollbar_adjustment (viewport);
+}
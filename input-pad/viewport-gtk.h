@@ -39,6 +39,16 @@ typedef struct _InputPadGtkViewport InputPadGtkViewport;
 typedef struct _InputPadGtkViewportPrivate InputPadGtkViewportPrivate;
 typedef struct _InputPadGtkViewportClass InputPadGtkViewportClass;
 
+/**
+ * InputPadGtkViewportFillFunc:
+ * @button: The recycled button in the table.
+ * @nth: The item index to be shown in @button or -1 for an empty slot.
+ * @data: The user data.
+ */
+typedef void (* InputPadGtkViewportFillFunc)  (GtkWidget               *button,
+                                               int                      nth,
+                                               gpointer                 data);
+
 struct _InputPadGtkViewport
 {
     GtkBin bin;
@@ -72,6 +82,14 @@ void                input_pad_gtk_viewport_table_configure
                                         GtkWidget               *table,
                                         unsigned int             min,
                                         unsigned int             max);
+void                input_pad_gtk_viewport_table_configure_with_func
+                                       (InputPadGtkViewport     *viewport,
+                                        GtkWidget               *table,
+                                        unsigned int             n_items,
+                                        unsigned int             n_columns,
+                                        InputPadGtkViewportFillFunc
+                                                                 fill_func,
+                                        gpointer                 data);
 
 G_END_DECLS
 
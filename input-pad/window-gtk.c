@@ -27,6 +27,7 @@
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h> /* IsModifierKey */
 #include <X11/keysym.h>
 #include <string.h> /* strlen */
 
@@ -37,6 +38,7 @@
 #include "i18n.h"
 #include "button-gtk.h"
 #include "combobox-gtk.h"
+#include "command-pad.h"
 #include "geometry-gdk.h"
 #include "input-pad.h"
 #include "input-pad-group.h"
@@ -44,14 +46,18 @@
 #include "input-pad-marshal.h"
 #include "input-pad-private.h"
 #include "input-pad-window-gtk.h"
-#include "unicode_block.h"
+#include "treemodel-gtk.h"
 #include "viewport-gtk.h"
+#include "xstats-gdk.h"
 
 #define N_KEYBOARD_LAYOUT_PART 3
 #define INPUT_PAD_UI_FILE INPUT_PAD_UI_GTK_DIR "/input-pad.ui"
 #define MAX_UCODE 0x10ffff
 #define MODULE_NAME_PREFIX "input-pad-"
 #define USE_GLOBAL_GMODULE 1
+#define KEYBOARD_LABELS_PRERENDER_KEYS 8
+#define COMMAND_TIMEOUT 10000
+#define LAYOUT_SWITCH_TIMEOUT 1000
 
 #if GTK_CHECK_VERSION (3, 19, 10)
 #  define CSS_DATA_NARROW_BUTTON \
@@ -103,6 +109,13 @@ typedef struct _CodePointData CodePointData;
 typedef struct _KeyboardLayoutPart KeyboardLayoutPart;
 typedef struct _CharTreeViewData CharTreeViewData;
 typedef struct _TableForEachData TableForEachData;
+typedef struct _CustomCharViewData CustomCharViewData;
+typedef struct _SearchCharViewData SearchCharViewData;
+typedef struct _KeyboardLabel KeyboardLabel;
+typedef struct _SendKeyJob SendKeyJob;
+typedef struct _SendKeyWorker SendKeyWorker;
+typedef struct _CommandRun CommandRun;
+typedef struct _CommandCache CommandCache;
 typedef struct _InputPadGtkApplicationClass InputPadGtkApplicationClass;
 
 enum {
@@ -135,16 +148,6 @@ enum {
     LAYOUT_N_COLS,
 };
 
-enum {
-    CHAR_BLOCK_LABEL_COL = 0,
-    CHAR_BLOCK_UNICODE_COL,
-    CHAR_BLOCK_UTF8_COL,
-    CHAR_BLOCK_START_COL,
-    CHAR_BLOCK_END_COL,
-    CHAR_BLOCK_VISIBLE_COL,
-    CHAR_BLOCK_N_COLS,
-};
-
 struct _InputPadGtkApplication
 {
     GtkApplication     parent;
@@ -164,11 +167,39 @@ G_DEFINE_TYPE(InputPadGtkApplication, input_pad_gtk_application, GTK_TYPE_APPLIC
 
 struct _InputPadGtkWindowPrivate {
     InputPadGroup              *group;
+    InputPadGroupIndex         *group_index;
     guint                       show_all : 1;
     GModule                    *module_gdk_xtest;
+    /* The key events are sent by the thread with its own display. */
+    SendKeyWorker              *send_key_worker;
+    gboolean                    send_key_worker_failed;
+    /* The running COMMANDS entries. The key is CommandRun.command. */
+    GHashTable                 *command_runs;
+    InputPadCommandHelper      *command_helper;
+    /* The outputs of the COMMANDS entries with <cache>. */
+    GHashTable                 *command_cache;
     InputPadXKBKeyList         *xkb_key_list;
+    /* xkb_key_list is saved here while a layout is previewed. */
+    InputPadXKBKeyList         *preview_saved_key_list;
+    gboolean                    preview_keymap_changed;
     guint                       keyboard_state;
+    guint                       keyboard_group;
+    /* The buttons of the default keyboard layout and their labels. */
+    GPtrArray                  *keyboard_buttons;
+    GHashTable                 *keyboard_labels;
+    guint                       keyboard_labels_idle_id;
+    guint                       keyboard_labels_nth_key;
     InputPadXKBConfigReg       *xkb_config_reg;
+    GCancellable               *xkb_config_reg_cancellable;
+    /* The last requested layout is applied in idle and the keyboard
+     * is updated when the server notifies the new keymap. */
+    gchar                      *layout_switch_layout;
+    gchar                      *layout_switch_variant;
+    gchar                      *layout_switch_option;
+    guint                       layout_switch_idle_id;
+    guint                       layout_switch_timeout_id;
+    GCancellable               *layout_switch_cancellable;
+    gboolean                    layout_switch_pending;
     gchar                     **group_layouts;
     gchar                     **group_variants;
     gchar                     **group_options;
@@ -181,8 +212,13 @@ struct _InputPadGtkWindowPrivate {
     GtkWidget                  *config_layouts_add_treeview;
     GtkWidget                  *config_layouts_remove_treeview;
     GtkWidget                  *config_layouts_combobox;
+    gchar                      *config_layouts_search_text;
     GtkWidget                  *config_options_dialog;
     GtkWidget                  *config_options_vbox;
+    /* The checked options are kept here since the check buttons are
+     * created when the option group is expanded. */
+    GHashTable                 *config_options_checked;
+    GtkWidget                  *custom_char_search_entry;
 
     GtkWidget                  *top_custom_char_view_hbox;
     GtkWidget                  *top_char_view_hbox;
@@ -203,6 +239,61 @@ struct _TableForEachData {
     InputPadGtkWindow          *window;
 };
 
+struct _KeyboardLabel {
+    gchar                      *display_name;
+    const gchar                *tooltip;
+    GdkPixbuf                  *pixbuf;
+};
+
+struct _SendKeyJob {
+    guint                       keysym;
+    guint                       keycode;
+    guint                       state;
+};
+
+/* The keys are sent by the thread with its own X connection. */
+struct _SendKeyWorker {
+    Display                    *display;
+    GAsyncQueue                *queue;
+    GThread                    *thread;
+};
+
+/* A COMMANDS entry runs once at a time and the output is sent with
+ * the keys of the press when the child exits. */
+struct _CommandRun {
+    InputPadGtkWindow          *window;
+    gchar                      *command;
+    /* subprocess is NULL when command_helper runs the command. */
+    GSubprocess                *subprocess;
+    GCancellable               *cancellable;
+    guint                       timeout_id;
+    guint                       keysym;
+    guint                       keycode;
+    guint                       state;
+    /* The run to refresh the cache does not send the output. */
+    gboolean                    send_output;
+    gboolean                    store_output;
+    /* The run is not in command_runs after the window is destroyed. */
+    gboolean                    detached;
+};
+
+struct _CommandCache {
+    gchar                      *output;
+    gint64                      time;
+};
+
+struct _CustomCharViewData {
+    InputPadTable              *table_data;
+    gchar                     **char_table;
+    int                        *nth;
+    int                         n_items;
+};
+
+struct _SearchCharViewData {
+    InputPadGroupIndexHit      *hits;
+    int                         n_hits;
+};
+
 struct _KeyboardLayoutPart {
     int                         key_row_id;
     int                         row;
@@ -281,18 +372,27 @@ static void             char_label_set_code_point
                                                  guint              code);
 static void             set_code_point_base     (CodePointData     *cp_data,
                                                  int                n_encoding);
-static InputPadGroup *  get_nth_pad_group       (InputPadGroup     *group,
-                                                 int                nth);
-static InputPadTable *  get_nth_pad_table       (InputPadTable     *table,
-                                                 int                nth);
-static void             run_command             (const gchar       *command,
-                                                 gchar            **command_output);
+static void             command_run_start       (InputPadGtkWindow *window,
+                                                 const gchar       *command,
+                                                 guint              keysym,
+                                                 guint              keycode,
+                                                 guint              state);
+static void             command_run_cancel_all  (InputPadGtkWindow *window);
+static void             command_cache_clear     (InputPadGtkWindow *window);
 static void             append_custom_char_view_table
                                                 (GtkWidget         *scrolled,
                                                  InputPadTable     *table_data);
 static void             destroy_custom_char_view_table
                                                 (GtkWidget         *scrolled,
                                                  InputPadGtkWindow *window);
+static void             append_search_char_view_table
+                                                (GtkWidget         *scrolled,
+                                                 InputPadGroupIndexHit
+                                                                   *hits,
+                                                 InputPadGtkWindow *window);
+static void             update_group_index      (InputPadGtkWindow *window);
+static void             keyboard_labels_prerender_stop
+                                                (InputPadGtkWindow *window);
 static char *           get_keysym_display_name (guint              keysym,
                                                  GtkWidget         *widget,
                                                  gchar            **tooltipp);
@@ -302,6 +402,8 @@ static void             create_keyboard_layout_ui_real_default
 G_INLINE_FUNC void      create_keyboard_layout_ui_real
                                                 (GtkWidget         *vbox,
                                                  InputPadGtkWindow *window);
+static void             reload_keyboard_layout  (InputPadGtkWindow *window,
+                                                 GtkWidget         *keyboard_vbox);
 static void             destroy_prev_keyboard_layout_default
                                                 (GtkWidget         *vbox,
                                                  InputPadGtkWindow *window);
@@ -314,6 +416,14 @@ static void             config_layouts_combobox_remove_layout
                                                  const gchar *layout_desc,
                                                  const gchar *variant_name,
                                                  const gchar *variant_desc);
+static void             config_layouts_combobox_append_layout
+                                                (GtkTreeStore *list,
+                                                 const gchar *layout_name,
+                                                 const gchar *layout_desc,
+                                                 const gchar *variant_name,
+                                                 const gchar *variant_desc);
+static GtkListStore *   config_layouts_add_list_get
+                                                (InputPadGtkWindow *window);
 static void             config_layouts_list_append_layout
                                                 (GtkListStore *list,
                                                  const gchar *layout_name,
@@ -326,9 +436,6 @@ static void             config_layouts_list_remove_iter
 static void             create_keyboard_layout_list_ui_real
                                                 (GtkWidget         *vbox,
                                                  InputPadGtkWindow *window);
-static GtkTreeModel *   custom_char_table_model_new
-                                                (InputPadGtkWindow *window,
-                                                 InputPadTable     *table);
 static void             create_custom_char_views
                                                 (GtkWidget         *hbox,
                                                  InputPadGtkWindow *window);
@@ -356,6 +463,119 @@ G_DEFINE_TYPE_WITH_PRIVATE (InputPadGtkWindow,
                             input_pad_gtk_window,
                             GTK_TYPE_APPLICATION_WINDOW);
 
+static void
+keyboard_label_free (gpointer data)
+{
+    KeyboardLabel *label = (KeyboardLabel *) data;
+
+    g_free (label->display_name);
+    g_object_unref (label->pixbuf);
+    g_slice_free (KeyboardLabel, label);
+}
+
+/* The rendered keysym labels are kept in the window so that the
+ * keyboard buttons swap the images without rendering them again. */
+static const KeyboardLabel *
+keyboard_label_lookup (InputPadGtkWindow *window, guint keysym)
+{
+    KeyboardLabel *label;
+    gchar *tooltip = NULL;
+
+    if (window->priv->keyboard_labels == NULL) {
+        window->priv->keyboard_labels =
+            g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                   NULL, keyboard_label_free);
+    }
+    label = g_hash_table_lookup (window->priv->keyboard_labels,
+                                 GUINT_TO_POINTER (keysym));
+    if (label) {
+        return label;
+    }
+    label = g_slice_new0 (KeyboardLabel);
+    label->display_name = get_keysym_display_name (keysym,
+                                                   GTK_WIDGET (window),
+                                                   &tooltip);
+    label->tooltip = tooltip;
+    label->pixbuf = input_pad_gtk_button_render_label (label->display_name,
+                                                       KEYBOARD_ICON_SIZE);
+    g_hash_table_insert (window->priv->keyboard_labels,
+                         GUINT_TO_POINTER (keysym), label);
+    return label;
+}
+
+/* Renders the labels of all the groups and levels of a few keys in
+ * each idle so that the group and Shift switches only swap the images. */
+static gboolean
+keyboard_labels_prerender_idle (gpointer data)
+{
+    InputPadGtkWindow *window = INPUT_PAD_GTK_WINDOW (data);
+    InputPadXKBKeyList *xkb_key_list;
+    InputPadXKBKeyRow *key_row;
+    guint n_keys, end;
+    int g, l;
+
+    g_return_val_if_fail (window->priv != NULL, FALSE);
+
+    xkb_key_list = window->priv->xkb_key_list;
+    if (xkb_key_list == NULL) {
+        window->priv->keyboard_labels_idle_id = 0;
+        return FALSE;
+    }
+    n_keys = input_pad_gdk_xkb_key_list_get_n_keys (xkb_key_list);
+    end = MIN (window->priv->keyboard_labels_nth_key + KEYBOARD_LABELS_PRERENDER_KEYS,
+               n_keys);
+    for (; window->priv->keyboard_labels_nth_key < end;
+         window->priv->keyboard_labels_nth_key++) {
+        key_row = input_pad_gdk_xkb_key_list_get_nth_key (xkb_key_list,
+                                                          window->priv->keyboard_labels_nth_key);
+        for (g = 0; key_row->keysym && key_row->keysym[g]; g++) {
+            for (l = 0; key_row->keysym[g][l]; l++) {
+                keyboard_label_lookup (window, key_row->keysym[g][l]);
+            }
+        }
+    }
+    if (end < n_keys) {
+        return TRUE;
+    }
+    window->priv->keyboard_labels_idle_id = 0;
+    return FALSE;
+}
+
+static void
+keyboard_labels_prerender_start (InputPadGtkWindow *window)
+{
+    keyboard_labels_prerender_stop (window);
+    window->priv->keyboard_labels_nth_key = 0;
+    window->priv->keyboard_labels_idle_id =
+        gdk_threads_add_idle_full (G_PRIORITY_LOW,
+                                   keyboard_labels_prerender_idle,
+                                   window, NULL);
+}
+
+static void
+keyboard_labels_prerender_stop (InputPadGtkWindow *window)
+{
+    if (window->priv->keyboard_labels_idle_id == 0) {
+        return;
+    }
+    g_source_remove (window->priv->keyboard_labels_idle_id);
+    window->priv->keyboard_labels_idle_id = 0;
+}
+
+static void
+keyboard_button_set_keysym_label (InputPadGtkWindow *window,
+                                  InputPadGtkButton *button,
+                                  guint              keysym)
+{
+    const KeyboardLabel *label = keyboard_label_lookup (window, keysym);
+
+    input_pad_gtk_button_set_keysym (button, keysym);
+    input_pad_gtk_button_set_label_pixbuf (button,
+                                           label->display_name,
+                                           label->pixbuf);
+    gtk_widget_set_tooltip_text (GTK_WIDGET (button), label->tooltip);
+}
+
 static void
 on_window_keyboard_changed (InputPadGtkWindow *window,
                             gint               group,
@@ -363,30 +583,29 @@ on_window_keyboard_changed (InputPadGtkWindow *window,
 {
     InputPadGtkButton *button;
     guint **keysyms;
-    int i = 0;
-    gchar *tooltip, *display_name;
+    guint i, n;
 
     g_return_if_fail (window != NULL &&
                       INPUT_PAD_IS_GTK_WINDOW (window));
-    g_return_if_fail (data != NULL &&
-                      INPUT_PAD_IS_GTK_BUTTON (data));
 
-    button = INPUT_PAD_GTK_BUTTON (data);
-    keysyms = input_pad_gtk_button_get_all_keysyms (button);
-    g_return_if_fail (keysyms != NULL);
-    while (keysyms[i]) i++;
-    if (group >= i) {
+    if (window->priv == NULL || window->priv->keyboard_buttons == NULL) {
         return;
     }
 
-    input_pad_gtk_button_set_keysym_group (button, group);
-    input_pad_gtk_button_set_keysym (button, keysyms[group][0]);
-    display_name = get_keysym_display_name (keysyms[group][0],
-                                            GTK_WIDGET (window), &tooltip);
-    input_pad_gtk_button_set_label_size (button, display_name,
-                                         KEYBOARD_ICON_SIZE);
-    gtk_widget_set_tooltip_text (GTK_WIDGET (button), tooltip);
-    g_free (display_name);
+    /* One handler updates all the keyboard buttons. */
+    for (i = 0; i < window->priv->keyboard_buttons->len; i++) {
+        button = INPUT_PAD_GTK_BUTTON (g_ptr_array_index (window->priv->keyboard_buttons, i));
+        keysyms = input_pad_gtk_button_get_all_keysyms (button);
+        if (keysyms == NULL) {
+            continue;
+        }
+        for (n = 0; keysyms[n]; n++);
+        if ((guint) group >= n) {
+            continue;
+        }
+        input_pad_gtk_button_set_keysym_group (button, group);
+        keyboard_button_set_keysym_label (window, button, keysyms[group][0]);
+    }
 }
 
 static void
@@ -461,6 +680,8 @@ on_window_group_changed_custom_char_views (InputPadGtkWindow *window,
     if (custom_group != NULL) {
         input_pad_group_destroy (window->priv->group);
         window->priv->group = custom_group;
+        update_group_index (window);
+        command_cache_clear (window);
     }
     create_custom_char_views (hbox, window);
 }
@@ -488,6 +709,8 @@ on_window_group_appended_custom_char_views (InputPadGtkWindow *window,
     }
     if (custom_group != NULL) {
         window->priv->group = custom_group;
+        update_group_index (window);
+        command_cache_clear (window);
     }
     create_custom_char_views (hbox, window);
 }
@@ -553,12 +776,11 @@ static void
 on_button_shift_clicked (GtkButton *button, gpointer data)
 {
     InputPadGtkButton *gen_button;
+    GtkWidget *window;
     guint current_keysym;
     guint new_keysym = 0;
     int i, group;
     guint **keysyms;
-    gchar *tooltip;
-    gchar *display_name;
 
     g_return_if_fail (INPUT_PAD_IS_GTK_BUTTON (data));
     gen_button = INPUT_PAD_GTK_BUTTON (data);
@@ -583,14 +805,12 @@ on_button_shift_clicked (GtkButton *button, gpointer data)
         new_keysym = keysyms[group][0];
     }
     if (new_keysym) {
-        display_name = get_keysym_display_name (new_keysym,
-                                                GTK_WIDGET (button),
-                                                &tooltip);
-        input_pad_gtk_button_set_keysym (gen_button, new_keysym);
-        input_pad_gtk_button_set_label_size (gen_button, display_name,
-                                             KEYBOARD_ICON_SIZE);
-        g_free (display_name);
-        gtk_widget_set_tooltip_text (GTK_WIDGET (gen_button), tooltip);
+        window = gtk_widget_get_ancestor (GTK_WIDGET (gen_button),
+                                          INPUT_PAD_TYPE_GTK_WINDOW);
+        g_return_if_fail (INPUT_PAD_IS_GTK_WINDOW (window));
+        keyboard_button_set_keysym_label (INPUT_PAD_GTK_WINDOW (window),
+                                          gen_button,
+                                          new_keysym);
     }
 }
 
@@ -653,52 +873,8 @@ on_button_up_pressed (GtkButton *button, gpointer data)
 }
 
 static void
-on_combobox_layout_changed (GtkComboBox *combobox,
-                            gpointer     data)
+update_group_layouts (InputPadGtkWindow *window)
 {
-    InputPadGtkWindow *window;
-    GtkTreeIter iter;
-    GtkTreeModel *model;
-    gchar *layout = NULL;
-    gchar *variant = NULL;
-    gchar *option = NULL;
-    GtkWidget *keyboard_vbox;
-
-    g_return_if_fail (data != NULL &&
-                      INPUT_PAD_IS_GTK_WINDOW (data));
-
-    window = INPUT_PAD_GTK_WINDOW (data);
-    if (!gtk_combo_box_get_active_iter (combobox, &iter)) {
-        return;
-    }
-    model = gtk_combo_box_get_model (combobox);
-    gtk_tree_model_get (model, &iter,
-                        LAYOUT_LAYOUT_NAME_COL, &layout,
-                        LAYOUT_VARIANT_NAME_COL, &variant, -1);
-    if (window->priv->group_options) {
-        option = g_strjoinv (",", window->priv->group_options);
-    }
-    input_pad_gdk_xkb_set_layout (window, window->priv->xkb_key_list,
-                                  layout, variant, option);
-    g_free (layout);
-    g_free (variant);
-    g_free (option);
-
-    if (window->priv->xkb_key_list) {
-        input_pad_gdk_xkb_destroy_keyboard_layouts (window,
-                                                    window->priv->xkb_key_list);
-        window->priv->xkb_key_list = NULL;
-    }
-    window->priv->xkb_key_list =
-        input_pad_gdk_xkb_parse_keyboard_layouts (window);
-    if (window->priv->kbdui_name && window->priv->xkb_key_list == NULL) {
-        return;
-    }
-
-    keyboard_vbox = gtk_widget_get_parent (gtk_widget_get_parent (GTK_WIDGET (combobox)));
-    destroy_prev_keyboard_layout (keyboard_vbox, window);
-    create_keyboard_layout_ui_real (keyboard_vbox, window);
-
     if (window->priv->group_layouts) {
         g_strfreev (window->priv->group_layouts);
         window->priv->group_layouts = NULL;
@@ -724,160 +900,734 @@ on_combobox_layout_changed (GtkComboBox *combobox,
 }
 
 static void
-xor_modifiers (InputPadGtkWindow *window, guint modifiers)
+keyboard_preview_drop (InputPadGtkWindow *window)
 {
-    guint state = window->priv->keyboard_state;
-
-    if (state & modifiers) {
-        state ^= modifiers;
-    } else {
-        state |= modifiers;
+    if (window->priv->preview_saved_key_list == NULL) {
+        return;
     }
-    window->priv->keyboard_state = state;
+    input_pad_gdk_xkb_destroy_keyboard_layouts (window,
+                                                window->priv->preview_saved_key_list);
+    window->priv->preview_saved_key_list = NULL;
+    window->priv->preview_keymap_changed = FALSE;
 }
 
-/*
- * % xterm -xrm "XTerm*allowSendEvents: true"
- */
-static int
-send_key_event (GdkWindow      *gdkwindow,
-                guint           keysym,
-                guint           keycode,
-                guint           state)
+static void
+reload_keyboard_layout (InputPadGtkWindow *window, GtkWidget *keyboard_vbox)
 {
-    XEvent xevent;
-    Window input_focus;
-    int revert;
-
-    XGetInputFocus (GDK_WINDOW_XDISPLAY (gdkwindow), &input_focus, &revert);
-    if (input_focus == (Window) 0) {
-        g_warning ("WARNING: Could not get a focused window.");
-        return FALSE;
+    /* The preview is replaced with the new session keymap. */
+    keyboard_preview_drop (window);
+    if (window->priv->xkb_key_list) {
+        input_pad_gdk_xkb_destroy_keyboard_layouts (window,
+                                                    window->priv->xkb_key_list);
+        window->priv->xkb_key_list = NULL;
     }
-
-    xevent.type = KeyPress;
-    xevent.xkey.type = KeyPress;
-    xevent.xkey.serial = 0L;
-    xevent.xkey.send_event = True;
-    xevent.xkey.display = GDK_WINDOW_XDISPLAY (gdkwindow);
-    xevent.xkey.root = XDefaultRootWindow (xevent.xkey.display);
-    xevent.xkey.window = input_focus;
-    xevent.xkey.subwindow = xevent.xkey.window;
-    xevent.xkey.time = CurrentTime;
-    xevent.xkey.state = state;
-    if (keycode) {
-        xevent.xkey.keycode = keycode;
-    } else {
-        xevent.xkey.keycode = XKeysymToKeycode (xevent.xkey.display,
-                                                (KeySym) keysym);
+    window->priv->xkb_key_list =
+        input_pad_gdk_xkb_parse_keyboard_layouts (window);
+    if (window->priv->kbdui_name && window->priv->xkb_key_list == NULL) {
+        return;
     }
-    xevent.xkey.same_screen = True;
-    XSendEvent (xevent.xkey.display, xevent.xkey.window, True,
-                KeyPressMask, &xevent);
-
-    XSync (xevent.xkey.display, False);
-    xevent.type = KeyRelease;
-    xevent.xkey.type = KeyRelease;
-    XSendEvent (xevent.xkey.display, xevent.xkey.window, True,
-                KeyReleaseMask, &xevent);
-    XSync (xevent.xkey.display, False);
 
-    return TRUE;
+    destroy_prev_keyboard_layout (keyboard_vbox, window);
+    create_keyboard_layout_ui_real (keyboard_vbox, window);
+    update_group_layouts (window);
 }
 
-#if 0
-/* deprecated */
-static guint
-get_state (const char *str, guint keysym)
+/* Called when the server notified the keymap of the requested layout,
+ * the layout did not change the keymap or the notification did not
+ * come in LAYOUT_SWITCH_TIMEOUT. */
+static void
+layout_switch_finish (InputPadGtkWindow *window, gboolean need_reload)
 {
-    guint state = 0;
-
-    if (!str || !*str || keysym > 0x7f) {
-        return 0;
+    if (!window->priv->layout_switch_pending) {
+        return;
     }
-    if (*str >= 'A' && *str <= 'Z') {
-        return ShiftMask;
+    window->priv->layout_switch_pending = FALSE;
+    if (window->priv->layout_switch_timeout_id) {
+        g_source_remove (window->priv->layout_switch_timeout_id);
+        window->priv->layout_switch_timeout_id = 0;
     }
-    switch (*str) {
-    case '!':
-    case '\"':
-    case '#':
-    case '$':
-    case '%':
-    case '&':
-    case '\'':
-    case '(':
-    case ')':
-    case '~':
-    case '=':
-    case '|':
-    case '{':
-    case '}':
-    case '`':
-    case '+':
-    case '*':
-    case '?':
-    case '_':
-        state = ShiftMask;
-        break;
-    default:;
+    if (need_reload) {
+        reload_keyboard_layout (window,
+                                window->priv->top_keyboard_layout_vbox);
+    } else {
+        update_group_layouts (window);
     }
-    return state;
 }
-#endif
 
-static void
-on_button_send_clicked (GtkButton *button, gpointer data)
+static gboolean
+on_layout_switch_timeout (gpointer data)
 {
-    CodePointData *cp_data;
-    const gchar *str;
-    guint code;
-    guint state = 0;
-    gboolean retval = FALSE;
-    InputPadTableType  type;
-
-    cp_data = (CodePointData *) data;
-    g_return_if_fail (GTK_IS_LABEL (cp_data->char_label));
-    g_return_if_fail (GTK_IS_CONTAINER (cp_data->digit_hbox));
-    g_return_if_fail (GTK_IS_WIDGET (cp_data->signal_window));
+    InputPadGtkWindow *window = INPUT_PAD_GTK_WINDOW (data);
 
-    str = gtk_label_get_label (GTK_LABEL (cp_data->char_label));
-    /* Decided input-pad always sends char but not keysym.
-     * Now keyboard layout can be used instead. */
-#if 0
-    code = digit_hbox_get_code_point (cp_data->digit_hbox);
-    state = get_state (str, code);
-    if (code < 0x7f) {
-        type = INPUT_PAD_TABLE_TYPE_KEYSYMS;
-    } else {
-        type = INPUT_PAD_TABLE_TYPE_CHARS;
-        code = 0;
-    }
-#else
-    type = INPUT_PAD_TABLE_TYPE_CHARS;
-    code = 0;
-    state = 0;
-#endif
+    g_return_val_if_fail (window->priv != NULL, FALSE);
 
-    g_signal_emit (cp_data->signal_window, signals[BUTTON_PRESSED], 0,
-                   str, type, code, 0, state, &retval);
+    window->priv->layout_switch_timeout_id = 0;
+    layout_switch_finish (window, TRUE);
+    return FALSE;
 }
 
 static void
-on_button_config_layouts_clicked (GtkButton *button, gpointer data)
+on_layout_switch_done (GObject      *source,
+                       GAsyncResult *result,
+                       gpointer      data)
 {
-    GtkWidget *dlg = GTK_WIDGET (data);
-    GtkWidget *top_window = gtk_widget_get_toplevel (GTK_WIDGET (button));
-
-    gtk_window_set_transient_for (GTK_WINDOW (dlg), GTK_WINDOW (top_window));
-    gtk_dialog_run (GTK_DIALOG (dlg));
-    gtk_widget_hide (dlg);
-}
+    InputPadGtkWindow *window = INPUT_PAD_GTK_WINDOW (source);
+    gboolean keymap_changed = FALSE;
+    GError *error = NULL;
 
-static void
-on_button_config_layouts_close_clicked (GtkButton *button, gpointer data)
-{
-    GtkWidget *dlg = GTK_WIDGET (data);
+    if (!input_pad_gdk_xkb_set_layout_finish (window, result,
+                                              &keymap_changed, &error)) {
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_error_free (error);
+            return;
+        }
+        g_warning ("Could not switch the layout: %s", error->message);
+        g_error_free (error);
+        layout_switch_finish (window, TRUE);
+        return;
+    }
+    if (!keymap_changed) {
+        /* No XkbMapNotify comes for the group lock. */
+        layout_switch_finish (window, FALSE);
+        return;
+    }
+    /* XkbMapNotify might be already handled before setxkbmap exits. */
+    if (window->priv->layout_switch_pending &&
+        window->priv->layout_switch_timeout_id == 0) {
+        window->priv->layout_switch_timeout_id =
+            gdk_threads_add_timeout (LAYOUT_SWITCH_TIMEOUT,
+                                     on_layout_switch_timeout,
+                                     window);
+    }
+}
+
+static gboolean
+on_layout_switch_idle (gpointer data)
+{
+    InputPadGtkWindow *window = INPUT_PAD_GTK_WINDOW (data);
+    gchar *layout, *variant, *option;
+
+    g_return_val_if_fail (window->priv != NULL, FALSE);
+
+    window->priv->layout_switch_idle_id = 0;
+    layout = window->priv->layout_switch_layout;
+    variant = window->priv->layout_switch_variant;
+    option = window->priv->layout_switch_option;
+    window->priv->layout_switch_layout = NULL;
+    window->priv->layout_switch_variant = NULL;
+    window->priv->layout_switch_option = NULL;
+
+    if (window->priv->layout_switch_cancellable) {
+        g_cancellable_cancel (window->priv->layout_switch_cancellable);
+        g_object_unref (window->priv->layout_switch_cancellable);
+    }
+    if (window->priv->layout_switch_timeout_id) {
+        g_source_remove (window->priv->layout_switch_timeout_id);
+        window->priv->layout_switch_timeout_id = 0;
+    }
+    window->priv->layout_switch_cancellable = g_cancellable_new ();
+    window->priv->layout_switch_pending = TRUE;
+    input_pad_gdk_xkb_set_layout_async (window, window->priv->xkb_key_list,
+                                        layout, variant, option,
+                                        window->priv->layout_switch_cancellable,
+                                        on_layout_switch_done,
+                                        NULL);
+    g_free (layout);
+    g_free (variant);
+    g_free (option);
+    return FALSE;
+}
+
+/* The repeated requests before the idle are coalesced into the last one. */
+static void
+layout_switch_queue (InputPadGtkWindow *window,
+                     const gchar       *layout,
+                     const gchar       *variant,
+                     const gchar       *option)
+{
+    g_free (window->priv->layout_switch_layout);
+    g_free (window->priv->layout_switch_variant);
+    g_free (window->priv->layout_switch_option);
+    window->priv->layout_switch_layout = g_strdup (layout);
+    window->priv->layout_switch_variant = g_strdup (variant);
+    window->priv->layout_switch_option = g_strdup (option);
+    if (window->priv->layout_switch_idle_id == 0) {
+        window->priv->layout_switch_idle_id =
+            gdk_threads_add_idle (on_layout_switch_idle, window);
+    }
+}
+
+static void
+layout_switch_cancel (InputPadGtkWindow *window)
+{
+    if (window->priv->layout_switch_idle_id) {
+        g_source_remove (window->priv->layout_switch_idle_id);
+        window->priv->layout_switch_idle_id = 0;
+    }
+    if (window->priv->layout_switch_timeout_id) {
+        g_source_remove (window->priv->layout_switch_timeout_id);
+        window->priv->layout_switch_timeout_id = 0;
+    }
+    if (window->priv->layout_switch_cancellable) {
+        g_cancellable_cancel (window->priv->layout_switch_cancellable);
+        g_object_unref (window->priv->layout_switch_cancellable);
+        window->priv->layout_switch_cancellable = NULL;
+    }
+    window->priv->layout_switch_pending = FALSE;
+    g_free (window->priv->layout_switch_layout);
+    window->priv->layout_switch_layout = NULL;
+    g_free (window->priv->layout_switch_variant);
+    window->priv->layout_switch_variant = NULL;
+    g_free (window->priv->layout_switch_option);
+    window->priv->layout_switch_option = NULL;
+}
+
+static void
+on_combobox_layout_changed (GtkComboBox *combobox,
+                            gpointer     data)
+{
+    InputPadGtkWindow *window;
+    GtkTreeIter iter;
+    GtkTreeModel *model;
+    gchar *layout = NULL;
+    gchar *variant = NULL;
+    gchar *option = NULL;
+
+    g_return_if_fail (data != NULL &&
+                      INPUT_PAD_IS_GTK_WINDOW (data));
+
+    window = INPUT_PAD_GTK_WINDOW (data);
+    if (!gtk_combo_box_get_active_iter (combobox, &iter)) {
+        return;
+    }
+    model = gtk_combo_box_get_model (combobox);
+    gtk_tree_model_get (model, &iter,
+                        LAYOUT_LAYOUT_NAME_COL, &layout,
+                        LAYOUT_VARIANT_NAME_COL, &variant, -1);
+    if (window->priv->group_options) {
+        option = g_strjoinv (",", window->priv->group_options);
+    }
+    layout_switch_queue (window, layout, variant, option);
+    g_free (layout);
+    g_free (variant);
+    g_free (option);
+}
+
+static void
+keymap_notify_reload (InputPadGtkWindow *window, GtkWidget *keyboard_vbox)
+{
+    if (window->priv->layout_switch_pending) {
+        layout_switch_finish (window, TRUE);
+    } else {
+        reload_keyboard_layout (window, keyboard_vbox);
+    }
+}
+
+/* Only the keysyms of the changed keycodes are reloaded and the labels
+ * of the buttons are updated unless the geometry or the modifier keys,
+ * which have the own signal handlers, are changed. */
+static void
+on_xkb_keymap_notify (InputPadGtkWindow *window,
+                      unsigned int       first_keycode,
+                      unsigned int       n_keycodes,
+                      gboolean           new_keyboard)
+{
+    InputPadGtkButton *button;
+    GtkWidget *keyboard_vbox;
+    gboolean *was_modifier = NULL;
+    guint **keysyms;
+    guint keycode, group, i, n;
+    gboolean need_reload = FALSE;
+
+    g_return_if_fail (INPUT_PAD_IS_GTK_WINDOW (window));
+
+    if (window->priv == NULL || window->priv->xkb_key_list == NULL) {
+        return;
+    }
+    if (window->priv->preview_saved_key_list) {
+        /* The keymap is parsed again when the preview ends. */
+        window->priv->preview_keymap_changed = TRUE;
+        return;
+    }
+    keyboard_vbox = window->priv->top_keyboard_layout_vbox;
+    if (new_keyboard &&
+        input_pad_gdk_xkb_key_list_geometry_changed (window,
+                                                     window->priv->xkb_key_list)) {
+        keymap_notify_reload (window, keyboard_vbox);
+        return;
+    }
+
+    if (window->priv->keyboard_buttons) {
+        was_modifier = g_new0 (gboolean, window->priv->keyboard_buttons->len);
+        for (i = 0; i < window->priv->keyboard_buttons->len; i++) {
+            button = INPUT_PAD_GTK_BUTTON (g_ptr_array_index (window->priv->keyboard_buttons, i));
+            keysyms = input_pad_gtk_button_get_all_keysyms (button);
+            if (keysyms && keysyms[0]) {
+                was_modifier[i] = IsModifierKey (keysyms[0][0]);
+            }
+        }
+    }
+    if (!input_pad_gdk_xkb_key_list_update_keysyms (window,
+                                                    window->priv->xkb_key_list,
+                                                    first_keycode,
+                                                    n_keycodes)) {
+        g_free (was_modifier);
+        keymap_notify_reload (window, keyboard_vbox);
+        return;
+    }
+    if (window->priv->kbdui) {
+        /* The keyboard modules create the own keys from the key list. */
+        g_free (was_modifier);
+        destroy_prev_keyboard_layout (keyboard_vbox, window);
+        create_keyboard_layout_ui_real (keyboard_vbox, window);
+        /* layout_switch_finish() emits KBD_CHANGED when a layout switch
+         * is pending. */
+        if (window->priv->layout_switch_pending) {
+            layout_switch_finish (window, FALSE);
+        } else {
+            g_signal_emit (window, signals[KBD_CHANGED], 0,
+                           (gint) window->priv->keyboard_group);
+        }
+        return;
+    }
+    if (window->priv->keyboard_buttons == NULL) {
+        g_free (was_modifier);
+        layout_switch_finish (window, FALSE);
+        return;
+    }
+
+    group = window->priv->keyboard_group;
+    for (i = 0; i < window->priv->keyboard_buttons->len; i++) {
+        button = INPUT_PAD_GTK_BUTTON (g_ptr_array_index (window->priv->keyboard_buttons, i));
+        keycode = input_pad_gtk_button_get_keycode (button);
+        if (keycode < first_keycode || keycode >= first_keycode + n_keycodes) {
+            continue;
+        }
+        keysyms = input_pad_gtk_button_get_all_keysyms (button);
+        if (keysyms == NULL) {
+            continue;
+        }
+        if (keysyms[0] == NULL ||
+            was_modifier[i] != (gboolean) IsModifierKey (keysyms[0][0])) {
+            need_reload = TRUE;
+            break;
+        }
+        for (n = 0; keysyms[n]; n++);
+        input_pad_gtk_button_set_keysym_group (button, group < n ? group : 0);
+        keyboard_button_set_keysym_label (window, button,
+                                          keysyms[group < n ? group : 0][0]);
+    }
+    g_free (was_modifier);
+    if (need_reload) {
+        keymap_notify_reload (window, keyboard_vbox);
+    } else {
+        layout_switch_finish (window, FALSE);
+    }
+}
+
+/* Shows the layout selected in the Configure Layouts dialog with the
+ * keymap compiled locally without changing the session keymap. */
+static void
+keyboard_preview_set_layout (InputPadGtkWindow *window,
+                             const gchar       *layout,
+                             const gchar       *variant)
+{
+    InputPadXKBKeyList *template_list;
+    InputPadXKBKeyList *preview;
+    GtkWidget *keyboard_vbox;
+    gchar *option = NULL;
+
+    if (window->priv->kbdui) {
+        return;
+    }
+    template_list = window->priv->preview_saved_key_list ?
+        window->priv->preview_saved_key_list : window->priv->xkb_key_list;
+    if (template_list == NULL) {
+        return;
+    }
+    if (window->priv->group_options) {
+        option = g_strjoinv (",", window->priv->group_options);
+    }
+    preview = input_pad_gdk_xkb_compile_keyboard_layouts (template_list,
+                                                          layout,
+                                                          variant,
+                                                          option);
+    g_free (option);
+    if (preview == NULL) {
+        return;
+    }
+    if (window->priv->preview_saved_key_list == NULL) {
+        window->priv->preview_saved_key_list = window->priv->xkb_key_list;
+    } else {
+        input_pad_gdk_xkb_destroy_keyboard_layouts (window,
+                                                    window->priv->xkb_key_list);
+    }
+    window->priv->xkb_key_list = preview;
+    keyboard_vbox = window->priv->top_keyboard_layout_vbox;
+    destroy_prev_keyboard_layout (keyboard_vbox, window);
+    create_keyboard_layout_ui_real (keyboard_vbox, window);
+}
+
+static void
+keyboard_preview_restore (InputPadGtkWindow *window)
+{
+    GtkWidget *keyboard_vbox;
+
+    if (window->priv->preview_saved_key_list == NULL) {
+        return;
+    }
+    keyboard_vbox = window->priv->top_keyboard_layout_vbox;
+    if (window->priv->preview_keymap_changed) {
+        reload_keyboard_layout (window, keyboard_vbox);
+        return;
+    }
+    input_pad_gdk_xkb_destroy_keyboard_layouts (window,
+                                                window->priv->xkb_key_list);
+    window->priv->xkb_key_list = window->priv->preview_saved_key_list;
+    window->priv->preview_saved_key_list = NULL;
+    destroy_prev_keyboard_layout (keyboard_vbox, window);
+    create_keyboard_layout_ui_real (keyboard_vbox, window);
+    on_window_keyboard_changed (window, window->priv->keyboard_group, NULL);
+}
+
+static void
+xor_modifiers (InputPadGtkWindow *window, guint modifiers)
+{
+    guint state = window->priv->keyboard_state;
+
+    if (state & modifiers) {
+        state ^= modifiers;
+    } else {
+        state |= modifiers;
+    }
+    window->priv->keyboard_state = state;
+}
+
+/*
+ * % xterm -xrm "XTerm*allowSendEvents: true"
+ */
+static Window
+send_key_get_input_focus (Display *display)
+{
+    Window input_focus;
+    int revert;
+
+    XGetInputFocus (display, &input_focus, &revert);
+    if (input_focus == (Window) 0) {
+        g_warning ("WARNING: Could not get a focused window.");
+    }
+    return input_focus;
+}
+
+static int
+send_key_event_real (Display        *display,
+                     Window          input_focus,
+                     guint           keysym,
+                     guint           keycode,
+                     guint           state)
+{
+    XEvent xevent;
+
+    if (input_focus == (Window) 0) {
+        return FALSE;
+    }
+
+    xevent.type = KeyPress;
+    xevent.xkey.type = KeyPress;
+    xevent.xkey.serial = 0L;
+    xevent.xkey.send_event = True;
+    xevent.xkey.display = display;
+    xevent.xkey.root = XDefaultRootWindow (xevent.xkey.display);
+    xevent.xkey.window = input_focus;
+    xevent.xkey.subwindow = xevent.xkey.window;
+    xevent.xkey.time = CurrentTime;
+    xevent.xkey.state = state;
+    if (keycode) {
+        xevent.xkey.keycode = keycode;
+    } else {
+        xevent.xkey.keycode = XKeysymToKeycode (xevent.xkey.display,
+                                                (KeySym) keysym);
+    }
+    xevent.xkey.same_screen = True;
+    XSendEvent (xevent.xkey.display, xevent.xkey.window, True,
+                KeyPressMask, &xevent);
+
+    xevent.type = KeyRelease;
+    xevent.xkey.type = KeyRelease;
+    XSendEvent (xevent.xkey.display, xevent.xkey.window, True,
+                KeyReleaseMask, &xevent);
+
+    return TRUE;
+}
+
+static SendKeyJob send_key_quit_job;
+
+/* Reads the queued events without a round trip. */
+static void
+send_key_worker_process_events (SendKeyWorker *worker)
+{
+    XEvent xevent;
+
+    while (XPending (worker->display)) {
+        XNextEvent (worker->display, &xevent);
+        switch (xevent.type) {
+        case MappingNotify:
+            XRefreshKeyboardMapping (&xevent.xmapping);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static gpointer
+send_key_worker_thread (gpointer data)
+{
+    SendKeyWorker *worker = (SendKeyWorker *) data;
+    SendKeyJob *job;
+    InputPadXStatsScope scope;
+    Window focus = (Window) 0;
+    gboolean quit = FALSE;
+
+    while (!quit) {
+        job = (SendKeyJob *) g_async_queue_pop (worker->queue);
+        input_pad_gdk_xstats_scope_begin (&scope,
+                                          INPUT_PAD_XSTATS_OP_KEY_PRESS);
+        send_key_worker_process_events (worker);
+        /* The focus is asked once per burst and not cached across
+         * the bursts because it can move inside a toplevel without
+         * an event on the root window and a cached window can be
+         * destroyed. */
+        if (job != &send_key_quit_job) {
+            focus = send_key_get_input_focus (worker->display);
+        }
+        /* The jobs queued by the key repeat are sent with one flush. */
+        do {
+            if (job == &send_key_quit_job) {
+                quit = TRUE;
+                break;
+            }
+            send_key_event_real (worker->display, focus,
+                                 job->keysym, job->keycode, job->state);
+            g_slice_free (SendKeyJob, job);
+        } while ((job = (SendKeyJob *) g_async_queue_try_pop (worker->queue)) != NULL);
+        XSync (worker->display, False);
+        send_key_worker_process_events (worker);
+        input_pad_gdk_xstats_scope_end (&scope);
+    }
+    return NULL;
+}
+
+static gboolean
+send_key_worker_start (InputPadGtkWindow *window)
+{
+    SendKeyWorker *worker;
+    Display *display;
+    GError *error = NULL;
+
+    if (window->priv->send_key_worker) {
+        return TRUE;
+    }
+    if (window->priv->send_key_worker_failed) {
+        return FALSE;
+    }
+    display = GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET (window)));
+    worker = g_slice_new0 (SendKeyWorker);
+    worker->display = XOpenDisplay (DisplayString (display));
+    if (worker->display == NULL) {
+        g_warning ("Could not open the display: %s", DisplayString (display));
+        g_slice_free (SendKeyWorker, worker);
+        window->priv->send_key_worker_failed = TRUE;
+        return FALSE;
+    }
+    input_pad_gdk_xstats_attach_display (worker->display);
+    worker->queue = g_async_queue_new ();
+    worker->thread = g_thread_try_new ("input-pad-send-key",
+                                       send_key_worker_thread,
+                                       worker, &error);
+    if (worker->thread == NULL) {
+        g_warning ("Could not create the thread: %s",
+                   error ? error->message : "");
+        g_clear_error (&error);
+        g_async_queue_unref (worker->queue);
+        input_pad_gdk_xstats_detach_display (worker->display);
+        XCloseDisplay (worker->display);
+        g_slice_free (SendKeyWorker, worker);
+        window->priv->send_key_worker_failed = TRUE;
+        return FALSE;
+    }
+    window->priv->send_key_worker = worker;
+    return TRUE;
+}
+
+static void
+send_key_worker_stop (InputPadGtkWindow *window)
+{
+    SendKeyWorker *worker = window->priv->send_key_worker;
+
+    if (worker == NULL) {
+        return;
+    }
+    g_async_queue_push (worker->queue, &send_key_quit_job);
+    g_thread_join (worker->thread);
+    g_async_queue_unref (worker->queue);
+    input_pad_gdk_xstats_detach_display (worker->display);
+    XCloseDisplay (worker->display);
+    g_slice_free (SendKeyWorker, worker);
+    window->priv->send_key_worker = NULL;
+}
+
+static int
+send_key_event (InputPadGtkWindow *window,
+                guint              keysym,
+                guint              keycode,
+                guint              state)
+{
+    SendKeyJob *job;
+    Display *display;
+    int retval;
+
+    if (!send_key_worker_start (window)) {
+        display = GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET (window)));
+        retval = send_key_event_real (display,
+                                      send_key_get_input_focus (display),
+                                      keysym, keycode, state);
+        XSync (display, False);
+        return retval;
+    }
+    job = g_slice_new (SendKeyJob);
+    job->keysym = keysym;
+    job->keycode = keycode;
+    job->state = state;
+    g_async_queue_push (window->priv->send_key_worker->queue, job);
+    return TRUE;
+}
+
+#if 0
+/* deprecated */
+static guint
+get_state (const char *str, guint keysym)
+{
+    guint state = 0;
+
+    if (!str || !*str || keysym > 0x7f) {
+        return 0;
+    }
+    if (*str >= 'A' && *str <= 'Z') {
+        return ShiftMask;
+    }
+    switch (*str) {
+    case '!':
+    case '\"':
+    case '#':
+    case '$':
+    case '%':
+    case '&':
+    case '\'':
+    case '(':
+    case ')':
+    case '~':
+    case '=':
+    case '|':
+    case '{':
+    case '}':
+    case '`':
+    case '+':
+    case '*':
+    case '?':
+    case '_':
+        state = ShiftMask;
+        break;
+    default:;
+    }
+    return state;
+}
+#endif
+
+static void
+on_button_send_clicked (GtkButton *button, gpointer data)
+{
+    CodePointData *cp_data;
+    const gchar *str;
+    guint code;
+    guint state = 0;
+    gboolean retval = FALSE;
+    InputPadTableType  type;
+
+    cp_data = (CodePointData *) data;
+    g_return_if_fail (GTK_IS_LABEL (cp_data->char_label));
+    g_return_if_fail (GTK_IS_CONTAINER (cp_data->digit_hbox));
+    g_return_if_fail (GTK_IS_WIDGET (cp_data->signal_window));
+
+    str = gtk_label_get_label (GTK_LABEL (cp_data->char_label));
+    /* Decided input-pad always sends char but not keysym.
+     * Now keyboard layout can be used instead. */
+#if 0
+    code = digit_hbox_get_code_point (cp_data->digit_hbox);
+    state = get_state (str, code);
+    if (code < 0x7f) {
+        type = INPUT_PAD_TABLE_TYPE_KEYSYMS;
+    } else {
+        type = INPUT_PAD_TABLE_TYPE_CHARS;
+        code = 0;
+    }
+#else
+    type = INPUT_PAD_TABLE_TYPE_CHARS;
+    code = 0;
+    state = 0;
+#endif
+
+    g_signal_emit (cp_data->signal_window, signals[BUTTON_PRESSED], 0,
+                   str, type, code, 0, state, &retval);
+}
+
+static void
+on_button_config_layouts_clicked (GtkButton *button, gpointer data)
+{
+    GtkWidget *dlg = GTK_WIDGET (data);
+    GtkWidget *top_window = gtk_widget_get_toplevel (GTK_WIDGET (button));
+
+    gtk_window_set_transient_for (GTK_WINDOW (dlg), GTK_WINDOW (top_window));
+    gtk_dialog_run (GTK_DIALOG (dlg));
+    gtk_widget_hide (dlg);
+    if (INPUT_PAD_IS_GTK_WINDOW (top_window)) {
+        keyboard_preview_restore (INPUT_PAD_GTK_WINDOW (top_window));
+    }
+}
+
+static void
+on_tree_view_select_config_layouts_add (GtkTreeSelection *selection,
+                                        gpointer          data)
+{
+    InputPadGtkWindow *window;
+    GtkTreeModel *model;
+    GtkTreeIter iter;
+    gchar *layout_name = NULL;
+    gchar *variant_name = NULL;
+
+    g_return_if_fail (data != NULL &&
+                      INPUT_PAD_IS_GTK_WINDOW (data));
+
+    window = INPUT_PAD_GTK_WINDOW (data);
+    if (window->priv == NULL ||
+        !gtk_tree_selection_get_selected (selection, &model, &iter)) {
+        return;
+    }
+    gtk_tree_model_get (model, &iter,
+                        LAYOUT_LAYOUT_NAME_COL, &layout_name,
+                        LAYOUT_VARIANT_NAME_COL, &variant_name,
+                        -1);
+    if (layout_name) {
+        keyboard_preview_set_layout (window, layout_name, variant_name);
+    }
+    g_free (layout_name);
+    g_free (variant_name);
+}
+
+static void
+on_button_config_layouts_close_clicked (GtkButton *button, gpointer data)
+{
+    GtkWidget *dlg = GTK_WIDGET (data);
 
     gtk_widget_hide (dlg);
 }
@@ -893,6 +1643,7 @@ on_button_config_layouts_add_clicked (GtkButton *button, gpointer data)
     GtkTreeModel *add_model;
     GtkTreeModel *remove_model;
     GtkTreeSelection *selection;
+    GtkTreeIter filter_iter;
     GtkTreeIter iter;
     gchar *layout_name = NULL;
     gchar *layout_desc = NULL;
@@ -910,9 +1661,17 @@ on_button_config_layouts_add_clicked (GtkButton *button, gpointer data)
     remove_model = gtk_tree_view_get_model (GTK_TREE_VIEW (remove_treeview));
     selection = gtk_tree_view_get_selection (GTK_TREE_VIEW (add_treeview));
 
-    if (!gtk_tree_selection_get_selected (selection, &add_model, &iter)) {
+    if (!gtk_tree_selection_get_selected (selection, &add_model, &filter_iter)) {
         return;
     }
+    if (GTK_IS_TREE_MODEL_FILTER (add_model)) {
+        gtk_tree_model_filter_convert_iter_to_child_iter (GTK_TREE_MODEL_FILTER (add_model),
+                                                          &iter,
+                                                          &filter_iter);
+        add_model = gtk_tree_model_filter_get_model (GTK_TREE_MODEL_FILTER (add_model));
+    } else {
+        iter = filter_iter;
+    }
 
     gtk_tree_model_get (add_model, &iter,
                         LAYOUT_LAYOUT_NAME_COL,
@@ -928,17 +1687,9 @@ on_button_config_layouts_add_clicked (GtkButton *button, gpointer data)
     config_layouts_list_append_layout (GTK_LIST_STORE (remove_model),
                                        layout_name, layout_desc,
                                        variant_name, variant_desc);
-    gtk_tree_store_append (GTK_TREE_STORE (combo_model), &iter, NULL);
-    gtk_tree_store_set (GTK_TREE_STORE (combo_model), &iter,
-                        LAYOUT_LAYOUT_NAME_COL,
-                        g_strdup (layout_name),
-                        LAYOUT_LAYOUT_DESC_COL,
-                        variant_desc ? g_strdup (variant_desc) :
-                            g_strdup (layout_desc),
-                        LAYOUT_VARIANT_NAME_COL,
-                        g_strdup (variant_name),
-                        LAYOUT_VARIANT_DESC_COL, NULL,
-                        LAYOUT_VISIBLE_COL, TRUE, -1);
+    config_layouts_combobox_append_layout (GTK_TREE_STORE (combo_model),
+                                           layout_name, layout_desc,
+                                           variant_name, variant_desc);
     g_free (layout_name);
     g_free (layout_desc);
     g_free (variant_name);
@@ -952,7 +1703,6 @@ on_button_config_layouts_remove_clicked (GtkButton *button, gpointer data)
     gchar **group_layouts = NULL;
     gchar **group_variants = NULL;
     GtkWidget *combobox;
-    GtkWidget *add_treeview;
     GtkWidget *remove_treeview;
     GtkTreeModel *combo_model;
     GtkTreeModel *add_model;
@@ -973,10 +1723,9 @@ on_button_config_layouts_remove_clicked (GtkButton *button, gpointer data)
     group_layouts = window->priv->group_layouts;
     group_variants = window->priv->group_variants;
     combobox = window->priv->config_layouts_combobox;
-    add_treeview = window->priv->config_layouts_add_treeview;
     remove_treeview = window->priv->config_layouts_remove_treeview;
     combo_model = gtk_combo_box_get_model (GTK_COMBO_BOX (combobox));
-    add_model = gtk_tree_view_get_model (GTK_TREE_VIEW (add_treeview));
+    add_model = GTK_TREE_MODEL (config_layouts_add_list_get (window));
     selection = gtk_tree_view_get_selection (GTK_TREE_VIEW (remove_treeview));
 
     if (!gtk_tree_selection_get_selected (selection, &remove_model, &iter)) {
@@ -1027,20 +1776,41 @@ on_button_config_layouts_remove_clicked (GtkButton *button, gpointer data)
     g_free (variant_desc);
 }
 
+static void
+on_search_entry_changed_config_layouts (GtkSearchEntry *entry,
+                                        gpointer        data)
+{
+    InputPadGtkWindow *window;
+    GtkTreeModel *model;
+    gchar *text;
+
+    g_return_if_fail (data != NULL &&
+                      INPUT_PAD_IS_GTK_WINDOW (data));
+
+    window = INPUT_PAD_GTK_WINDOW (data);
+    g_return_if_fail (window->priv != NULL);
+
+    text = g_strdup (gtk_entry_get_text (GTK_ENTRY (entry)));
+    g_strstrip (text);
+    g_free (window->priv->config_layouts_search_text);
+    window->priv->config_layouts_search_text = g_utf8_casefold (text, -1);
+    g_free (text);
+
+    model = gtk_tree_view_get_model (GTK_TREE_VIEW (window->priv->config_layouts_add_treeview));
+    if (GTK_IS_TREE_MODEL_FILTER (model)) {
+        gtk_tree_model_filter_refilter (GTK_TREE_MODEL_FILTER (model));
+    }
+}
+
 static void
 on_button_config_options_close_clicked (GtkButton *button, gpointer data)
 {
     InputPadGtkWindow *window;
-    GList *orig_list, *orig_list_button;
-    GList *list = NULL;
-    GList *list_button = NULL;
-    GtkWidget *expander;
-    GtkWidget *vbox;
-    GtkWidget *checkbutton;
+    InputPadXKBOptionGroupList *groups;
+    InputPadXKBOptionList *options;
     GtkWidget *combobox;
     GtkTreeIter iter;
     GtkTreeModel *model;
-    const gchar *text;
     gchar *layout = NULL;
     gchar *variant = NULL;
     gchar *option = NULL;
@@ -1052,37 +1822,25 @@ on_button_config_options_close_clicked (GtkButton *button, gpointer data)
 
     gtk_widget_hide (window->priv->config_options_dialog);
 
-    list = gtk_container_get_children (GTK_CONTAINER (window->priv->config_options_vbox));
-    orig_list = list;
-    while (list) {
-        GList *tmp_list;
-
-        expander = GTK_WIDGET (list->data);
-
-        tmp_list = gtk_container_get_children (GTK_CONTAINER (expander));
-        vbox = GTK_WIDGET (tmp_list->data);
-        g_list_free (tmp_list);
-
-        list_button = gtk_container_get_children (GTK_CONTAINER (vbox));
-        orig_list_button = list_button;
-        while (list_button) {
-            checkbutton = GTK_WIDGET (list_button->data);
-            text = (gchar *) g_object_get_data (G_OBJECT (checkbutton), "option");
-            if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (checkbutton))) {
-                if (option == NULL) {
-                    option = g_strdup (text);
-                } else {
-                    gchar *p = g_strdup_printf ("%s,%s", option, text);
-                    g_free (option);
-                    option = p;
-                }
+    g_return_if_fail (window->priv->xkb_config_reg != NULL);
+    g_return_if_fail (window->priv->config_options_checked != NULL);
+
+    for (groups = window->priv->xkb_config_reg->option_groups;
+         groups; groups = groups->next) {
+        for (options = groups->options; options; options = options->next) {
+            if (!g_hash_table_contains (window->priv->config_options_checked,
+                                        options->option)) {
+                continue;
+            }
+            if (option == NULL) {
+                option = g_strdup (options->option);
+            } else {
+                gchar *p = g_strdup_printf ("%s,%s", option, options->option);
+                g_free (option);
+                option = p;
             }
-            list_button = list_button->next;
         }
-        g_list_free (orig_list_button);
-        list = list->next;
     }
-    g_list_free (orig_list);
 
     combobox = window->priv->config_layouts_combobox;
     if (!gtk_combo_box_get_active_iter (GTK_COMBO_BOX (combobox), &iter)) {
@@ -1097,8 +1855,7 @@ on_button_config_options_close_clicked (GtkButton *button, gpointer data)
         window->priv->group_options = g_strsplit (option, ",", -1);
     }
     if (layout) {
-        input_pad_gdk_xkb_set_layout (window, window->priv->xkb_key_list,
-                                      layout, variant, option);
+        layout_switch_queue (window, layout, variant, option);
     }
     g_free (layout);
     g_free (variant);
@@ -1113,18 +1870,19 @@ on_button_pressed (GtkButton *button, gpointer data)
     InputPadTableType  type;
     const char *str;
     const char *rawtext;
-    char *command_output = NULL;
     guint keycode;
     guint keysym;
     guint **keysyms;
     guint group;
     guint state = 0;
     gboolean retval = FALSE;
+    InputPadXStatsScope scope;
 
     g_return_if_fail (INPUT_PAD_IS_GTK_BUTTON (button));
     g_return_if_fail (data != NULL &&
                       INPUT_PAD_IS_GTK_WINDOW (data));
 
+    input_pad_gdk_xstats_scope_begin (&scope, INPUT_PAD_XSTATS_OP_KEY_PRESS);
     window = INPUT_PAD_GTK_WINDOW (data);
     ibutton = INPUT_PAD_GTK_BUTTON (button);
     str = input_pad_gtk_button_get_label (ibutton);
@@ -1139,12 +1897,25 @@ on_button_pressed (GtkButton *button, gpointer data)
         keysym == (guint) '\t' && keycode == 0 && keysyms == NULL) {
         str = "\t";
         keysym = 0;
-    } else if (type == INPUT_PAD_TABLE_TYPE_COMMANDS) {
-        run_command (rawtext, &command_output);
-        if (command_output == NULL) {
-            return;
+    } else if (type == INPUT_PAD_TABLE_TYPE_CHARS && keysym == 0 &&
+               window->priv->module_gdk_xtest != NULL &&
+               window->priv->xkb_key_list != NULL &&
+               str != NULL && g_utf8_strlen (str, -1) == 1) {
+        guint char_state = 0;
+
+        /* The char on the current layout is sent with the key. */
+        group = window->priv->keyboard_group;
+        if (input_pad_gdk_xkb_key_list_lookup_unicode (window->priv->xkb_key_list,
+                                                       g_utf8_get_char (str),
+                                                       group,
+                                                       &keycode,
+                                                       &keysym,
+                                                       &char_state)) {
+            state = (state & ~ShiftMask) | char_state;
         }
-        str = command_output;
+    } else if (type == INPUT_PAD_TABLE_TYPE_COMMANDS) {
+        /* The output is sent by on_command_communicated(). */
+        str = NULL;
     } else if (rawtext) {
         str = rawtext;
     }
@@ -1153,12 +1924,15 @@ on_button_pressed (GtkButton *button, gpointer data)
     }
     state = input_pad_xkb_build_core_state (state, group);
 
-    g_signal_emit (window, signals[BUTTON_PRESSED], 0,
-                   str, type, keysym, keycode, state, &retval);
-
     if (type == INPUT_PAD_TABLE_TYPE_COMMANDS) {
-        g_free (command_output);
+        if (rawtext) {
+            command_run_start (window, rawtext, keysym, keycode, state);
+        }
+    } else {
+        g_signal_emit (window, signals[BUTTON_PRESSED], 0,
+                       str, type, keysym, keycode, state, &retval);
     }
+
     if (state & ShiftMask) {
         state ^= ShiftMask;
     }
@@ -1171,6 +1945,7 @@ on_button_pressed (GtkButton *button, gpointer data)
         state ^= Mod1Mask;
     }
     window->priv->keyboard_state = state;
+    input_pad_gdk_xstats_scope_end (&scope);
 }
 
 static void
@@ -1180,6 +1955,11 @@ on_button_pressed_repeat (InputPadGtkButton *button, gpointer data)
 
     g_return_if_fail (INPUT_PAD_IS_GTK_BUTTON (button));
 
+    /* A held button does not run the command again. */
+    if (input_pad_gtk_button_get_table_type (button) ==
+        INPUT_PAD_TABLE_TYPE_COMMANDS) {
+        return;
+    }
     keysym = input_pad_gtk_button_get_keysym (button);
     if ((keysym == XK_Control_L) || (keysym == XK_Control_R) ||
         (keysym == XK_Alt_L) || (keysym == XK_Alt_L) ||
@@ -1238,21 +2018,31 @@ on_button_layout_arrow_pressed (GtkButton *button, gpointer data)
 static void
 on_checkbutton_config_options_option_clicked (GtkButton *button, gpointer data)
 {
+    InputPadGtkWindow *window;
     GtkWidget *expander;
     GtkWidget *label;
+    const gchar *option;
     int checked;
     gchar *text;
 
     g_return_if_fail (GTK_IS_EXPANDER (data));
     expander = GTK_WIDGET (data);
+    window = INPUT_PAD_GTK_WINDOW (g_object_get_data (G_OBJECT (expander),
+                                                      "window"));
+    g_return_if_fail (window->priv != NULL);
+    option = (const gchar *) g_object_get_data (G_OBJECT (button), "option");
     label = gtk_expander_get_label_widget (GTK_EXPANDER (expander));
     checked = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (expander), "checked"));
     if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (button))) {
+        g_hash_table_add (window->priv->config_options_checked,
+                          (gpointer) option);
         text = g_strdup_printf ("<b>%s</b>",
                                 gtk_label_get_text (GTK_LABEL (label)));
         gtk_label_set_markup (GTK_LABEL (label), text);
+        g_free (text);
         checked++;
     } else {
+        g_hash_table_remove (window->priv->config_options_checked, option);
         checked--;
         if (checked <= 0) {
             text = g_strdup (gtk_label_get_text (GTK_LABEL (label)));
@@ -1264,6 +2054,56 @@ on_checkbutton_config_options_option_clicked (GtkButton *button, gpointer data)
                        GINT_TO_POINTER (checked));
 }
 
+/* Creates the check buttons of the option group when the group is
+ * expanded at the first time. */
+static void
+on_expander_config_options_expanded (GObject    *object,
+                                     GParamSpec *pspec,
+                                     gpointer    data)
+{
+    InputPadGtkWindow *window;
+    InputPadXKBOptionGroupList *groups;
+    InputPadXKBOptionList *options;
+    GtkWidget *expander;
+    GtkWidget *vbox;
+    GtkWidget *checkbutton;
+
+    g_return_if_fail (GTK_IS_EXPANDER (object));
+    g_return_if_fail (data != NULL &&
+                      INPUT_PAD_IS_GTK_WINDOW (data));
+
+    expander = GTK_WIDGET (object);
+    window = INPUT_PAD_GTK_WINDOW (data);
+    if (!gtk_expander_get_expanded (GTK_EXPANDER (expander)) ||
+        gtk_bin_get_child (GTK_BIN (expander)) != NULL) {
+        return;
+    }
+    groups = (InputPadXKBOptionGroupList *) g_object_get_data (G_OBJECT (expander),
+                                                               "option_group_list");
+    g_return_if_fail (groups != NULL);
+
+    vbox = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
+    gtk_widget_set_margin_start (vbox, 18);
+    gtk_container_add (GTK_CONTAINER (expander), vbox);
+    gtk_widget_show (vbox);
+
+    for (options = groups->options; options; options = options->next) {
+        checkbutton = gtk_check_button_new_with_label (options->desc);
+        g_object_set_data (G_OBJECT (checkbutton), "option",
+                           (gpointer) options->option);
+        if (g_hash_table_contains (window->priv->config_options_checked,
+                                   options->option)) {
+            gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (checkbutton),
+                                          TRUE);
+        }
+        g_signal_connect (checkbutton, "toggled",
+                          G_CALLBACK (on_checkbutton_config_options_option_clicked),
+                          (gpointer) expander);
+        gtk_box_pack_start (GTK_BOX (vbox), checkbutton, FALSE, TRUE, 0);
+        gtk_widget_show (checkbutton);
+    }
+}
+
 static void
 on_combobox_changed (GtkComboBox *combobox, gpointer data)
 {
@@ -1294,33 +2134,32 @@ on_tree_view_select_custom_char_group (GtkTreeSelection     *selection,
     GtkTreeModel *sub_model;
     GtkTreeIter iter;
     GtkTreeSelection *sub_selection;
-    int n;
 
     g_return_if_fail (INPUT_PAD_IS_GTK_WINDOW (tv_data->window));
     window = INPUT_PAD_GTK_WINDOW (tv_data->window);
     g_return_if_fail (window->priv != NULL && window->priv->group != NULL);
     g_return_if_fail (GTK_IS_TREE_VIEW (tv_data->sub_tv));
 
-    group = window->priv->group;
     sub_tv = GTK_WIDGET (tv_data->sub_tv);
 
     if (!gtk_tree_selection_get_selected (selection, &model, &iter)) {
         g_warning ("Main treeview is not selected.");
         return;
     }
-    gtk_tree_model_get (model, &iter,
-                        CHAR_BLOCK_START_COL, &n, -1);
-    group = get_nth_pad_group (group, n);
+    group = input_pad_gtk_tree_model_iter_get_group (INPUT_PAD_GTK_TREE_MODEL (model),
+                                                     &iter);
     g_return_if_fail (group != NULL);
-    sub_model = custom_char_table_model_new (window, group->table);
-    g_return_if_fail (sub_model != NULL);
-    gtk_widget_hide (sub_tv);
-    gtk_tree_view_set_model (GTK_TREE_VIEW (sub_tv), sub_model);
+    sub_model = gtk_tree_view_get_model (GTK_TREE_VIEW (sub_tv));
+    g_return_if_fail (INPUT_PAD_IS_GTK_TREE_MODEL (sub_model));
+    /* The table model only emits row-changed for the new group and
+     * the first table is selected again to show the new table. */
+    sub_selection = gtk_tree_view_get_selection (GTK_TREE_VIEW (sub_tv));
+    gtk_tree_selection_unselect_all (sub_selection);
+    input_pad_gtk_tree_model_set_group (INPUT_PAD_GTK_TREE_MODEL (sub_model),
+                                        group);
     if (gtk_tree_model_get_iter_first (sub_model, &iter)) {
-        sub_selection = gtk_tree_view_get_selection (GTK_TREE_VIEW (sub_tv));
         gtk_tree_selection_select_iter (sub_selection, &iter);
     }
-    gtk_widget_show (sub_tv);
 }
 
 static void
@@ -1338,7 +2177,6 @@ on_tree_view_select_custom_char_table (GtkTreeSelection     *selection,
     GtkTreeModel *sub_model;
     GtkTreeIter main_iter;
     GtkTreeIter sub_iter;
-    int n;
 
     g_return_if_fail (INPUT_PAD_IS_GTK_WINDOW (tv_data->window));
     window = INPUT_PAD_GTK_WINDOW (tv_data->window);
@@ -1346,7 +2184,6 @@ on_tree_view_select_custom_char_table (GtkTreeSelection     *selection,
     g_return_if_fail (GTK_IS_TREE_VIEW (tv_data->main_tv));
     g_return_if_fail (GTK_IS_SCROLLED_WINDOW (tv_data->scrolled));
 
-    group = window->priv->group;
     main_tv = GTK_WIDGET (tv_data->main_tv);
     scrolled = GTK_WIDGET (tv_data->scrolled);
     main_selection = gtk_tree_view_get_selection (GTK_TREE_VIEW (main_tv));
@@ -1359,13 +2196,11 @@ on_tree_view_select_custom_char_table (GtkTreeSelection     *selection,
         /* gtk_tree_view_set_model() in main model causes this. */
         return;
     }
-    gtk_tree_model_get (main_model, &main_iter,
-                        CHAR_BLOCK_START_COL, &n, -1);
-    group = get_nth_pad_group (group, n);
+    group = input_pad_gtk_tree_model_iter_get_group (INPUT_PAD_GTK_TREE_MODEL (sub_model),
+                                                     &sub_iter);
     g_return_if_fail (group != NULL);
-    gtk_tree_model_get (sub_model, &sub_iter,
-                        CHAR_BLOCK_START_COL, &n, -1);
-    table = get_nth_pad_table (group->table, n);
+    table = input_pad_gtk_tree_model_iter_get_table (INPUT_PAD_GTK_TREE_MODEL (sub_model),
+                                                     &sub_iter);
     g_return_if_fail (table != NULL && table->priv != NULL);
     table->priv->signal_window = window;
     destroy_custom_char_view_table (scrolled, window);
@@ -1397,12 +2232,87 @@ on_tree_view_select_all_char (GtkTreeSelection     *selection,
     append_all_char_view_table (scrolled, start, end, window);
 }
 
+static void
+on_search_entry_changed_custom_char (GtkSearchEntry *entry,
+                                     gpointer        data)
+{
+    CharTreeViewData *tv_data = (CharTreeViewData *) data;
+    InputPadGtkWindow *window;
+    InputPadGroupIndexHit *hits;
+    GtkTreeSelection *sub_selection;
+    const gchar *text;
+
+    g_return_if_fail (INPUT_PAD_IS_GTK_WINDOW (tv_data->window));
+    g_return_if_fail (GTK_IS_SCROLLED_WINDOW (tv_data->scrolled));
+
+    window = INPUT_PAD_GTK_WINDOW (tv_data->window);
+    text = gtk_entry_get_text (GTK_ENTRY (entry));
+    hits = NULL;
+    if (text && *text && window->priv->group_index) {
+        /* All the hits are shown in InputPadGtkViewport. */
+        hits = input_pad_group_index_query (window->priv->group_index,
+                                            text,
+                                            0);
+    }
+    if (hits == NULL) {
+        /* Go back to the selected subgroup. */
+        sub_selection = gtk_tree_view_get_selection (GTK_TREE_VIEW (tv_data->sub_tv));
+        on_tree_view_select_custom_char_table (sub_selection, tv_data);
+        return;
+    }
+    destroy_custom_char_view_table (tv_data->scrolled, window);
+    /* The table owns the hits. */
+    append_search_char_view_table (tv_data->scrolled, hits, window);
+}
+
+
+static void
+on_xkb_config_registry_parsed (GObject         *source_object,
+                               GAsyncResult    *result,
+                               gpointer         data)
+{
+    InputPadGtkWindow *window = INPUT_PAD_GTK_WINDOW (source_object);
+    InputPadXKBConfigReg *xkb_config_reg;
+    GError *error = NULL;
+
+    xkb_config_reg =
+        input_pad_gdk_xkb_parse_config_registry_finish (window,
+                                                        result,
+                                                        &error);
+    if (error != NULL) {
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_warning ("Failed to parse XKB config registry: %s",
+                       error->message);
+        }
+        g_error_free (error);
+        return;
+    }
+    if (window->priv == NULL) {
+        input_pad_gdk_xkb_destroy_config_registry (xkb_config_reg);
+        return;
+    }
+    g_clear_object (&window->priv->xkb_config_reg_cancellable);
+
+    window->priv->xkb_config_reg = xkb_config_reg;
+    if (xkb_config_reg == NULL) {
+        return;
+    }
+    g_return_if_fail (GTK_IS_WIDGET (data));
+
+    create_keyboard_layout_list_ui_real (GTK_WIDGET (data), window);
+    if (window->priv->config_layouts_combobox) {
+        on_window_keyboard_changed_combobox (window,
+                                             window->priv->keyboard_group,
+                                             window->priv->config_layouts_combobox);
+    }
+}
 
 static void
 on_window_realize (GtkWidget *window, gpointer data)
 {
     GtkWidget *keyboard_vbox;
     InputPadGtkWindow *input_pad;
+    InputPadXStatsScope scope;
 
     g_return_if_fail (INPUT_PAD_IS_GTK_WINDOW (window));
     g_return_if_fail (GTK_IS_WIDGET (data));
@@ -1410,13 +2320,17 @@ on_window_realize (GtkWidget *window, gpointer data)
     input_pad = INPUT_PAD_GTK_WINDOW (window);
     keyboard_vbox = GTK_WIDGET (data);
 
+    input_pad_gdk_xstats_attach_display (GDK_WINDOW_XDISPLAY (gtk_widget_get_window (window)));
+    input_pad_gdk_xstats_scope_begin (&scope, INPUT_PAD_XSTATS_OP_STARTUP);
     input_pad->priv->xkb_key_list = 
         input_pad_gdk_xkb_parse_keyboard_layouts (input_pad);
     if (input_pad->priv->kbdui_name && input_pad->priv->xkb_key_list == NULL) {
+        input_pad_gdk_xstats_scope_end (&scope);
         return;
     }
 
     create_keyboard_layout_ui_real (keyboard_vbox, input_pad);
+    input_pad_gdk_xkb_set_keymap_notify (input_pad, on_xkb_keymap_notify);
     input_pad->priv->group_layouts =
         input_pad_gdk_xkb_get_group_layouts (input_pad,
                                              input_pad->priv->xkb_key_list);
@@ -1426,16 +2340,19 @@ on_window_realize (GtkWidget *window, gpointer data)
     input_pad->priv->group_options =
         input_pad_gdk_xkb_get_group_options (input_pad,
                                              input_pad->priv->xkb_key_list);
-    input_pad->priv->xkb_config_reg =
-        input_pad_gdk_xkb_parse_config_registry (input_pad,
-                                                 input_pad->priv->xkb_key_list);
-    if (input_pad->priv->xkb_config_reg == NULL) {
-        input_pad_gdk_xkb_signal_emit (input_pad, signals[KBD_CHANGED]);
-        return;
+    /* The layout list and the configure dialogs are created when
+     * the registry is parsed on a worker thread. */
+    if (input_pad->priv->xkb_config_reg == NULL &&
+        input_pad->priv->xkb_config_reg_cancellable == NULL) {
+        input_pad->priv->xkb_config_reg_cancellable = g_cancellable_new ();
+        input_pad_gdk_xkb_parse_config_registry_async (input_pad,
+                                                       input_pad->priv->xkb_key_list,
+                                                       input_pad->priv->xkb_config_reg_cancellable,
+                                                       on_xkb_config_registry_parsed,
+                                                       (gpointer) keyboard_vbox);
     }
-
-    create_keyboard_layout_list_ui_real (keyboard_vbox, input_pad);
     input_pad_gdk_xkb_signal_emit (input_pad, signals[KBD_CHANGED]);
+    input_pad_gdk_xstats_scope_end (&scope);
 }
 
 static void
@@ -1457,28 +2374,6 @@ resize_toplevel_window_with_hide_widget (GtkWidget *widget)
     }
 }
 
-static InputPadGroup *
-get_nth_pad_group (InputPadGroup *group, int nth)
-{
-    InputPadGroup *retval = group;
-    int i;
-    for (i = 0; i < nth; i++) {
-        retval = retval->next;
-    }
-    return retval;
-}
-
-static InputPadTable *
-get_nth_pad_table (InputPadTable *table, int nth)
-{
-    InputPadTable *retval = table;
-    int i;
-    for (i = 0; i < nth; i++) {
-        retval = retval->next;
-    }
-    return retval;
-}
-
 static guint
 digit_hbox_get_code_point (GtkWidget *digit_hbox)
 {
@@ -1870,181 +2765,412 @@ keysym_get_value_from_string (const gchar *str)
 }
 #endif
 
-#if 0
-guint **
-xkb_key_list_get_all_keysyms_from_keysym (InputPadXKBKeyList *xkb_key_list,
-                                          guint               keysym)
+
+char **
+string_table_get_label_array (InputPadTableStr *strs)
 {
-    InputPadXKBKeyList *list = xkb_key_list;
-    InputPadXKBKeyRow  *key_row;
-    int i, j;
-    gboolean found = FALSE;
+    int i = 0, len;
+    char **retval = NULL;
+
+    if (strs == NULL) {
+        return NULL;
+    }
+    while (strs[i].label) {
+        i++;
+    }
+    len = i;
+    retval = g_new0 (char *, len + 1);
+    for (i = 0; strs[i].label; i++) {
+        retval[i] = g_strdup (strs[i].label);
+    }
 
-    g_return_val_if_fail (xkb_key_list != NULL, NULL);
+    return retval;
+}
 
-    for (i = 0; i < 20; i++) {
-        while (list) {
-            key_row = list->row;
-            while (key_row) {
-                if (!key_row->keysym[i]) {
-                    goto out_all_keysyms_check;
-                }
-                for (j = 0; key_row->keysym[i][j]; j++) {
-                    if (keysym == key_row->keysym[i][j]) {
-                        found = TRUE;
-                        goto out_all_keysyms_check;
-                    }
-                }
-                key_row = key_row->next;
-            }
-            list = list->next;
+char **
+command_table_get_label_array (InputPadTableCmd *cmds)
+{
+    int i = 0, len;
+    char **retval = NULL;
+
+    if (cmds == NULL) {
+        return NULL;
+    }
+    while (cmds[i].execl) {
+        i++;
+    }
+    len = i;
+    retval = g_new0 (char *, len + 1);
+    for (i = 0; cmds[i].execl; i++) {
+        if (cmds[i].label) {
+            retval[i] = g_strdup (cmds[i].label);
+        } else {
+            retval[i] = g_strdup (cmds[i].execl);
         }
     }
-out_all_keysyms_check:
-    if (found) {
-        return key_row->keysym;
+
+    return retval;
+}
+
+static void
+command_run_unlink (CommandRun *run)
+{
+    if (run->detached || run->window->priv == NULL) {
+        return;
+    }
+    if (run->window->priv->command_runs &&
+        g_hash_table_lookup (run->window->priv->command_runs,
+                             run->command) == run) {
+        g_hash_table_remove (run->window->priv->command_runs, run->command);
+    }
+}
+
+static void
+command_run_free (CommandRun *run)
+{
+    if (run->timeout_id != 0) {
+        g_source_remove (run->timeout_id);
+        run->timeout_id = 0;
+    }
+    command_run_unlink (run);
+    g_clear_object (&run->subprocess);
+    g_object_unref (run->cancellable);
+    g_object_unref (run->window);
+    g_free (run->command);
+    g_slice_free (CommandRun, run);
+}
+
+/* The run is freed by on_command_communicated() after it is
+ * cancelled. */
+static void
+command_run_abort (CommandRun *run)
+{
+    command_run_unlink (run);
+    g_cancellable_cancel (run->cancellable);
+    if (run->subprocess) {
+        g_subprocess_force_exit (run->subprocess);
+    }
+}
+
+static void
+command_run_cancel_all (InputPadGtkWindow *window)
+{
+    GList *runs;
+    GList *list;
+
+    if (window->priv->command_runs == NULL) {
+        return;
+    }
+    /* The runs are freed by the callbacks after window->priv is
+     * cleared so they are detached from the table here. */
+    runs = g_hash_table_get_values (window->priv->command_runs);
+    for (list = runs; list; list = list->next) {
+        CommandRun *run = (CommandRun *) list->data;
+
+        command_run_abort (run);
+        run->detached = TRUE;
+        if (run->timeout_id != 0) {
+            g_source_remove (run->timeout_id);
+            run->timeout_id = 0;
+        }
+    }
+    g_list_free (runs);
+    g_hash_table_destroy (window->priv->command_runs);
+    window->priv->command_runs = NULL;
+}
+
+static gboolean
+on_command_timeout (gpointer data)
+{
+    CommandRun *run = (CommandRun *) data;
+
+    run->timeout_id = 0;
+    g_warning ("The script %s did not exit in %d msec", run->command,
+               COMMAND_TIMEOUT);
+    command_run_abort (run);
+    return FALSE;
+}
+
+static void
+command_send_output (InputPadGtkWindow *window,
+                     const char        *output,
+                     guint              keysym,
+                     guint              keycode,
+                     guint              state)
+{
+    gboolean retval = FALSE;
+    InputPadXStatsScope scope;
+
+    input_pad_gdk_xstats_scope_begin (&scope, INPUT_PAD_XSTATS_OP_KEY_PRESS);
+    g_signal_emit (window, signals[BUTTON_PRESSED], 0,
+                   output,
+                   INPUT_PAD_TABLE_TYPE_COMMANDS,
+                   keysym, keycode, state, &retval);
+    input_pad_gdk_xstats_scope_end (&scope);
+}
+
+static void
+command_cache_free (CommandCache *cache)
+{
+    g_free (cache->output);
+    g_slice_free (CommandCache, cache);
+}
+
+static void
+command_cache_clear (InputPadGtkWindow *window)
+{
+    if (window->priv->command_cache) {
+        g_hash_table_destroy (window->priv->command_cache);
+        window->priv->command_cache = NULL;
     }
-    return NULL;
 }
-#endif
 
-char **
-string_table_get_label_array (InputPadTableStr *strs)
+static void
+command_cache_store (InputPadGtkWindow *window,
+                     const gchar       *command,
+                     const char        *output)
 {
-    int i = 0, len;
-    char **retval = NULL;
+    CommandCache *cache;
 
-    if (strs == NULL) {
-        return NULL;
-    }
-    while (strs[i].label) {
-        i++;
-    }
-    len = i;
-    retval = g_new0 (char *, len + 1);
-    for (i = 0; strs[i].label; i++) {
-        retval[i] = g_strdup (strs[i].label);
+    if (window->priv->command_cache == NULL) {
+        window->priv->command_cache =
+            g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free,
+                                   (GDestroyNotify) command_cache_free);
     }
-
-    return retval;
+    cache = g_slice_new (CommandCache);
+    cache->output = g_strdup (output);
+    cache->time = g_get_monotonic_time ();
+    g_hash_table_replace (window->priv->command_cache,
+                          g_strdup (command), cache);
 }
 
-char **
-command_table_get_label_array (InputPadTableCmd *cmds)
+static void
+command_run_send_output (CommandRun *run,
+                         char       *std_output,
+                         gboolean    successful)
 {
-    int i = 0, len;
-    char **retval = NULL;
+    gboolean has_output;
 
-    if (cmds == NULL) {
-        return NULL;
+    has_output = (std_output != NULL && strlen (std_output) > 2);
+    if (std_output) {
+        g_strchomp (std_output);
     }
-    while (cmds[i].execl) {
-        i++;
+    if (run->store_output && successful && has_output) {
+        command_cache_store (run->window, run->command, std_output);
     }
-    len = i;
-    retval = g_new0 (char *, len + 1);
-    for (i = 0; cmds[i].execl; i++) {
-        if (cmds[i].label) {
-            retval[i] = g_strdup (cmds[i].label);
-        } else {
-            retval[i] = g_strdup (cmds[i].execl);
-        }
+    if (run->send_output && has_output) {
+        command_send_output (run->window, std_output,
+                             run->keysym, run->keycode, run->state);
     }
-
-    return retval;
 }
 
 static void
-run_command (const gchar *command, gchar **command_output)
+on_command_communicated (GObject      *source,
+                         GAsyncResult *result,
+                         gpointer      data)
 {
-    GError  *error;
-    char   **argv;
-    char   **envp = NULL;
-    char    *p;
-    char    *end;
-    char    *name;
-    const char *value;
-    char    *extracted;
-    char    *new_arg;
-    char    *std_output = NULL;
-    char    *std_error = NULL;
-    int      i, n, exit_status;
-
-    error = NULL;
-    if (!g_shell_parse_argv (command, NULL, &argv, &error)) {
-        g_warning ("Could not parse command: %s", error->message);
+    CommandRun *run = (CommandRun *) data;
+    GError *error = NULL;
+    char *std_output = NULL;
+    char *std_error = NULL;
+    gboolean successful;
+
+    if (!g_subprocess_communicate_utf8_finish (G_SUBPROCESS (source),
+                                               result,
+                                               &std_output,
+                                               &std_error,
+                                               &error)) {
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_warning ("Could not run the script %s: %s",
+                       run->command, error->message);
+        }
         g_error_free (error);
+        command_run_free (run);
         return;
     }
-    n = 0;
-    for (i = 0; argv[i]; i++) {
-        if (g_strstr_len (argv[i], -1, "=") != NULL) {
-            n++;
-        } else {
-            break;
-        }
+    successful = g_subprocess_get_successful (run->subprocess);
+    if (!successful) {
+        g_warning ("Failed to run the script %s: %s", run->command,
+                   std_error ? std_error : "");
     }
-    if (n > 0) {
-        envp = g_new0 (char *, n + 1);
+    command_run_send_output (run, std_output, successful);
+    g_free (std_output);
+    g_free (std_error);
+    command_run_free (run);
+}
+
+static void
+on_command_helper_run (GObject      *source,
+                       GAsyncResult *result,
+                       gpointer      data)
+{
+    CommandRun *run = (CommandRun *) data;
+    InputPadCommandHelper *helper = NULL;
+    GError *error = NULL;
+    char *std_output = NULL;
+    int exit_status = 0;
+
+    /* The task fails after the window is destroyed. */
+    if (run->window->priv) {
+        helper = run->window->priv->command_helper;
+    }
+    if (!input_pad_command_helper_run_finish (helper,
+                                              result,
+                                              &std_output, &exit_status,
+                                              &error)) {
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_warning ("Could not run the script %s: %s",
+                       run->command, error->message);
+        }
+        g_error_free (error);
+        command_run_free (run);
+        return;
     }
-    for (i = 0; i < n; i++) {
-        envp[i] = g_strdup (argv[i]);
+    if (exit_status != 0) {
+        g_warning ("Failed to run the script %s: exit status %d",
+                   run->command, exit_status);
     }
-    for (i = n; argv[i]; i++) {
-        if ((p = g_strstr_len (argv[i], -1, "$")) != NULL &&
-            *(p + 1) != '\0') {
-            end = g_strstr_len (p + 1, -1, " ");
-            if (end) {
-                name = g_strndup (p, end - p);
-            } else {
-                name = g_strdup (p);
-            }
-            value = g_getenv (name + 1);
-            g_free (name);
-            if (value != NULL) {
-                extracted = g_strdup (value);
-            } else {
-                extracted = g_strdup ("");
+    command_run_send_output (run, std_output, exit_status == 0);
+    g_free (std_output);
+    command_run_free (run);
+}
+
+/* Returns the command prepared when the file was loaded. */
+static InputPadTableCmdPrivate *
+command_lookup (InputPadGtkWindow *window, const gchar *command)
+{
+    InputPadGroup *group;
+    InputPadTable *table;
+    int i;
+
+    for (group = window->priv->group; group; group = group->next) {
+        for (table = group->table; table; table = table->next) {
+            if (table->type != INPUT_PAD_TABLE_TYPE_COMMANDS ||
+                table->data.cmds == NULL ||
+                table->priv == NULL || table->priv->cmds == NULL) {
+                continue;
             }
-            *p = '\0';
-            if (end) {
-                new_arg = g_strconcat (argv[i], extracted, end, NULL);
-            } else {
-                new_arg = g_strconcat (argv[i], extracted, NULL);
+            for (i = 0; table->data.cmds[i].execl; i++) {
+                if (!g_strcmp0 (table->data.cmds[i].execl, command)) {
+                    return &table->priv->cmds[i];
+                }
             }
-            g_free (argv[i]);
-            argv[i] = new_arg;
         }
     }
-    error = NULL;
-    if (!g_spawn_sync (NULL,
-                       &argv[n],
-                       envp,
-                       G_SPAWN_SEARCH_PATH,
-                       NULL, NULL,
-                       &std_output, &std_error,
-                       &exit_status, &error)) {
-        g_warning ("Could not run the script %s: %s: %s",
-                   command,
-                   error->message,
-                   std_error ? std_error : "");
-        g_error_free (error);
-        g_strfreev (argv);
+    return NULL;
+}
+
+static void
+command_run_spawn (InputPadGtkWindow       *window,
+                   const gchar             *command,
+                   InputPadTableCmdPrivate *cmd,
+                   guint                    keysym,
+                   guint                    keycode,
+                   guint                    state,
+                   gboolean                 send_output)
+{
+    GSubprocessLauncher *launcher;
+    GSubprocess *subprocess = NULL;
+    CommandRun *run;
+    GError *error = NULL;
+    gboolean use_helper;
+
+    /* The helper runs one command at a time and the other commands
+     * are spawned while it is busy. */
+    use_helper = (window->priv->command_helper != NULL &&
+                  !input_pad_command_helper_is_busy (window->priv->command_helper));
+    if (!use_helper) {
+        launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE |
+                                              G_SUBPROCESS_FLAGS_STDERR_PIPE);
+        if (cmd->envp) {
+            g_subprocess_launcher_set_environ (launcher, cmd->envp);
+        }
+        subprocess = g_subprocess_launcher_spawnv (launcher,
+                                                   (const gchar * const *) cmd->argv,
+                                                   &error);
+        g_object_unref (launcher);
+        if (subprocess == NULL) {
+            g_warning ("Could not run the script %s: %s",
+                       command, error->message);
+            g_error_free (error);
+            return;
+        }
+    }
+
+    run = g_slice_new0 (CommandRun);
+    run->window = g_object_ref (window);
+    run->command = g_strdup (command);
+    run->subprocess = subprocess;
+    run->cancellable = g_cancellable_new ();
+    run->keysym = keysym;
+    run->keycode = keycode;
+    run->state = state;
+    run->send_output = send_output;
+    run->store_output = (cmd->cache_ttl != 0);
+    run->timeout_id = gdk_threads_add_timeout (COMMAND_TIMEOUT,
+                                               on_command_timeout,
+                                               run);
+    if (window->priv->command_runs == NULL) {
+        window->priv->command_runs = g_hash_table_new (g_str_hash,
+                                                       g_str_equal);
+    }
+    g_hash_table_insert (window->priv->command_runs, run->command, run);
+    if (use_helper) {
+        input_pad_command_helper_run_async (window->priv->command_helper,
+                                            (const char * const *) cmd->argv,
+                                            (const char * const *) cmd->envp,
+                                            run->cancellable,
+                                            on_command_helper_run,
+                                            run);
+    } else {
+        g_subprocess_communicate_utf8_async (subprocess, NULL,
+                                             run->cancellable,
+                                             on_command_communicated,
+                                             run);
+    }
+}
+
+/* The cached output is sent at once. The output older than
+ * cache_ttl is still sent and refreshed in the background. */
+static void
+command_run_start (InputPadGtkWindow *window,
+                   const gchar       *command,
+                   guint              keysym,
+                   guint              keycode,
+                   guint              state)
+{
+    InputPadTableCmdPrivate *cmd;
+    CommandRun *run = NULL;
+    CommandCache *cache = NULL;
+
+    cmd = command_lookup (window, command);
+    if (cmd == NULL || cmd->argv == NULL) {
+        g_warning ("Could not find the prepared command: %s", command);
         return;
     }
-    g_strfreev (argv);
-    g_strfreev (envp);
-    if (exit_status != 0) {
-        g_warning ("Failed to run the script %s: %s", command,
-                   std_error ? std_error : "");
+    if (window->priv->command_runs) {
+        run = g_hash_table_lookup (window->priv->command_runs, command);
+    }
+    if (cmd->cache_ttl != 0 && window->priv->command_cache) {
+        cache = g_hash_table_lookup (window->priv->command_cache, command);
     }
-    if (std_output && strlen (std_output) > 2) {
-        if (command_output) {
-            *command_output = g_strdup (g_strchomp (std_output));
+    if (cache) {
+        command_send_output (window, cache->output, keysym, keycode, state);
+        if (cmd->cache_ttl > 0 && run == NULL &&
+            g_get_monotonic_time () - cache->time >=
+            (gint64) cmd->cache_ttl * G_TIME_SPAN_SECOND) {
+            command_run_spawn (window, command, cmd,
+                               keysym, keycode, state, FALSE);
         }
+        return;
     }
-    g_free (std_output);
-    g_free (std_error);
+
+    /* The press while the command is running restarts it. */
+    if (run) {
+        command_run_abort (run);
+    }
+    command_run_spawn (window, command, cmd, keysym, keycode, state, TRUE);
 }
 
 static void
@@ -2156,22 +3282,129 @@ destroy_char_view_table_common (GtkWidget *scrolled, InputPadGtkWindow *window)
     gtk_container_remove (GTK_CONTAINER (scrolled), viewport);
 }
 
+static void
+custom_char_button_set (InputPadGtkButton *button,
+                        InputPadTable     *table_data,
+                        int                i,
+                        const gchar       *str)
+{
+    const gchar *rawtext = NULL;
+    const gchar *tooltip = NULL;
+    guint keysym = 0;
+    guint code;
+
+    /* The recycled buttons in InputPadGtkViewport can have the values
+     * of the other entries so all the values are reset here and the
+     * label image is rendered only when the label is changed. */
+    if (table_data->type == INPUT_PAD_TABLE_TYPE_CHARS) {
+        if (str[0] == '0' && 
+            (str[1] == 'x' || str[1] == 'X')) {
+            str += 2;
+        }
+        code = (guint) g_ascii_strtoll (str, NULL, 16);
+        if (input_pad_gtk_button_get_table_type (button) != INPUT_PAD_TABLE_TYPE_CHARS ||
+            input_pad_gtk_button_get_unicode (button) != code) {
+            input_pad_gtk_button_set_unicode (button, code);
+        }
+        /* Decided input-pad always sends char but not keysym.
+         * Now keyboard layout can be used instead. */
+        input_pad_gtk_button_set_keysym (button,
+                                         (code == '\t') ? code : 0);
+        input_pad_gtk_button_set_rawtext (button, NULL);
+        return;
+    }
+
+    if (g_strcmp0 (input_pad_gtk_button_get_label (button), str) != 0) {
+        input_pad_gtk_button_set_label (button, str);
+    }
+    if (table_data->type == INPUT_PAD_TABLE_TYPE_KEYSYMS) {
+        keysym = XStringToKeysym (str);
+        if (keysym == NoSymbol) {
+            g_warning ("keysym str %s does not have the value.", str);
+        }
+    } else if (table_data->type == INPUT_PAD_TABLE_TYPE_STRINGS) {
+        rawtext = table_data->data.strs[i].rawtext;
+        tooltip = rawtext;
+        if (table_data->data.strs[i].comment) {
+            tooltip = table_data->data.strs[i].comment;
+        }
+    } else if (table_data->type == INPUT_PAD_TABLE_TYPE_COMMANDS) {
+        rawtext = table_data->data.cmds[i].execl;
+        tooltip = rawtext;
+    }
+    input_pad_gtk_button_set_keysym (button, keysym);
+    input_pad_gtk_button_set_rawtext (button, rawtext);
+    gtk_widget_set_tooltip_text (GTK_WIDGET (button), tooltip);
+    input_pad_gtk_button_set_table_type (button, table_data->type);
+}
+
+static GtkWidget *
+custom_char_button_new (InputPadTable *table_data, int i, const gchar *str)
+{
+    GtkWidget *button;
+    const gchar *code_str = str;
+
+    if (table_data->type == INPUT_PAD_TABLE_TYPE_CHARS) {
+        if (code_str[0] == '0' && 
+            (code_str[1] == 'x' || code_str[1] == 'X')) {
+            code_str += 2;
+        }
+        button = input_pad_gtk_button_new_with_unicode ((guint) g_ascii_strtoll (code_str, NULL, 16));
+    } else {
+        button = input_pad_gtk_button_new_with_label (str);
+    }
+    custom_char_button_set (INPUT_PAD_GTK_BUTTON (button), table_data, i, str);
+
+    return button;
+}
+
+static void
+custom_char_view_fill_button (GtkWidget *button, int nth, gpointer data)
+{
+    CustomCharViewData *view_data = (CustomCharViewData *) data;
+    int i;
+
+    g_return_if_fail (INPUT_PAD_IS_GTK_BUTTON (button));
+    g_return_if_fail (view_data != NULL);
+
+    if (nth < 0 || nth >= view_data->n_items) {
+        gtk_widget_hide (button);
+        return;
+    }
+    i = view_data->nth[nth];
+    custom_char_button_set (INPUT_PAD_GTK_BUTTON (button),
+                            view_data->table_data,
+                            i,
+                            view_data->char_table[i]);
+    gtk_widget_show (button);
+}
+
+static void
+custom_char_view_data_free (gpointer data)
+{
+    CustomCharViewData *view_data = (CustomCharViewData *) data;
+
+    g_strfreev (view_data->char_table);
+    g_free (view_data->nth);
+    g_free (view_data);
+}
+
 static void
 append_custom_char_view_table (GtkWidget *scrolled, InputPadTable *table_data)
 {
     InputPadGtkWindow *input_pad;
+    CustomCharViewData *view_data;
     GtkCssProvider *css_provider;
     GtkStyleContext *style_context;
     GtkWidget *table;
+    GtkWidget *viewport = NULL;
     GtkWidget *button = NULL;
     GError *error = NULL;
     gchar **char_table;
     gchar *str;
     const int max_column = table_data->column;
-    int i, num, row, col, len, code;
-    guint keysym;
+    int i, num, n_buttons, row, col;
 #if 0
-    guint **keysyms;
     InputPadXKBKeyList *xkb_key_list = NULL;
 #endif
 
@@ -2192,17 +3425,26 @@ append_custom_char_view_table (GtkWidget *scrolled, InputPadTable *table_data)
         table_data->priv->inited = 1;
         return;
     }
+
+    /* view_data->nth maps the button position to the index in
+     * char_table because the empty strings are skipped. */
+    view_data = g_new0 (CustomCharViewData, 1);
+    view_data->table_data = table_data;
+    view_data->char_table = char_table;
+    view_data->nth = g_new0 (int, g_strv_length (char_table) + 1);
     for (i = 0, num = 0; char_table[i]; i++) {
         str = char_table[i];
-        len = strlen (str);
-        if (len > 0) {
-            num++;
+        if (*str != '\0') {
+            view_data->nth[num++] = i;
         }
     }
-    col = max_column;
-    row = num / col;
-    if (num % col) {
-        row++;
+    view_data->n_items = num;
+
+    /* Only the visible rows are realized for the big tables and
+     * InputPadGtkViewport refills the buttons on scroll. */
+    n_buttons = num;
+    if (num > max_column * INPUT_PAD_MAX_WINDOW_ROW) {
+        n_buttons = max_column * INPUT_PAD_MAX_WINDOW_ROW;
     }
 
 #if 0
@@ -2241,109 +3483,229 @@ append_custom_char_view_table (GtkWidget *scrolled, InputPadTable *table_data)
                   "row-homogeneous", TRUE,
                   "column-homogeneous", TRUE,
                   NULL);
+    g_object_set_data_full (G_OBJECT (table), "custom-char-view-data",
+                            view_data, custom_char_view_data_free);
+    if (n_buttons < num) {
+        viewport = input_pad_gtk_viewport_new ();
+        gtk_container_add (GTK_CONTAINER (scrolled), viewport);
+        gtk_container_add (GTK_CONTAINER (viewport), table);
+    } else {
+#if GTK_CHECK_VERSION (3, 8, 0)
+        gtk_container_add (GTK_CONTAINER (scrolled), table);
+#else
+        gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (scrolled),
+                                               table);
+#endif
+    }
+    gtk_widget_show (table);
+
+    for (num = 0; num < n_buttons; num++) {
+        i = view_data->nth[num];
+        button = custom_char_button_new (table_data, i, char_table[i]);
+        row = num / max_column;
+        col = num % max_column;
+        style_context = gtk_widget_get_style_context (button);
+        gtk_style_context_add_provider (style_context,
+                                        GTK_STYLE_PROVIDER (css_provider),
+                                        GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+        gtk_grid_attach (GTK_GRID (table), button,
+                         col, row, 1, 1);
+
+        gtk_widget_show (button);
+        if (input_pad->child)
+            gtk_widget_set_sensitive (button,
+                                      input_pad->priv->char_button_sensitive);
+        g_signal_connect (G_OBJECT (button), "pressed",
+                          G_CALLBACK (on_button_pressed),
+                          (gpointer) table_data->priv->signal_window);
+        g_signal_connect (G_OBJECT (button), "pressed-repeat",
+                          G_CALLBACK (on_button_pressed_repeat),
+                          (gpointer) table_data->priv->signal_window);
+        g_signal_connect (G_OBJECT (table_data->priv->signal_window),
+                          "char-button-sensitive",
+                          G_CALLBACK (on_window_char_button_sensitive),
+                          (gpointer) button);
+    }
+    g_object_unref (css_provider);
+
+    if (viewport) {
+        input_pad_gtk_viewport_table_configure_with_func (INPUT_PAD_GTK_VIEWPORT (viewport),
+                                                          table,
+                                                          view_data->n_items,
+                                                          max_column,
+                                                          custom_char_view_fill_button,
+                                                          view_data);
+        gtk_widget_show (viewport);
+    }
+
+    table_data->priv->inited = 1;
+}
+
+static void
+destroy_custom_char_view_table (GtkWidget *scrolled, InputPadGtkWindow *window)
+{
+    /* Currently same contents. */
+    destroy_char_view_table_common (scrolled, window);
+}
+
+static const gchar *
+search_hit_get_label (InputPadGroupIndexHit *hit)
+{
+    if (hit->table->type == INPUT_PAD_TABLE_TYPE_STRINGS) {
+        return hit->table->data.strs[hit->nth].label;
+    } else if (hit->table->data.cmds[hit->nth].label) {
+        return hit->table->data.cmds[hit->nth].label;
+    }
+    return hit->table->data.cmds[hit->nth].execl;
+}
+
+static void
+search_char_view_fill_button (GtkWidget *button, int nth, gpointer data)
+{
+    SearchCharViewData *view_data = (SearchCharViewData *) data;
+    InputPadGroupIndexHit *hit;
+
+    g_return_if_fail (INPUT_PAD_IS_GTK_BUTTON (button));
+    g_return_if_fail (view_data != NULL);
+
+    if (nth < 0 || nth >= view_data->n_hits) {
+        gtk_widget_hide (button);
+        return;
+    }
+    hit = &view_data->hits[nth];
+    custom_char_button_set (INPUT_PAD_GTK_BUTTON (button),
+                            hit->table,
+                            hit->nth,
+                            search_hit_get_label (hit));
+    gtk_widget_show (button);
+}
+
+static void
+search_char_view_data_free (gpointer data)
+{
+    SearchCharViewData *view_data = (SearchCharViewData *) data;
+
+    input_pad_group_index_free_hits (view_data->hits);
+    g_free (view_data);
+}
+
+static void
+append_search_char_view_table (GtkWidget              *scrolled,
+                               InputPadGroupIndexHit  *hits,
+                               InputPadGtkWindow      *input_pad)
+{
+    SearchCharViewData *view_data;
+    GtkCssProvider *css_provider;
+    GtkStyleContext *style_context;
+    GtkWidget *table;
+    GtkWidget *viewport = NULL;
+    GtkWidget *button;
+    GError *error = NULL;
+    int i, n_hits, n_buttons, row, col;
+    int max_column = INPUT_PAD_MAX_COLUMN;
+
+    g_return_if_fail (hits != NULL);
+
+    /* The hits can come from different tables and use the narrowest
+     * column so that the wide string labels fit in the view. */
+    for (i = 0; hits[i].table; i++) {
+        if (hits[i].table->column > 0 &&
+            hits[i].table->column < max_column) {
+            max_column = hits[i].table->column;
+        }
+    }
+    n_hits = i;
+    view_data = g_new0 (SearchCharViewData, 1);
+    view_data->hits = hits;
+    view_data->n_hits = n_hits;
+
+    /* Only the visible rows are realized as the custom tables. */
+    n_buttons = n_hits;
+    if (n_hits > max_column * INPUT_PAD_MAX_WINDOW_ROW) {
+        n_buttons = max_column * INPUT_PAD_MAX_WINDOW_ROW;
+    }
+
+    css_provider = gtk_css_provider_new ();
+    if (input_pad->child) {
+        gtk_css_provider_load_from_data (
+                css_provider,
+                CSS_DATA_NARROW_BUTTON,
+                -1,
+                &error);
+    } else {
+        /* FIXME: cannot change background in GTK3 button. */
+        gtk_css_provider_load_from_data (
+                css_provider,
+                CSS_DATA_GRAY_NARROW_BUTTON,
+                -1,
+                &error);
+    }
+
+    table = gtk_grid_new ();
+    g_object_set (table,
+                  "halign", GTK_ALIGN_START,
+                  "valign", GTK_ALIGN_START,
+                  "margin", 0,
+                  "expand", FALSE,
+                  "row-spacing", 0,
+                  "column-spacing", 0,
+                  "row-homogeneous", TRUE,
+                  "column-homogeneous", TRUE,
+                  NULL);
+    g_object_set_data_full (G_OBJECT (table), "search-char-view-data",
+                            view_data, search_char_view_data_free);
+    if (n_buttons < n_hits) {
+        viewport = input_pad_gtk_viewport_new ();
+        gtk_container_add (GTK_CONTAINER (scrolled), viewport);
+        gtk_container_add (GTK_CONTAINER (viewport), table);
+    } else {
 #if GTK_CHECK_VERSION (3, 8, 0)
-    gtk_container_add (GTK_CONTAINER (scrolled), table);
+        gtk_container_add (GTK_CONTAINER (scrolled), table);
 #else
-    gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (scrolled),
-                                           table);
+        gtk_scrolled_window_add_with_viewport (GTK_SCROLLED_WINDOW (scrolled),
+                                               table);
 #endif
+    }
     gtk_widget_show (table);
 
-    for (i = 0, num = 0; char_table[i]; i++) {
-        str = char_table[i];
-        len = strlen (str);
-        if (len > 0) {
-            if (table_data->type == INPUT_PAD_TABLE_TYPE_CHARS) {
-                if (str[0] == '0' && 
-                    (str[1] == 'x' || str[1] == 'X')) {
-                    str += 2;
-                    len -= 2;
-                }
-                code = (int) g_ascii_strtoll (str, NULL, 16);
-                button = input_pad_gtk_button_new_with_unicode (code);
-                /* Decided input-pad always sends char but not keysym.
-                 * Now keyboard layout can be used instead. */
-#if 0
-                if (code <= 0x7f) {
-                    input_pad_gtk_button_set_keysym (INPUT_PAD_GTK_BUTTON (button),
-                                                     code);
-                    keysyms = NULL;
-                    if (xkb_key_list) {
-                        keysyms = xkb_key_list_get_all_keysyms_from_keysym (xkb_key_list,
-                                                                           code);
-                    }
-                    if (keysyms) {
-                        input_pad_gtk_button_set_all_keysyms (INPUT_PAD_GTK_BUTTON (button),
-                                                              keysyms);
-                    }
-                }
-#endif
-            } else if (table_data->type == INPUT_PAD_TABLE_TYPE_KEYSYMS) {
-                button = input_pad_gtk_button_new_with_label (str);
-                keysym = XStringToKeysym (str);
-                if (keysym == NoSymbol) {
-                    g_warning ("keysym str %s does not have the value.", str);
-                }
-                input_pad_gtk_button_set_keysym (INPUT_PAD_GTK_BUTTON (button),
-                                                 keysym);
-            } else if (table_data->type == INPUT_PAD_TABLE_TYPE_STRINGS) {
-                button = input_pad_gtk_button_new_with_label (char_table[i]);
-                if (table_data->data.strs[i].rawtext) {
-                    gtk_widget_set_tooltip_text (button,
-                                                 table_data->data.strs[i].rawtext);
-                    input_pad_gtk_button_set_rawtext (INPUT_PAD_GTK_BUTTON (button),
-                                                      table_data->data.strs[i].rawtext);
-                }
-                if (table_data->data.strs[i].comment) {
-                    gtk_widget_set_tooltip_text (button,
-                                                 table_data->data.strs[i].comment);
-                }
-            } else if (table_data->type == INPUT_PAD_TABLE_TYPE_COMMANDS) {
-                button = input_pad_gtk_button_new_with_label (char_table[i]);
-                gtk_widget_set_tooltip_text (button,
-                                             table_data->data.cmds[i].execl);
-                input_pad_gtk_button_set_rawtext (INPUT_PAD_GTK_BUTTON (button),
-                                                  table_data->data.cmds[i].execl);
-            }
-            input_pad_gtk_button_set_table_type (INPUT_PAD_GTK_BUTTON (button),
-                                                 table_data->type);
-            row = num / max_column;
-            col = num % max_column;
-            style_context = gtk_widget_get_style_context (button);
-            gtk_style_context_add_provider (style_context,
-                                            GTK_STYLE_PROVIDER (css_provider),
-                                            GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
-            gtk_grid_attach (GTK_GRID (table), button,
-                             col, row, 1, 1);
+    for (i = 0; i < n_buttons; i++) {
+        button = custom_char_button_new (hits[i].table, hits[i].nth,
+                                         search_hit_get_label (&hits[i]));
+        row = i / max_column;
+        col = i % max_column;
+        style_context = gtk_widget_get_style_context (button);
+        gtk_style_context_add_provider (style_context,
+                                        GTK_STYLE_PROVIDER (css_provider),
+                                        GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+        gtk_grid_attach (GTK_GRID (table), button,
+                         col, row, 1, 1);
 
-            gtk_widget_show (button);
-            if (input_pad->child)
-                gtk_widget_set_sensitive (button,
-                                          input_pad->priv->char_button_sensitive);
-            g_signal_connect (G_OBJECT (button), "pressed",
-                              G_CALLBACK (on_button_pressed),
-                              (gpointer) table_data->priv->signal_window);
-            g_signal_connect (G_OBJECT (button), "pressed-repeat",
-                              G_CALLBACK (on_button_pressed_repeat),
-                              (gpointer) table_data->priv->signal_window);
-            g_signal_connect (G_OBJECT (table_data->priv->signal_window),
-                              "char-button-sensitive",
-                              G_CALLBACK (on_window_char_button_sensitive),
-                              (gpointer) button);
-            num++;
-        }
+        gtk_widget_show (button);
+        if (input_pad->child)
+            gtk_widget_set_sensitive (button,
+                                      input_pad->priv->char_button_sensitive);
+        g_signal_connect (G_OBJECT (button), "pressed",
+                          G_CALLBACK (on_button_pressed),
+                          (gpointer) input_pad);
+        g_signal_connect (G_OBJECT (button), "pressed-repeat",
+                          G_CALLBACK (on_button_pressed_repeat),
+                          (gpointer) input_pad);
+        g_signal_connect (G_OBJECT (input_pad),
+                          "char-button-sensitive",
+                          G_CALLBACK (on_window_char_button_sensitive),
+                          (gpointer) button);
     }
     g_object_unref (css_provider);
-    g_strfreev (char_table);
-
-    table_data->priv->inited = 1;
-}
 
-static void
-destroy_custom_char_view_table (GtkWidget *scrolled, InputPadGtkWindow *window)
-{
-    /* Currently same contents. */
-    destroy_char_view_table_common (scrolled, window);
+    if (viewport) {
+        input_pad_gtk_viewport_table_configure_with_func (INPUT_PAD_GTK_VIEWPORT (viewport),
+                                                          table,
+                                                          n_hits,
+                                                          max_column,
+                                                          search_char_view_fill_button,
+                                                          view_data);
+        gtk_widget_show (viewport);
+    }
 }
 
 gchar *
@@ -2429,11 +3791,20 @@ create_keyboard_layout_ui_real_default (GtkWidget *vbox, InputPadGtkWindow *wind
     GtkWidget *button_num_lock = NULL;
     GError *error = NULL;
     GList *orig_children, *children = NULL;
-    char *tooltip;
-    char *display_name;
 
     g_return_if_fail (xkb_key_list != NULL);
 
+    if (window->priv->keyboard_buttons) {
+        g_ptr_array_free (window->priv->keyboard_buttons, TRUE);
+    }
+    window->priv->keyboard_buttons = g_ptr_array_new ();
+    g_signal_handlers_disconnect_by_func (G_OBJECT (window),
+                                          G_CALLBACK (on_window_keyboard_changed),
+                                          NULL);
+    g_signal_connect (G_OBJECT (window), "keyboard-changed",
+                      G_CALLBACK (on_window_keyboard_changed),
+                      NULL);
+
     hbox = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 5);
     gtk_box_pack_start (GTK_BOX (vbox), hbox, FALSE, FALSE, 0);
     gtk_box_reorder_child (GTK_BOX (vbox), hbox, 0);
@@ -2520,17 +3891,12 @@ create_keyboard_layout_ui_real_default (GtkWidget *vbox, InputPadGtkWindow *wind
         col = 0;
         key_row = list->row;
         while (key_row) {
-            display_name = get_keysym_display_name (key_row->keysym[0][0],
-                                                    GTK_WIDGET (window),
-                                                    &tooltip);
-            button = input_pad_gtk_button_new_with_label_size (display_name,
-                                                               KEYBOARD_ICON_SIZE);
-            gtk_widget_set_tooltip_text (button, tooltip);
-            g_free (display_name);
+            button = g_object_new (INPUT_PAD_TYPE_GTK_BUTTON, NULL);
+            keyboard_button_set_keysym_label (window,
+                                              INPUT_PAD_GTK_BUTTON (button),
+                                              key_row->keysym[0][0]);
             input_pad_gtk_button_set_keycode (INPUT_PAD_GTK_BUTTON (button),
                                               (guint) key_row->keycode);
-            input_pad_gtk_button_set_keysym (INPUT_PAD_GTK_BUTTON (button),
-                                             key_row->keysym[0][0]);
             input_pad_gtk_button_set_all_keysyms (INPUT_PAD_GTK_BUTTON (button),
                                                   key_row->keysym);
             input_pad_gtk_button_set_table_type (INPUT_PAD_GTK_BUTTON (button),
@@ -2549,9 +3915,7 @@ create_keyboard_layout_ui_real_default (GtkWidget *vbox, InputPadGtkWindow *wind
             g_signal_connect (G_OBJECT (button), "pressed-repeat",
                               G_CALLBACK (on_button_pressed_repeat),
                               (gpointer) window);
-            g_signal_connect (G_OBJECT (window), "keyboard-changed",
-                              G_CALLBACK (on_window_keyboard_changed),
-                              (gpointer) button);
+            g_ptr_array_add (window->priv->keyboard_buttons, button);
             if (key_row->keysym[0][0] == XK_Shift_L) {
                 button_shift_l = button;
             } else if (key_row->keysym[0][0] == XK_Shift_R) {
@@ -2629,6 +3993,8 @@ create_keyboard_layout_ui_real_default (GtkWidget *vbox, InputPadGtkWindow *wind
                       table_data);
 
     g_object_unref (css_provider);
+
+    keyboard_labels_prerender_start (window);
 }
 
 G_INLINE_FUNC void
@@ -2649,11 +4015,7 @@ keyboard_element_remove (GtkWidget *button, gpointer data)
 {
     TableForEachData *foreach_data = (TableForEachData *) data;
     GtkWidget *table = foreach_data->table;
-    InputPadGtkWindow *window = foreach_data->window;
 
-    g_signal_handlers_disconnect_by_func (G_OBJECT (window),
-                                          G_CALLBACK (on_window_keyboard_changed),
-                                          (gpointer) button);
     gtk_container_remove (GTK_CONTAINER (table), button);
 }
 
@@ -2679,6 +4041,15 @@ destroy_prev_keyboard_layout_default (GtkWidget *vbox, InputPadGtkWindow *window
     GtkWidget *hbox;
     static TableForEachData foreach_data = { NULL, };
 
+    g_signal_handlers_disconnect_by_func (G_OBJECT (window),
+                                          G_CALLBACK (on_window_keyboard_changed),
+                                          NULL);
+    if (window->priv->keyboard_buttons) {
+        g_ptr_array_free (window->priv->keyboard_buttons, TRUE);
+        window->priv->keyboard_buttons = NULL;
+    }
+    keyboard_labels_prerender_stop (window);
+
     children = gtk_container_get_children (GTK_CONTAINER (vbox));
     hbox = GTK_WIDGET (children->data);
     g_list_free (children);
@@ -2733,6 +4104,57 @@ sort_layout_name (GtkTreeModel *model,
     return retval;
 }
 
+static gchar *
+layout_row_key_new (const gchar *layout_name, const gchar *variant_name)
+{
+    if (variant_name == NULL || *variant_name == '\0') {
+        return g_strdup (layout_name);
+    }
+    return g_strdup_printf ("%s(%s)", layout_name, variant_name);
+}
+
+/* The rows of the layout combo box are indexed by "layout(variant)".
+ * GtkTreeStore iters persist while the rows exist. */
+static GHashTable *
+config_layouts_combobox_get_rows (GtkTreeStore *list)
+{
+    GHashTable *rows;
+
+    rows = (GHashTable *) g_object_get_data (G_OBJECT (list), "layout-rows");
+    if (rows == NULL) {
+        rows = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                      g_free,
+                                      (GDestroyNotify) gtk_tree_iter_free);
+        g_object_set_data_full (G_OBJECT (list), "layout-rows", rows,
+                                (GDestroyNotify) g_hash_table_destroy);
+    }
+    return rows;
+}
+
+static void
+config_layouts_combobox_append_layout (GtkTreeStore *list,
+                                       const gchar *layout_name,
+                                       const gchar *layout_desc,
+                                       const gchar *variant_name,
+                                       const gchar *variant_desc)
+{
+    GtkTreeIter   iter;
+
+    gtk_tree_store_append (list, &iter, NULL);
+    gtk_tree_store_set (list, &iter,
+                        LAYOUT_LAYOUT_NAME_COL,
+                        layout_name,
+                        LAYOUT_LAYOUT_DESC_COL,
+                        variant_desc ? variant_desc : layout_desc,
+                        LAYOUT_VARIANT_NAME_COL,
+                        variant_name,
+                        LAYOUT_VARIANT_DESC_COL, NULL,
+                        LAYOUT_VISIBLE_COL, TRUE, -1);
+    g_hash_table_replace (config_layouts_combobox_get_rows (list),
+                          layout_row_key_new (layout_name, variant_name),
+                          gtk_tree_iter_copy (&iter));
+}
+
 static void
 config_layouts_combobox_remove_layout (GtkTreeStore *list,
                                        const gchar *layout_name,
@@ -2740,39 +4162,20 @@ config_layouts_combobox_remove_layout (GtkTreeStore *list,
                                        const gchar *variant_name,
                                        const gchar *variant_desc)
 {
+    GHashTable   *rows;
+    GtkTreeIter  *row;
     GtkTreeIter   iter;
+    gchar        *key;
 
-    gtk_tree_model_get_iter_first (GTK_TREE_MODEL (list), &iter);
-    do {
-        gchar *combo_layout_name = NULL;
-        gchar *combo_layout_desc = NULL;
-        gchar *combo_variant_name = NULL;
-        gchar *combo_variant_desc = NULL;
-
-        gtk_tree_model_get (GTK_TREE_MODEL (list), &iter,
-                            LAYOUT_LAYOUT_NAME_COL,
-                            &combo_layout_name,
-                            LAYOUT_LAYOUT_DESC_COL,
-                            &combo_layout_desc,
-                            LAYOUT_VARIANT_NAME_COL,
-                            &combo_variant_name,
-                            LAYOUT_VARIANT_DESC_COL,
-                            &combo_variant_desc,
-                            -1);
-        if (!g_strcmp0 (combo_layout_name, layout_name) &&
-            !g_strcmp0 (combo_variant_name, variant_name)) {
-            gtk_tree_store_remove (GTK_TREE_STORE (list), &iter);
-            g_free (combo_layout_name);
-            g_free (combo_layout_desc);
-            g_free (combo_variant_name);
-            g_free (combo_variant_desc);
-            break;
-        }
-        g_free (combo_layout_name);
-        g_free (combo_layout_desc);
-        g_free (combo_variant_name);
-        g_free (combo_variant_desc);
-    } while (gtk_tree_model_iter_next (GTK_TREE_MODEL (list), &iter));
+    rows = config_layouts_combobox_get_rows (list);
+    key = layout_row_key_new (layout_name, variant_name);
+    row = (GtkTreeIter *) g_hash_table_lookup (rows, key);
+    if (row != NULL) {
+        iter = *row;
+        g_hash_table_remove (rows, key);
+        gtk_tree_store_remove (list, &iter);
+    }
+    g_free (key);
 }
 
 static void
@@ -2809,11 +4212,74 @@ config_layouts_list_remove_iter (GtkListStore *list,
     }
 }
 
+static GtkListStore *
+config_layouts_add_list_get (InputPadGtkWindow *window)
+{
+    GtkTreeModel *model;
+
+    model = gtk_tree_view_get_model (GTK_TREE_VIEW (window->priv->config_layouts_add_treeview));
+    if (GTK_IS_TREE_MODEL_FILTER (model)) {
+        model = gtk_tree_model_filter_get_model (GTK_TREE_MODEL_FILTER (model));
+    }
+    return GTK_LIST_STORE (model);
+}
+
+static gboolean
+config_layouts_filter_visible (GtkTreeModel *model,
+                               GtkTreeIter  *iter,
+                               gpointer      data)
+{
+    InputPadGtkWindow *window = INPUT_PAD_GTK_WINDOW (data);
+    const gchar *text;
+    const gchar *search_key = NULL;
+    gchar *layout = NULL;
+    gchar *variant = NULL;
+    gchar *desc = NULL;
+    gchar *folded = NULL;
+    gboolean retval;
+
+    if (window->priv == NULL) {
+        return TRUE;
+    }
+    text = window->priv->config_layouts_search_text;
+    if (text == NULL || *text == '\0') {
+        return TRUE;
+    }
+    gtk_tree_model_get (model, iter,
+                        LAYOUT_LAYOUT_NAME_COL, &layout,
+                        LAYOUT_VARIANT_NAME_COL, &variant,
+                        LAYOUT_LAYOUT_DESC_COL, &desc, -1);
+    if (desc == NULL) {
+        g_free (layout);
+        g_free (variant);
+        return FALSE;
+    }
+    if (window->priv->xkb_config_reg) {
+        search_key = input_pad_gdk_xkb_config_reg_get_search_key (window->priv->xkb_config_reg,
+                                                                  layout,
+                                                                  variant);
+    }
+    if (search_key == NULL) {
+        folded = g_utf8_casefold (desc, -1);
+        search_key = folded;
+    }
+    retval = (strstr (search_key, text) != NULL);
+    g_free (folded);
+    g_free (layout);
+    g_free (variant);
+    g_free (desc);
+    return retval;
+}
+
 static void
 config_layouts_treeview_set_list (GtkWidget    *treeview,
                                   GtkListStore *list,
-                                  gboolean      is_sortable)
+                                  gboolean      is_sortable,
+                                  GtkTreeModelFilterVisibleFunc
+                                                filter_func,
+                                  gpointer      filter_data)
 {
+    GtkTreeModel *model = GTK_TREE_MODEL (list);
     GtkCellRenderer *renderer;
     GtkTreeViewColumn *column;
 
@@ -2826,8 +4292,16 @@ config_layouts_treeview_set_list (GtkWidget    *treeview,
                                               LAYOUT_LAYOUT_DESC_COL,
                                               GTK_SORT_ASCENDING);
     }
-    gtk_tree_view_set_model (GTK_TREE_VIEW (treeview), GTK_TREE_MODEL (list));
-    g_object_unref (G_OBJECT (list));
+    if (filter_func) {
+        model = gtk_tree_model_filter_new (GTK_TREE_MODEL (list), NULL);
+        gtk_tree_model_filter_set_visible_func (GTK_TREE_MODEL_FILTER (model),
+                                                filter_func,
+                                                filter_data,
+                                                NULL);
+        g_object_unref (G_OBJECT (list));
+    }
+    gtk_tree_view_set_model (GTK_TREE_VIEW (treeview), model);
+    g_object_unref (G_OBJECT (model));
 
     renderer = gtk_cell_renderer_text_new ();
     column = gtk_tree_view_column_new_with_attributes (_("Layout"), renderer,
@@ -2843,11 +4317,13 @@ config_layouts_treeview_set (InputPadGtkWindow         *input_pad,
                              InputPadXKBLayoutList     *xkb_layout_list)
 {
     InputPadXKBLayoutList *layouts = NULL;
-    GtkTreeIter   iter;
     GtkListStore *add_list;
     GtkListStore *remove_list;
+    GHashTable *group_keys;
     gchar **group_layouts = input_pad->priv->group_layouts;
     gchar **group_variants = input_pad->priv->group_variants;
+    gchar *key;
+    guint n_variants;
     int i;
 
     add_list = gtk_list_store_new (LAYOUT_N_COLS,
@@ -2863,79 +4339,49 @@ config_layouts_treeview_set (InputPadGtkWindow         *input_pad,
                                       G_TYPE_STRING,
                                       G_TYPE_BOOLEAN);
 
+    /* The current group layouts go to the remove list. */
+    group_keys = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                        g_free, NULL);
+    n_variants = group_variants ? g_strv_length (group_variants) : 0;
+    for (i = 0; group_layouts && group_layouts[i]; i++) {
+        g_hash_table_add (group_keys,
+                          layout_row_key_new (group_layouts[i],
+                                              (guint) i < n_variants ?
+                                                  group_variants[i] : NULL));
+    }
+
     for (layouts = xkb_layout_list; layouts; layouts = layouts->next) {
         InputPadXKBVariantList *variants = layouts->variants;
 
-        config_layouts_list_append_layout (add_list,
+        key = layout_row_key_new (layouts->layout, NULL);
+        config_layouts_list_append_layout (g_hash_table_contains (group_keys, key) ?
+                                               remove_list : add_list,
                                            layouts->layout,
                                            layouts->desc,
                                            NULL,
                                            NULL);
+        g_free (key);
         while (variants) {
-            config_layouts_list_append_layout (add_list,
+            key = layout_row_key_new (layouts->layout, variants->variant);
+            config_layouts_list_append_layout (g_hash_table_contains (group_keys, key) ?
+                                                   remove_list : add_list,
                                                layouts->layout,
                                                layouts->desc,
                                                variants->variant,
                                                variants->desc);
+            g_free (key);
             variants = variants->next;
         }
     }
-
-    gtk_tree_model_get_iter_first (GTK_TREE_MODEL (add_list), &iter);
-    do {
-        gchar *layout_name = NULL;
-        gchar *layout_desc = NULL;
-        gchar *variant_name = NULL;
-        gchar *variant_desc = NULL;
-
-        gtk_tree_model_get (GTK_TREE_MODEL (add_list), &iter,
-                            LAYOUT_LAYOUT_NAME_COL,
-                            &layout_name,
-                            LAYOUT_LAYOUT_DESC_COL,
-                            &layout_desc,
-                            LAYOUT_VARIANT_NAME_COL,
-                            &variant_name,
-                            LAYOUT_VARIANT_DESC_COL,
-                            &variant_desc,
-                            -1);
-        for (i = 0; group_layouts[i]; i++) {
-            if (!g_strcmp0 (group_layouts[i], layout_name)) {
-                if (group_variants == NULL ||
-                    i >= g_strv_length (group_variants) ||
-                    group_variants[i] == NULL ||
-                    *group_variants[i] == '\0') {
-                    if (variant_name == NULL) {
-                        config_layouts_list_remove_iter (add_list, &iter);
-                        config_layouts_list_append_layout (remove_list,
-                                                           layout_name,
-                                                           layout_desc,
-                                                           variant_name,
-                                                           variant_desc);
-                        break;
-                    }
-                } else {
-                    if (!g_strcmp0 (group_variants[i], variant_name)) {
-                        config_layouts_list_remove_iter (add_list, &iter);
-                        config_layouts_list_append_layout (remove_list,
-                                                           layout_name,
-                                                           layout_desc,
-                                                           variant_name,
-                                                           variant_desc);
-                        break;
-                    }
-                }
-            }
-        }
-        g_free (layout_name);
-        g_free (layout_desc);
-        g_free (variant_name);
-        g_free (variant_desc);
-    } while (gtk_tree_model_iter_next (GTK_TREE_MODEL (add_list), &iter));
+    g_hash_table_destroy (group_keys);
 
     config_layouts_treeview_set_list (input_pad->priv->config_layouts_add_treeview,
-                                      add_list, TRUE);
+                                      add_list, TRUE,
+                                      config_layouts_filter_visible,
+                                      input_pad);
     config_layouts_treeview_set_list (input_pad->priv->config_layouts_remove_treeview,
-                                      remove_list, FALSE);
+                                      remove_list, FALSE,
+                                      NULL, NULL);
 }
 
 static void
@@ -2943,13 +4389,19 @@ config_options_treeview_set (InputPadGtkWindow                 *input_pad,
                              InputPadXKBOptionGroupList        *xkb_group_list)
 {
     InputPadXKBOptionGroupList *groups = NULL;
+    InputPadXKBOptionList *options;
     GtkWidget *expander;
-    GtkWidget *vbox;
-    GtkWidget *checkbutton;
     GtkWidget *label;
     gchar **group_options = input_pad->priv->group_options;
     int i;
 
+    if (input_pad->priv->config_options_checked == NULL) {
+        input_pad->priv->config_options_checked =
+            g_hash_table_new (g_str_hash, g_str_equal);
+    }
+    g_hash_table_remove_all (input_pad->priv->config_options_checked);
+
+    /* The hash table keeps the option strings of the registry. */
     for (groups = xkb_group_list ; groups; groups = groups->next) {
         int checked = 0;
 
@@ -2959,108 +4411,73 @@ config_options_treeview_set (InputPadGtkWindow                 *input_pad,
         gtk_widget_show (expander);
         g_object_set_data (G_OBJECT (expander), "option_group",
                            (gpointer) groups->option_group);
-        g_object_set_data (G_OBJECT (expander), "checked",
-                           GINT_TO_POINTER (checked));
-        vbox = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
-        gtk_widget_set_margin_start (vbox, 18);
-        gtk_container_add (GTK_CONTAINER (expander), vbox);
-        gtk_widget_show (vbox);
-
-        InputPadXKBOptionList *options = groups->options;
-        while (options) {
-            gboolean has_option = FALSE;
-
-            checkbutton = gtk_check_button_new_with_label (options->desc);
-            g_object_set_data (G_OBJECT (checkbutton), "option",
-                               (gpointer) options->option);
-            for (i = 0; group_options[i]; i++) {
+        g_object_set_data (G_OBJECT (expander), "option_group_list",
+                           (gpointer) groups);
+        g_object_set_data (G_OBJECT (expander), "window",
+                           (gpointer) input_pad);
+
+        for (options = groups->options; options; options = options->next) {
+            for (i = 0; group_options && group_options[i]; i++) {
                 if (!g_strcmp0 (group_options[i], options->option)) {
-                    has_option = TRUE;
+                    g_hash_table_add (input_pad->priv->config_options_checked,
+                                      (gpointer) options->option);
+                    checked++;
                     break;
                 }
             }
-            if (has_option) {
-                gchar *text = g_strdup_printf ("<b>%s</b>", groups->desc);
-
-                gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (checkbutton),
-                                              TRUE);
-                label = gtk_expander_get_label_widget (GTK_EXPANDER (expander));
-                gtk_label_set_markup (GTK_LABEL (label), text);
-                g_free (text);
-                g_object_set_data (G_OBJECT (expander), "checked",
-                                   GINT_TO_POINTER (++checked));
-            }
-            g_signal_connect (checkbutton, "toggled",
-                              G_CALLBACK (on_checkbutton_config_options_option_clicked),
-                              (gpointer) expander);
-            gtk_box_pack_start (GTK_BOX (vbox), checkbutton, FALSE, TRUE, 0);
-            gtk_widget_show (checkbutton);
-            options = options->next;
         }
+        if (checked > 0) {
+            gchar *text = g_strdup_printf ("<b>%s</b>", groups->desc);
+
+            label = gtk_expander_get_label_widget (GTK_EXPANDER (expander));
+            gtk_label_set_markup (GTK_LABEL (label), text);
+            g_free (text);
+        }
+        g_object_set_data (G_OBJECT (expander), "checked",
+                           GINT_TO_POINTER (checked));
+        g_signal_connect (expander, "notify::expanded",
+                          G_CALLBACK (on_expander_config_options_expanded),
+                          (gpointer) input_pad);
     }
 }
 
 static GtkTreeModel *
 layout_model_new (InputPadGtkWindow            *input_pad,
-                  InputPadXKBLayoutList        *xkb_layout_list)
+                  InputPadXKBConfigReg         *xkb_config_reg)
 {
-    InputPadXKBLayoutList *layouts = NULL;
+    InputPadXKBLayoutList *layout;
+    InputPadXKBVariantList *variant;
     GtkTreeStore *store;
-    GtkTreeIter   iter;
     gchar **group_layouts = input_pad->priv->group_layouts;
     gchar **group_variants = input_pad->priv->group_variants;
+    guint n_variants;
     int i;
 
     store = gtk_tree_store_new (LAYOUT_N_COLS, G_TYPE_STRING, G_TYPE_STRING,
                                 G_TYPE_STRING, G_TYPE_STRING, G_TYPE_BOOLEAN);
+    n_variants = group_variants ? g_strv_length (group_variants) : 0;
     for (i = 0; group_layouts[i]; i++) {
-        const gchar *layout_name = NULL;
-        const gchar *layout_desc = NULL;
-        const gchar *variant_name = NULL;
-        const gchar *variant_desc = NULL;
-        gboolean has_layout = FALSE;
-
-        for (layouts = xkb_layout_list ;layouts; layouts = layouts->next) {
-            InputPadXKBVariantList *variants = layouts->variants;
-
-            if (!g_strcmp0 (group_layouts[i], layouts->layout)) {
-                layout_name = layouts->layout;
-                layout_desc = layouts->desc;
-                if (group_variants == NULL ||
-                    i >= g_strv_length (group_variants) ||
-                    group_variants[i] == NULL ||
-                    *group_variants[i] == '\0') {
-                    has_layout = TRUE;
-                    break;
-                }
-                while (variants) {
-                    if (!g_strcmp0 (group_variants[i], variants->variant)) {
-                        has_layout = TRUE;
-                        variant_name = variants->variant;
-                        variant_desc = variants->desc;
-                        break;
-                    }
-                    variants = variants->next;
-                }
-            }
-            if (has_layout) {
-                break;
-            }
-        }
-        if (!has_layout) {
+        layout = input_pad_gdk_xkb_config_reg_lookup_layout (xkb_config_reg,
+                                                             group_layouts[i]);
+        if (layout == NULL) {
             continue;
         }
-        gtk_tree_store_append (store, &iter, NULL);
-        gtk_tree_store_set (store, &iter,
-                            LAYOUT_LAYOUT_NAME_COL,
-                            layout_name,
-                            LAYOUT_LAYOUT_DESC_COL,
-                            variant_desc ? variant_desc :
-                                layout_desc,
-                            LAYOUT_VARIANT_NAME_COL,
-                            variant_name,
-                            LAYOUT_VARIANT_DESC_COL, NULL,
-                            LAYOUT_VISIBLE_COL, TRUE, -1);
+        variant = NULL;
+        if ((guint) i < n_variants &&
+            group_variants[i] != NULL &&
+            *group_variants[i] != '\0') {
+            variant = input_pad_gdk_xkb_config_reg_lookup_variant (xkb_config_reg,
+                                                                   group_layouts[i],
+                                                                   group_variants[i]);
+            if (variant == NULL) {
+                continue;
+            }
+        }
+        config_layouts_combobox_append_layout (store,
+                                               layout->layout,
+                                               layout->desc,
+                                               variant ? variant->variant : NULL,
+                                               variant ? variant->desc : NULL);
     }
 
     /* Appended layouts should be last. */
@@ -3108,7 +4525,7 @@ create_keyboard_layout_list_ui_real (GtkWidget *vbox, InputPadGtkWindow *window)
     combobox = gtk_combo_box_new ();
     gtk_label_set_mnemonic_widget (GTK_LABEL (label), combobox);
     gtk_box_pack_start (GTK_BOX (hbox), combobox, FALSE, FALSE, 0);
-    model = layout_model_new (window, layouts);
+    model = layout_model_new (window, xkb_config_reg);
     gtk_combo_box_set_model (GTK_COMBO_BOX (combobox), model);
     g_object_unref (G_OBJECT (model));
     if (gtk_tree_model_get_iter_first (model, &iter)) {
@@ -3177,148 +4594,6 @@ set_about (GtkWidget *widget)
     g_free (license);
 }
 
-static GtkTreeModel *
-custom_char_group_model_new (InputPadGtkWindow *window)
-{
-    InputPadGroup *group;
-    GtkTreeStore *store;
-    GtkTreeIter   iter;
-    int i;
-
-    g_return_val_if_fail (INPUT_PAD_IS_GTK_WINDOW (window), NULL);
-    g_return_val_if_fail (window->priv != NULL && window->priv->group != NULL, NULL);
-
-    group = window->priv->group;
-
-    store = gtk_tree_store_new (CHAR_BLOCK_N_COLS,
-                                G_TYPE_STRING, G_TYPE_STRING,
-                                G_TYPE_STRING,
-                                G_TYPE_UINT, G_TYPE_UINT,
-                                G_TYPE_BOOLEAN);
-    for (i = 0; group; i++) {
-        gtk_tree_store_append (store, &iter, NULL);
-        gtk_tree_store_set (store, &iter,
-                            CHAR_BLOCK_LABEL_COL,
-                            group->name,
-                            CHAR_BLOCK_UNICODE_COL, NULL,
-                            CHAR_BLOCK_UTF8_COL, NULL,
-                            CHAR_BLOCK_START_COL, i,
-                            CHAR_BLOCK_END_COL, 0,
-                            CHAR_BLOCK_VISIBLE_COL, TRUE,
-                            -1);
-        group = group->next;
-    }
-    return GTK_TREE_MODEL (store);
-}
-
-static GtkTreeModel *
-custom_char_table_model_new (InputPadGtkWindow *window, InputPadTable *table)
-{
-    GtkTreeStore *store;
-    GtkTreeIter   iter;
-    int i;
-
-    g_return_val_if_fail (INPUT_PAD_IS_GTK_WINDOW (window), NULL);
-    g_return_val_if_fail (table != NULL, NULL);
-
-    store = gtk_tree_store_new (CHAR_BLOCK_N_COLS,
-                                G_TYPE_STRING, G_TYPE_STRING,
-                                G_TYPE_STRING,
-                                G_TYPE_UINT, G_TYPE_UINT,
-                                G_TYPE_BOOLEAN);
-    for (i = 0; table; i++) {
-        gtk_tree_store_append (store, &iter, NULL);
-        gtk_tree_store_set (store, &iter,
-                            CHAR_BLOCK_LABEL_COL,
-                            table->name,
-                            CHAR_BLOCK_UNICODE_COL, NULL,
-                            CHAR_BLOCK_UTF8_COL, NULL,
-                            CHAR_BLOCK_START_COL, i,
-                            CHAR_BLOCK_END_COL, 0,
-                            CHAR_BLOCK_VISIBLE_COL, TRUE,
-                            -1);
-        table = table->next;
-    }
-    return GTK_TREE_MODEL (store);
-}
-
-static int
-sort_char_block_start (GtkTreeModel *model,
-                       GtkTreeIter  *a,
-                       GtkTreeIter  *b,
-                       gpointer      data)
-{
-    unsigned int start_a = 0;
-    unsigned int start_b = 0;
-
-    gtk_tree_model_get (model, a,
-                        CHAR_BLOCK_START_COL, &start_a, -1);
-    gtk_tree_model_get (model, b,
-                        CHAR_BLOCK_START_COL, &start_b, -1);
-    return (start_a - start_b);
-}
-
-static GtkTreeModel *
-all_char_table_model_new (void)
-{
-    GtkTreeStore *store;
-    GtkTreeIter   iter;
-    int i, j;
-    unsigned int start, end;
-    gchar *range;
-    gchar *range2;
-    gchar buff[7];
-    gchar buff2[35]; /* 7 x 5 e.g. 'a' -> '0x61 ' */
-    gchar buff3[35];
-
-    store = gtk_tree_store_new (CHAR_BLOCK_N_COLS,
-                                G_TYPE_STRING, G_TYPE_STRING,
-                                G_TYPE_STRING,
-                                G_TYPE_UINT, G_TYPE_UINT,
-                                G_TYPE_BOOLEAN);
-    for (i = 0; input_pad_unicode_block_table[i].label; i++) {
-        gtk_tree_store_append (store, &iter, NULL);
-        start = input_pad_unicode_block_table[i].start;
-        end = input_pad_unicode_block_table[i].end;
-        range = g_strdup_printf ("U+%06X - U+%06X", start, end);
-
-        buff[g_unichar_to_utf8 ((gunichar) start, buff)] = '\0';
-        buff2[0] = '\0';
-        for (j = 0; buff[j] && j < 7; j++) {
-            sprintf (buff2 + j * 5, "0x%02X ", (unsigned char) buff[j]);
-        }
-        if (buff[0] == '\0') {
-            buff2[0] = '0'; buff2[0] = 'x'; buff2[1] = '0'; buff2[2] = '0';
-            buff2[3] = '\0';
-        }
-        buff[g_unichar_to_utf8 ((gunichar) end, buff)] = '\0';
-        buff3[0] = '\0';
-        for (j = 0; buff[j] && j < 7; j++) {
-            sprintf (buff3 + j * 5, "0x%02X ", (unsigned char) buff[j]);
-        }
-        range2 = g_strdup_printf ("%s - %s", buff2, buff3);
-
-        gtk_tree_store_set (store, &iter,
-                            CHAR_BLOCK_LABEL_COL,
-                            _(input_pad_unicode_block_table[i].label),
-                            CHAR_BLOCK_UNICODE_COL, range,
-                            CHAR_BLOCK_UTF8_COL, range2,
-                            CHAR_BLOCK_START_COL, start,
-                            CHAR_BLOCK_END_COL, end,
-                            CHAR_BLOCK_VISIBLE_COL, TRUE, -1);
-        g_free (range);
-        g_free (range2);
-    }
-    gtk_tree_sortable_set_sort_func (GTK_TREE_SORTABLE (store),
-                                     CHAR_BLOCK_START_COL,
-                                     sort_char_block_start,
-                                     NULL, NULL);
-    gtk_tree_sortable_set_sort_column_id (GTK_TREE_SORTABLE (store),
-                                          CHAR_BLOCK_START_COL,
-                                          GTK_SORT_ASCENDING);
-    return GTK_TREE_MODEL (store);
-}
-
 static void
 create_about_dialog_ui (GtkBuilder *builder, GtkWidget *window)
 {
@@ -3416,6 +4691,7 @@ create_custom_char_views (GtkWidget *hbox, InputPadGtkWindow *window)
     GtkTreeViewColumn *column;
     GtkTreeSelection *selection;
     GtkTreeIter iter;
+    GtkWidget *entry;
     static CharTreeViewData tv_data;
 
     g_return_if_fail (INPUT_PAD_IS_GTK_WINDOW (window));
@@ -3432,7 +4708,7 @@ create_custom_char_views (GtkWidget *hbox, InputPadGtkWindow *window)
      * is hidden with GtkViewport. */
     main_tv = gtk_tree_view_new ();
     gtk_container_add (GTK_CONTAINER (scrolled), main_tv);
-    model = custom_char_group_model_new (INPUT_PAD_GTK_WINDOW (window));
+    model = input_pad_gtk_tree_model_new_with_groups (INPUT_PAD_GTK_WINDOW (window)->priv->group);
     gtk_tree_view_set_model (GTK_TREE_VIEW (main_tv), model);
     g_object_unref (G_OBJECT (model));
     gtk_widget_show (main_tv);
@@ -3449,6 +4725,9 @@ create_custom_char_views (GtkWidget *hbox, InputPadGtkWindow *window)
      * is hidden with GtkViewport. */
     sub_tv = gtk_tree_view_new ();
     gtk_container_add (GTK_CONTAINER (scrolled), sub_tv);
+    model = input_pad_gtk_tree_model_new_with_tables (NULL);
+    gtk_tree_view_set_model (GTK_TREE_VIEW (sub_tv), model);
+    g_object_unref (G_OBJECT (model));
     gtk_widget_show (sub_tv);
 
     renderer = gtk_cell_renderer_text_new ();
@@ -3495,12 +4774,42 @@ create_custom_char_views (GtkWidget *hbox, InputPadGtkWindow *window)
         selection = gtk_tree_view_get_selection (GTK_TREE_VIEW (main_tv));
         gtk_tree_selection_select_iter (selection, &iter);
     }
+
+    if (window->priv->custom_char_search_entry) {
+        entry = window->priv->custom_char_search_entry;
+        g_signal_connect (G_OBJECT (entry), "search-changed",
+                          G_CALLBACK (on_search_entry_changed_custom_char),
+                          &tv_data);
+        /* Keep the search results after the pads are reloaded. */
+        if (gtk_entry_get_text_length (GTK_ENTRY (entry)) > 0) {
+            on_search_entry_changed_custom_char (GTK_SEARCH_ENTRY (entry),
+                                                 &tv_data);
+        }
+    }
+}
+
+static GtkWidget *
+custom_char_views_get_scrolled (GtkWidget *hbox)
+{
+    GList *hbox_list;
+    GList *list;
+    GtkWidget *scrolled = NULL;
+
+    /* Skip the search entry. */
+    hbox_list = gtk_container_get_children (GTK_CONTAINER (hbox));
+    for (list = hbox_list; list; list = list->next) {
+        if (GTK_IS_SCROLLED_WINDOW (list->data)) {
+            scrolled = GTK_WIDGET (list->data);
+            break;
+        }
+    }
+    g_list_free (hbox_list);
+    return scrolled;
 }
 
 static void
 destroy_custom_char_views (GtkWidget *hbox, InputPadGtkWindow *window)
 {
-    GList *hbox_list = NULL;
     GList *scrolled_list;
     GList *viewport_list;
     GtkWidget *scrolled;
@@ -3511,11 +4820,17 @@ destroy_custom_char_views (GtkWidget *hbox, InputPadGtkWindow *window)
 
     g_return_if_fail (INPUT_PAD_IS_GTK_WINDOW (window));
 
+    if (window->priv->custom_char_search_entry) {
+        g_signal_handlers_disconnect_matched (G_OBJECT (window->priv->custom_char_search_entry),
+                                              G_SIGNAL_MATCH_FUNC,
+                                              0, 0, NULL,
+                                              G_CALLBACK (on_search_entry_changed_custom_char),
+                                              NULL);
+    }
+
     for (i = 0; i < 2; i++) {
-        hbox_list = gtk_container_get_children (GTK_CONTAINER (hbox));
-        g_return_if_fail (GTK_IS_SCROLLED_WINDOW (hbox_list->data));
-        scrolled = GTK_WIDGET (hbox_list->data);
-        g_list_free (hbox_list);
+        scrolled = custom_char_views_get_scrolled (hbox);
+        g_return_if_fail (scrolled != NULL);
 
         scrolled_list = gtk_container_get_children (GTK_CONTAINER (scrolled));
         g_return_if_fail (GTK_IS_VIEWPORT (scrolled_list->data));
@@ -3534,10 +4849,8 @@ destroy_custom_char_views (GtkWidget *hbox, InputPadGtkWindow *window)
         gtk_container_remove (GTK_CONTAINER (hbox), scrolled);
     }
 
-    hbox_list = gtk_container_get_children (GTK_CONTAINER (hbox));
-    g_return_if_fail (GTK_IS_SCROLLED_WINDOW (hbox_list->data));
-    scrolled = GTK_WIDGET (hbox_list->data);
-    g_list_free (hbox_list);
+    scrolled = custom_char_views_get_scrolled (hbox);
+    g_return_if_fail (scrolled != NULL);
 
     scrolled_list = gtk_container_get_children (GTK_CONTAINER (scrolled));
     g_return_if_fail (GTK_IS_VIEWPORT (scrolled_list->data));
@@ -3563,6 +4876,17 @@ create_custom_char_view_ui (GtkBuilder *builder,
     priv = input_pad_gtk_window_get_instance_private (INPUT_PAD_GTK_WINDOW (window));
     hbox = priv->top_custom_char_view_hbox;
 
+    /* The entry is packed before the views and kept while the views
+     * are recreated by the pad reload. */
+    priv->custom_char_search_entry = gtk_search_entry_new ();
+    gtk_widget_set_valign (priv->custom_char_search_entry, GTK_ALIGN_START);
+    gtk_entry_set_width_chars (GTK_ENTRY (priv->custom_char_search_entry), 12);
+    gtk_widget_set_tooltip_text (priv->custom_char_search_entry,
+                                 _("Search strings and commands in all pads"));
+    gtk_box_pack_start (GTK_BOX (hbox), priv->custom_char_search_entry,
+                        FALSE, FALSE, 0);
+    gtk_widget_show (priv->custom_char_search_entry);
+
     create_custom_char_views (hbox, INPUT_PAD_GTK_WINDOW (window));
 
     /* Should not call g_variant_unref() for g_action_change_state()
@@ -3685,7 +5009,7 @@ create_all_char_view_ui (GtkBuilder    *builder,
      * is hidden with GtkViewport. */
     tv = gtk_tree_view_new ();
     gtk_container_add (GTK_CONTAINER (scrolled), tv);
-    model = all_char_table_model_new ();
+    model = input_pad_gtk_tree_model_new_with_unicode_blocks ();
     gtk_tree_view_set_model (GTK_TREE_VIEW (tv), model);
     g_object_unref (G_OBJECT (model));
     gtk_widget_show (tv);
@@ -3781,6 +5105,7 @@ create_keyboard_layout_ui (GtkBuilder  *builder,
     GtkWidget *button_remove;
     GtkWidget *button_option;
     GtkWidget *button_option_close;
+    GtkWidget *search_entry;
     GAction *action;
     InputPadGtkWindow *input_pad = INPUT_PAD_GTK_WINDOW (window);
 
@@ -3791,6 +5116,7 @@ create_keyboard_layout_ui (GtkBuilder  *builder,
     button_remove = GTK_WIDGET (gtk_builder_get_object (builder, "ConfigLayoutsRemoveButton"));
     button_option = GTK_WIDGET (gtk_builder_get_object (builder, "ConfigLayoutsOptionButton"));
     button_option_close = GTK_WIDGET (gtk_builder_get_object (builder, "ConfigOptionsCloseButton"));
+    search_entry = GTK_WIDGET (gtk_builder_get_object (builder, "ConfigLayoutsSearchEntry"));
     input_pad->priv->config_layouts_dialog =
         GTK_WIDGET (gtk_builder_get_object (builder, "ConfigLayoutsDialog"));
     input_pad->priv->config_layouts_add_treeview =
@@ -3820,6 +5146,13 @@ create_keyboard_layout_ui (GtkBuilder  *builder,
     g_signal_connect (G_OBJECT (button_option_close), "clicked",
                       G_CALLBACK (on_button_config_options_close_clicked),
                       (gpointer) input_pad);
+    g_signal_connect (G_OBJECT (search_entry), "search-changed",
+                      G_CALLBACK (on_search_entry_changed_config_layouts),
+                      (gpointer) input_pad);
+    g_signal_connect (G_OBJECT (gtk_tree_view_get_selection (GTK_TREE_VIEW (input_pad->priv->config_layouts_add_treeview))),
+                      "changed",
+                      G_CALLBACK (on_tree_view_select_config_layouts_add),
+                      (gpointer) input_pad);
 
     /* Should not call g_variant_unref() for g_action_change_state()
      * and g_simple_action_set_state() since the variant is floating? */
@@ -4450,12 +5783,32 @@ input_pad_gtk_window_set_priv (InputPadGtkWindow *window)
         priv->group = input_pad_group_parse_all_files (NULL, NULL);
     }
     priv->char_button_sensitive = TRUE;
+    if (priv->command_helper == NULL &&
+        g_getenv ("INPUT_PAD_COMMAND_HELPER")) {
+        priv->command_helper = input_pad_command_helper_new ();
+    }
 
     if (kbdui_name) {
         priv->kbdui_name = g_strdup (kbdui_name);
     }
 
     window->priv = priv;
+    update_group_index (window);
+}
+
+static void
+update_group_index (InputPadGtkWindow *window)
+{
+    g_return_if_fail (window->priv != NULL);
+
+    if (window->priv->group_index) {
+        input_pad_group_index_destroy (window->priv->group_index);
+        window->priv->group_index = NULL;
+    }
+    if (window->priv->group) {
+        window->priv->group_index =
+            input_pad_group_index_new (window->priv->group);
+    }
 }
 
 static void
@@ -4479,6 +5832,10 @@ input_pad_gtk_window_real_destroy (GtkWidget *widget)
     InputPadGtkWindow *window = INPUT_PAD_GTK_WINDOW (widget);
 
     if (window->priv) {
+        if (window->priv->group_index) {
+            input_pad_group_index_destroy (window->priv->group_index);
+            window->priv->group_index = NULL;
+        }
         if (window->priv->group) {
             input_pad_group_destroy (window->priv->group);
             window->priv->group = NULL;
@@ -4491,6 +5848,39 @@ input_pad_gtk_window_real_destroy (GtkWidget *widget)
         if (window->priv->kbdui) {
             input_pad_gtk_window_kbdui_destroy (window);
         }
+        if (window->priv->keyboard_buttons) {
+            g_ptr_array_free (window->priv->keyboard_buttons, TRUE);
+            window->priv->keyboard_buttons = NULL;
+        }
+        keyboard_labels_prerender_stop (window);
+        input_pad_gdk_xkb_set_keymap_notify (window, NULL);
+        layout_switch_cancel (window);
+        keyboard_preview_drop (window);
+        send_key_worker_stop (window);
+        command_run_cancel_all (window);
+        if (window->priv->command_helper) {
+            input_pad_command_helper_destroy (window->priv->command_helper);
+            window->priv->command_helper = NULL;
+        }
+        command_cache_clear (window);
+        if (window->priv->xkb_config_reg_cancellable) {
+            g_cancellable_cancel (window->priv->xkb_config_reg_cancellable);
+            g_clear_object (&window->priv->xkb_config_reg_cancellable);
+        }
+        if (window->priv->xkb_config_reg) {
+            input_pad_gdk_xkb_destroy_config_registry (window->priv->xkb_config_reg);
+            window->priv->xkb_config_reg = NULL;
+        }
+        if (window->priv->keyboard_labels) {
+            g_hash_table_destroy (window->priv->keyboard_labels);
+            window->priv->keyboard_labels = NULL;
+        }
+        g_free (window->priv->config_layouts_search_text);
+        window->priv->config_layouts_search_text = NULL;
+        if (window->priv->config_options_checked) {
+            g_hash_table_destroy (window->priv->config_options_checked);
+            window->priv->config_options_checked = NULL;
+        }
         g_free (window->priv->kbdui_name);
         window->priv->kbdui_name = NULL;
         window->priv = NULL;
@@ -4511,6 +5901,16 @@ input_pad_gtk_window_real_realize (GtkWidget *window)
     GTK_WIDGET_CLASS (input_pad_gtk_window_parent_class)->realize (window);
 }
 
+static void
+input_pad_gtk_window_real_keyboard_changed (InputPadGtkWindow *window,
+                                            gint               group)
+{
+    if (window->priv == NULL) {
+        return;
+    }
+    window->priv->keyboard_group = (guint) group;
+}
+
 static gboolean
 input_pad_gtk_window_real_button_pressed (InputPadGtkWindow *window,
                                           const gchar       *str,
@@ -4521,14 +5921,12 @@ input_pad_gtk_window_real_button_pressed (InputPadGtkWindow *window,
 {
     if (type == INPUT_PAD_TABLE_TYPE_CHARS) {
         if (keysym > 0) {
-            send_key_event (gtk_widget_get_window (GTK_WIDGET (window)),
-                            keysym, keycode, state);
+            send_key_event (window, keysym, keycode, state);
         } else {
             g_print ("%s", str ? str : "");
         }
     } else if (type == INPUT_PAD_TABLE_TYPE_KEYSYMS) {
-        send_key_event (gtk_widget_get_window (GTK_WIDGET (window)),
-                        keysym, keycode, state);
+        send_key_event (window, keysym, keycode, state);
     } else if (type == INPUT_PAD_TABLE_TYPE_STRINGS) {
             g_print ("%s", str ? str : "");
     } else if (type == INPUT_PAD_TABLE_TYPE_COMMANDS) {
@@ -4549,6 +5947,7 @@ input_pad_gtk_window_class_init (InputPadGtkWindowClass *klass)
     widget_class->realize = input_pad_gtk_window_real_realize;
 
     klass->button_pressed = input_pad_gtk_window_real_button_pressed;
+    klass->keyboard_changed = input_pad_gtk_window_real_keyboard_changed;
 
     gtk_widget_class_set_template_from_resource (widget_class,
                                                  "/com/github/fujiwarat/input-pad/window-gtk.ui");
@@ -0,0 +1,252 @@
+/* vim:set et sts=4: */
+/* input-pad - The input pad
+ * Copyright (C) 2010-2012 Takao Fujiwara <takao.fujiwara1@gmail.com>
+ * Copyright (C) 2010-2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <X11/Xlib.h> /* LastKnownRequestProcessed */
+#include <string.h> /* memset */
+
+#include "xstats-gdk.h"
+
+typedef int (*XStatsAfterFunc) (Display *display);
+
+/* The requests are counted with the after function of Xlib, which is
+ * called after each request. A request is counted as a round trip when
+ * the reply of the request itself has been read. */
+static gboolean xstats_enabled;
+static gboolean xstats_log;
+static InputPadXStats xstats_totals[INPUT_PAD_XSTATS_N_OPS];
+static GHashTable *xstats_displays;
+static GPrivate xstats_current_scope;
+G_LOCK_DEFINE_STATIC (xstats);
+
+static const gchar *xstats_op_names[INPUT_PAD_XSTATS_N_OPS] = {
+    "other",
+    "startup",
+    "layout build",
+    "key press",
+    "layout switch",
+};
+
+static void
+xstats_init (void)
+{
+    static gsize initialized = 0;
+
+    if (g_once_init_enter (&initialized)) {
+        const gchar *value = g_getenv ("INPUT_PAD_XSTATS");
+
+        if (value && *value && g_strcmp0 (value, "0")) {
+            xstats_enabled = TRUE;
+            xstats_log = TRUE;
+        }
+        g_once_init_leave (&initialized, 1);
+    }
+}
+
+static int
+xstats_after_func (Display *display)
+{
+    InputPadXStatsScope *scope;
+    XStatsAfterFunc prev_func;
+    gboolean round_trip;
+
+    round_trip = (LastKnownRequestProcessed (display) + 1 ==
+                  NextRequest (display));
+    scope = (InputPadXStatsScope *) g_private_get (&xstats_current_scope);
+    if (scope) {
+        scope->n_requests++;
+        if (round_trip) {
+            scope->n_round_trips++;
+        }
+    }
+
+    G_LOCK (xstats);
+    if (scope == NULL) {
+        xstats_totals[INPUT_PAD_XSTATS_OP_OTHER].n_requests++;
+        if (round_trip) {
+            xstats_totals[INPUT_PAD_XSTATS_OP_OTHER].n_round_trips++;
+        }
+    }
+    prev_func = (XStatsAfterFunc) g_hash_table_lookup (xstats_displays,
+                                                       display);
+    G_UNLOCK (xstats);
+
+    if (prev_func) {
+        return prev_func (display);
+    }
+    return 0;
+}
+
+gboolean
+input_pad_gdk_xstats_is_enabled (void)
+{
+    xstats_init ();
+    return xstats_enabled;
+}
+
+/* The displays need to be attached after the counter is enabled. */
+void
+input_pad_gdk_xstats_set_enabled (gboolean enabled)
+{
+    xstats_init ();
+    xstats_enabled = enabled;
+}
+
+void
+input_pad_gdk_xstats_attach_display (Display *display)
+{
+    XStatsAfterFunc prev_func;
+
+    g_return_if_fail (display != NULL);
+
+    xstats_init ();
+    if (!xstats_enabled) {
+        return;
+    }
+
+    G_LOCK (xstats);
+    if (xstats_displays == NULL) {
+        xstats_displays = g_hash_table_new (g_direct_hash, g_direct_equal);
+    }
+    if (g_hash_table_contains (xstats_displays, display)) {
+        G_UNLOCK (xstats);
+        return;
+    }
+    G_UNLOCK (xstats);
+
+    prev_func = (XStatsAfterFunc) XSetAfterFunction (display,
+                                                     xstats_after_func);
+
+    G_LOCK (xstats);
+    g_hash_table_insert (xstats_displays, display, (gpointer) prev_func);
+    G_UNLOCK (xstats);
+}
+
+/* Needs to be called before the display is closed. */
+void
+input_pad_gdk_xstats_detach_display (Display *display)
+{
+    XStatsAfterFunc prev_func;
+    gpointer value = NULL;
+
+    g_return_if_fail (display != NULL);
+
+    G_LOCK (xstats);
+    if (xstats_displays == NULL ||
+        !g_hash_table_lookup_extended (xstats_displays, display,
+                                       NULL, &value)) {
+        G_UNLOCK (xstats);
+        return;
+    }
+    prev_func = (XStatsAfterFunc) value;
+    g_hash_table_remove (xstats_displays, display);
+    G_UNLOCK (xstats);
+
+    XSetAfterFunction (display, prev_func);
+}
+
+/* The scopes can be nested on a thread and the requests of the inner
+ * scope are also counted for the outer scope. */
+void
+input_pad_gdk_xstats_scope_begin (InputPadXStatsScope  *scope,
+                                  InputPadXStatsOp      op)
+{
+    g_return_if_fail (scope != NULL);
+    g_return_if_fail (op < INPUT_PAD_XSTATS_N_OPS);
+
+    xstats_init ();
+    scope->op = op;
+    scope->enabled = xstats_enabled;
+    if (!scope->enabled) {
+        return;
+    }
+    scope->start_time = g_get_monotonic_time ();
+    scope->n_requests = 0;
+    scope->n_round_trips = 0;
+    scope->parent = (InputPadXStatsScope *) g_private_get (&xstats_current_scope);
+    g_private_set (&xstats_current_scope, scope);
+}
+
+void
+input_pad_gdk_xstats_scope_end (InputPadXStatsScope *scope)
+{
+    InputPadXStats *totals;
+    gint64 time;
+
+    g_return_if_fail (scope != NULL);
+
+    if (!scope->enabled) {
+        return;
+    }
+    time = g_get_monotonic_time () - scope->start_time;
+    g_private_set (&xstats_current_scope, scope->parent);
+    if (scope->parent) {
+        scope->parent->n_requests += scope->n_requests;
+        scope->parent->n_round_trips += scope->n_round_trips;
+    }
+
+    G_LOCK (xstats);
+    totals = &xstats_totals[scope->op];
+    totals->n_scopes++;
+    totals->n_requests += scope->n_requests;
+    totals->n_round_trips += scope->n_round_trips;
+    totals->time += time;
+    G_UNLOCK (xstats);
+
+    if (xstats_log) {
+        g_message ("X requests of %s: %u requests, %u round trips, %.3f ms",
+                   xstats_op_names[scope->op],
+                   scope->n_requests, scope->n_round_trips,
+                   time / 1000.0);
+    }
+}
+
+void
+input_pad_gdk_xstats_get (InputPadXStatsOp  op,
+                          InputPadXStats   *stats)
+{
+    g_return_if_fail (op < INPUT_PAD_XSTATS_N_OPS);
+    g_return_if_fail (stats != NULL);
+
+    G_LOCK (xstats);
+    *stats = xstats_totals[op];
+    G_UNLOCK (xstats);
+}
+
+void
+input_pad_gdk_xstats_reset (void)
+{
+    G_LOCK (xstats);
+    memset (xstats_totals, 0, sizeof (xstats_totals));
+    G_UNLOCK (xstats);
+}
+
+const gchar *
+input_pad_gdk_xstats_op_get_name (InputPadXStatsOp op)
+{
+    g_return_val_if_fail (op < INPUT_PAD_XSTATS_N_OPS, NULL);
+
+    return xstats_op_names[op];
+}
@@ -0,0 +1,84 @@
+/* vim:set et sts=4: */
+/* input-pad - The input pad
+ * Copyright (C) 2010-2012 Takao Fujiwara <takao.fujiwara1@gmail.com>
+ * Copyright (C) 2010-2012 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#ifndef __INPUT_PAD_XSTATS_GDK_H__
+#define __INPUT_PAD_XSTATS_GDK_H__
+
+#include <glib.h>
+#include <X11/Xlib.h>
+
+G_BEGIN_DECLS
+
+/* The Xlib requests are counted while an operation scope is open on
+ * the thread. The requests outside the scopes are counted as OTHER. */
+typedef enum {
+    INPUT_PAD_XSTATS_OP_OTHER = 0,
+    INPUT_PAD_XSTATS_OP_STARTUP,
+    INPUT_PAD_XSTATS_OP_LAYOUT_BUILD,
+    INPUT_PAD_XSTATS_OP_KEY_PRESS,
+    INPUT_PAD_XSTATS_OP_LAYOUT_SWITCH,
+    INPUT_PAD_XSTATS_N_OPS,
+} InputPadXStatsOp;
+
+typedef struct _InputPadXStats InputPadXStats;
+typedef struct _InputPadXStatsScope InputPadXStatsScope;
+
+struct _InputPadXStats {
+    guint               n_scopes;
+    guint               n_requests;
+    guint               n_round_trips;
+    gint64              time;
+};
+
+/* The scope is allocated by the caller, usually on the stack. */
+struct _InputPadXStatsScope {
+    InputPadXStatsOp    op;
+    gboolean            enabled;
+    gint64              start_time;
+    guint               n_requests;
+    guint               n_round_trips;
+    InputPadXStatsScope *parent;
+};
+
+gboolean                input_pad_gdk_xstats_is_enabled
+                                        (void);
+void                    input_pad_gdk_xstats_set_enabled
+                                        (gboolean               enabled);
+void                    input_pad_gdk_xstats_attach_display
+                                        (Display               *display);
+void                    input_pad_gdk_xstats_detach_display
+                                        (Display               *display);
+void                    input_pad_gdk_xstats_scope_begin
+                                        (InputPadXStatsScope   *scope,
+                                         InputPadXStatsOp       op);
+void                    input_pad_gdk_xstats_scope_end
+                                        (InputPadXStatsScope   *scope);
+void                    input_pad_gdk_xstats_get
+                                        (InputPadXStatsOp       op,
+                                         InputPadXStats        *stats);
+void                    input_pad_gdk_xstats_reset
+                                        (void);
+const gchar *           input_pad_gdk_xstats_op_get_name
+                                        (InputPadXStatsOp       op);
+
+G_END_DECLS
+
+#endif
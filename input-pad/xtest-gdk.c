@@ -23,15 +23,18 @@
 #include <config.h>
 #endif
 
-#include <gdk/gdk.h>
+#include <gtk/gtk.h>
 #include <gdk/gdkx.h>
 #include <X11/Xlib.h>
+#include <X11/XKBlib.h>
 #include <X11/keysym.h>
 #include <X11/extensions/XTest.h>
 
 #include <input-pad-window-gtk.h>
 #include <input-pad-group.h>
 
+#include "xstats-gdk.h"
+
 G_MODULE_EXPORT
 gboolean     input_pad_module_init (InputPadGtkWindow *window);
 G_MODULE_EXPORT
@@ -39,52 +42,662 @@ gboolean     input_pad_module_setup (InputPadGtkWindow *window);
 G_MODULE_EXPORT
 const gchar* g_module_check_init (GModule *module);
 
+#define SPARE_KEYCODES_MAX 32
+#define PASTE_THRESHOLD_DEFAULT 32
+#define PASTE_RESTORE_TIMEOUT 5000
+#define PASTE_N_SELECTIONS 2
+
+typedef struct _XSendKeyEvent XSendKeyEvent;
+typedef struct _XSendJob XSendJob;
+typedef struct _SpareKeycode SpareKeycode;
+
+/* If bind is True, keycode is bound to bind_keysym before the key
+ * is sent. If bind_only is True, the key is not sent. */
+struct _XSendKeyEvent {
+    KeyCode     keycode;
+    guint       state;
+    gboolean    bind;
+    KeySym      bind_keysym;
+    gboolean    bind_only;
+};
+
+struct _XSendJob {
+    XSendKeyEvent      *events;
+    guint               n_events;
+};
+
+struct _SpareKeycode {
+    KeyCode     keycode;
+    KeySym      keysym;
+    guint       last_used;
+};
+
 static Display *saved_display = NULL;
 
+/* The keycodes without keysyms are bound to the chars which are not
+ * on the keyboard. The least recently used one is bound again. */
+static struct {
+    Display            *display;
+    SpareKeycode        keys[SPARE_KEYCODES_MAX];
+    guint               n_keys;
+    guint               serial;
+    gboolean            initialized;
+} spare_keycodes;
+
+/* The keys are sent by the thread with its own X connection so that
+ * the main loop does not wait for the X server. */
+static struct {
+    Display            *main_display;
+    GThread            *thread;
+    GAsyncQueue        *queue;
+    volatile gint       busy;
+    gboolean            failed;
+} xsend_worker;
+
+static XSendJob xsend_quit_job;
+
+/* The XTEST availability and the keysym to keycode table are kept
+ * for the display. The table is built again after the keymap is
+ * changed. */
+static struct {
+    Display            *display;
+    gboolean            have_xtest;
+    int                 xkb_event_base;
+    GHashTable         *keycodes;
+} xdisplay_cache;
+
+/* The long strings are set to CLIPBOARD and PRIMARY and pasted with
+ * Shift+Insert. The previous texts are restored after the text is
+ * served to the paste or after PASTE_RESTORE_TIMEOUT if the text is
+ * never requested. */
+static struct {
+    GtkClipboard       *clipboards[PASTE_N_SELECTIONS];
+    gchar              *saved_texts[PASTE_N_SELECTIONS];
+    gboolean            owned[PASTE_N_SELECTIONS];
+    gchar              *text;
+    Display            *display;
+    guint               serial;
+    guint               n_received;
+    guint               restore_id;
+    gboolean            served;
+    guint               threshold;
+} paste;
+
+static struct {
+    guint   state;
+    KeySym  keysym;
+} state2keysym[] = {
+    { ControlMask, XK_Control_L } ,
+    { Mod1Mask,    XK_Alt_L },
+    { Mod4Mask,    XK_Super_L },
+    { ShiftMask,   XK_Shift_L },
+    { LockMask,    XK_Caps_Lock },
+    { 0,           0L }
+};
+
+static void
+xsend_key_state_queue (Display       *display,
+                       guint          state,
+                       Bool           pressed)
+{
+    KeyCode     keycode_real;
+    int i;
+
+    for (i = 0; state2keysym[i].state != 0; i++) {
+        if (state & state2keysym[i].state) {
+            keycode_real = XKeysymToKeycode (display, state2keysym[i].keysym);
+            XTestFakeKeyEvent (display, keycode_real, pressed, CurrentTime);
+        }
+    }
+}
+
 static int
 xsend_key_state (Display       *display,
                  guint          state,
                  Bool           pressed)
 {
-    KeyCode     keycode_real;
-    static struct {
-        guint   state;
-        KeySym  keysym;
-    } state2keysym[] = {
-        { ControlMask, XK_Control_L } ,
-        { Mod1Mask,    XK_Alt_L },
-        { Mod4Mask,    XK_Super_L },
-        { ShiftMask,   XK_Shift_L },
-        { LockMask,    XK_Caps_Lock },
-        { 0,           0L }
-    };
-    int i;
-
     if (pressed) {
         saved_display = display;
     } else {
         saved_display = NULL;
     }
 
+    xsend_key_state_queue (display, state, pressed);
+    XSync (display, False);
+    return TRUE;
+}
+
+static GdkFilterReturn
+on_filter_mapping_evt (GdkXEvent * xev, GdkEvent * event, gpointer data)
+{
+    XEvent *xevent = (XEvent *) xev;
+    XkbEvent *xkbev = (XkbEvent *) xev;
+
+    if (xevent->type == MappingNotify) {
+        if (xevent->xmapping.request != MappingKeyboard) {
+            return GDK_FILTER_CONTINUE;
+        }
+    } else if (xdisplay_cache.xkb_event_base < 0 ||
+               xevent->type != xdisplay_cache.xkb_event_base ||
+               (xkbev->any.xkb_type != XkbMapNotify &&
+                xkbev->any.xkb_type != XkbNewKeyboardNotify)) {
+        return GDK_FILTER_CONTINUE;
+    }
+    if (xdisplay_cache.keycodes) {
+        g_hash_table_destroy (xdisplay_cache.keycodes);
+        xdisplay_cache.keycodes = NULL;
+    }
+    return GDK_FILTER_CONTINUE;
+}
+
+static void
+xdisplay_cache_init (Display *display)
+{
+    int opcode = 0;
+    int event  = 0;
+    int error  = 0;
+
+    if (xdisplay_cache.display == display) {
+        return;
+    }
+    if (xdisplay_cache.display) {
+        gdk_window_remove_filter (NULL, (GdkFilterFunc)
+                                  on_filter_mapping_evt, NULL);
+    }
+    if (xdisplay_cache.keycodes) {
+        g_hash_table_destroy (xdisplay_cache.keycodes);
+        xdisplay_cache.keycodes = NULL;
+    }
+    xdisplay_cache.display = display;
+    xdisplay_cache.have_xtest = XQueryExtension (display, "XTEST",
+                                                 &opcode, &event, &error);
+    if (!XkbQueryExtension (display, NULL, &xdisplay_cache.xkb_event_base,
+                            NULL, NULL, NULL)) {
+        xdisplay_cache.xkb_event_base = -1;
+    }
+    gdk_window_add_filter (NULL, (GdkFilterFunc)
+                           on_filter_mapping_evt, NULL);
+}
+
+/* The filter is removed before the module can be unloaded. */
+static void
+xdisplay_cache_fini (void)
+{
+    if (xdisplay_cache.display == NULL) {
+        return;
+    }
+    gdk_window_remove_filter (NULL, (GdkFilterFunc)
+                              on_filter_mapping_evt, NULL);
+    if (xdisplay_cache.keycodes) {
+        g_hash_table_destroy (xdisplay_cache.keycodes);
+        xdisplay_cache.keycodes = NULL;
+    }
+    xdisplay_cache.display = NULL;
+    xdisplay_cache.have_xtest = FALSE;
+    xdisplay_cache.xkb_event_base = -1;
+}
+
+static gboolean
+spare_keycodes_contains (KeyCode keycode)
+{
+    guint i;
+
+    for (i = 0; i < spare_keycodes.n_keys; i++) {
+        if (spare_keycodes.keys[i].keycode == keycode) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Same as XKeysymToKeycode() but the lower column is preferred in
+ * the table without a scan of the keymap. The spare keycodes are
+ * not in the table because they can be bound again at any time. */
+static KeyCode
+xdisplay_cache_keysym_to_keycode (Display *display, KeySym keysym)
+{
+    KeySym *keysyms;
+    int min_keycode, max_keycode, keysyms_per_keycode;
+    int keycode, i;
+
+    xdisplay_cache_init (display);
+    if (xdisplay_cache.keycodes == NULL) {
+        xdisplay_cache.keycodes = g_hash_table_new (g_direct_hash,
+                                                    g_direct_equal);
+        XDisplayKeycodes (display, &min_keycode, &max_keycode);
+        keysyms = XGetKeyboardMapping (display, min_keycode,
+                                       max_keycode - min_keycode + 1,
+                                       &keysyms_per_keycode);
+        if (keysyms == NULL) {
+            return XKeysymToKeycode (display, keysym);
+        }
+        for (i = 0; i < keysyms_per_keycode; i++) {
+            for (keycode = min_keycode; keycode <= max_keycode; keycode++) {
+                KeySym sym = keysyms[(keycode - min_keycode) * keysyms_per_keycode + i];
+
+                if (sym == NoSymbol ||
+                    spare_keycodes_contains ((KeyCode) keycode) ||
+                    g_hash_table_contains (xdisplay_cache.keycodes,
+                                           GUINT_TO_POINTER (sym))) {
+                    continue;
+                }
+                g_hash_table_insert (xdisplay_cache.keycodes,
+                                     GUINT_TO_POINTER (sym),
+                                     GUINT_TO_POINTER (keycode));
+            }
+        }
+        XFree (keysyms);
+    }
+    return (KeyCode) GPOINTER_TO_UINT (g_hash_table_lookup (xdisplay_cache.keycodes,
+                                                            GUINT_TO_POINTER (keysym)));
+}
+
+static void
+spare_keycodes_init (Display *display)
+{
+    KeySym *keysyms;
+    int min_keycode, max_keycode, keysyms_per_keycode;
+    int keycode, i;
+
+    if (spare_keycodes.initialized) {
+        return;
+    }
+    spare_keycodes.initialized = TRUE;
+    if (g_getenv ("INPUT_PAD_NO_KEYCODE_REMAP")) {
+        return;
+    }
+
+    XDisplayKeycodes (display, &min_keycode, &max_keycode);
+    keysyms = XGetKeyboardMapping (display, min_keycode,
+                                   max_keycode - min_keycode + 1,
+                                   &keysyms_per_keycode);
+    if (keysyms == NULL) {
+        return;
+    }
+    for (keycode = max_keycode;
+         keycode >= min_keycode && spare_keycodes.n_keys < SPARE_KEYCODES_MAX;
+         keycode--) {
+        KeySym *syms = keysyms + (keycode - min_keycode) * keysyms_per_keycode;
+        SpareKeycode *key;
+
+        for (i = 0; i < keysyms_per_keycode; i++) {
+            if (syms[i] != NoSymbol) {
+                break;
+            }
+        }
+        if (i < keysyms_per_keycode) {
+            continue;
+        }
+        key = &spare_keycodes.keys[spare_keycodes.n_keys++];
+        key->keycode = (KeyCode) keycode;
+        key->keysym = NoSymbol;
+        key->last_used = 0;
+    }
+    XFree (keysyms);
+    spare_keycodes.display = display;
+}
+
+/* Returns the spare keycode which is already bound to keysym or 0. */
+static KeyCode
+spare_keycodes_lookup (KeySym keysym)
+{
+    guint i;
+
+    if (keysym == NoSymbol) {
+        return 0;
+    }
+    for (i = 0; i < spare_keycodes.n_keys; i++) {
+        SpareKeycode *key = &spare_keycodes.keys[i];
+
+        if (key->keysym == keysym) {
+            key->last_used = ++spare_keycodes.serial;
+            return key->keycode;
+        }
+    }
+    return 0;
+}
+
+/* Returns the spare keycode bound to keysym or 0. The keycodes used
+ * since serial are not bound again so that the queued events keep
+ * their keysyms. *reboundp is True when the keycode needs to be bound
+ * before it is sent. */
+static KeyCode
+spare_keycodes_bind (Display   *display,
+                     KeySym     keysym,
+                     guint      serial,
+                     gboolean  *reboundp)
+{
+    SpareKeycode *lru = NULL;
+    guint i;
+
+    spare_keycodes_init (display);
+    *reboundp = FALSE;
+    for (i = 0; i < spare_keycodes.n_keys; i++) {
+        SpareKeycode *key = &spare_keycodes.keys[i];
+
+        if (key->keysym == keysym) {
+            key->last_used = ++spare_keycodes.serial;
+            return key->keycode;
+        }
+        if (key->last_used >= serial) {
+            continue;
+        }
+        if (lru == NULL || key->last_used < lru->last_used) {
+            lru = key;
+        }
+    }
+    if (lru == NULL) {
+        return 0;
+    }
+    lru->keysym = keysym;
+    lru->last_used = ++spare_keycodes.serial;
+    *reboundp = TRUE;
+    return lru->keycode;
+}
+
+/* Returns the events which bind the spare keycodes to NoSymbol. */
+static XSendKeyEvent *
+spare_keycodes_unbind (guint *n_eventsp)
+{
+    XSendKeyEvent *events;
+    guint i, n = 0;
+
+    *n_eventsp = 0;
+    if (spare_keycodes.display == NULL) {
+        return NULL;
+    }
+    events = g_new0 (XSendKeyEvent, spare_keycodes.n_keys + 1);
+    for (i = 0; i < spare_keycodes.n_keys; i++) {
+        SpareKeycode *key = &spare_keycodes.keys[i];
+
+        if (key->keysym == NoSymbol) {
+            continue;
+        }
+        events[n].keycode = key->keycode;
+        events[n].bind = TRUE;
+        events[n].bind_keysym = NoSymbol;
+        events[n].bind_only = TRUE;
+        n++;
+        key->keysym = NoSymbol;
+        key->last_used = 0;
+    }
+    if (n == 0) {
+        g_free (events);
+        return NULL;
+    }
+    *n_eventsp = n;
+    return events;
+}
+
+/* Queues all the events without a flush. The modifiers are pressed
+ * and released only when the state is changed between the events. */
+static void
+xsend_key_events_queue (Display             *display,
+                        const XSendKeyEvent *events,
+                        guint                n_events)
+{
+    guint modifiers = 0;
+    guint modifiers_mask = 0;
+    guint next_modifiers;
+    guint i;
+
     for (i = 0; state2keysym[i].state != 0; i++) {
-        if (state & state2keysym[i].state) {
-            keycode_real = XKeysymToKeycode (display, state2keysym[i].keysym);
-            XTestFakeKeyEvent (display, keycode_real, pressed, CurrentTime);
-            XSync (display, False);
+        modifiers_mask |= state2keysym[i].state;
+    }
+
+    for (i = 0; i < n_events; i++) {
+        if (events[i].bind) {
+            KeySym syms[2];
+
+            syms[0] = events[i].bind_keysym;
+            syms[1] = events[i].bind_keysym;
+            XChangeKeyboardMapping (display, events[i].keycode, 2, syms, 1);
         }
+        if (events[i].bind_only) {
+            continue;
+        }
+        next_modifiers = events[i].state & modifiers_mask;
+        if (next_modifiers != modifiers) {
+            xsend_key_state_queue (display, modifiers & ~next_modifiers,
+                                   False);
+            xsend_key_state_queue (display, next_modifiers & ~modifiers,
+                                   True);
+            modifiers = next_modifiers;
+        }
+        XTestFakeKeyEvent (display, events[i].keycode, True, CurrentTime);
+        XTestFakeKeyEvent (display, events[i].keycode, False, CurrentTime);
+    }
+    if (modifiers != 0) {
+        xsend_key_state_queue (display, modifiers, False);
+    }
+}
+
+/* Sends all the events with one flush. */
+static int
+xsend_key_events (Display             *display,
+                  const XSendKeyEvent *events,
+                  guint                n_events)
+{
+    saved_display = display;
+    xsend_key_events_queue (display, events, n_events);
+    XSync (display, False);
+    saved_display = NULL;
+    return TRUE;
+}
+
+static gpointer
+xsend_worker_thread (gpointer data)
+{
+    Display *display = (Display *) data;
+    XSendJob *job;
+    XEvent xevent;
+    InputPadXStatsScope scope;
+    gboolean quit = FALSE;
+
+    while (!quit) {
+        job = (XSendJob *) g_async_queue_pop (xsend_worker.queue);
+        g_atomic_int_set (&xsend_worker.busy, 1);
+        input_pad_gdk_xstats_scope_begin (&scope,
+                                          INPUT_PAD_XSTATS_OP_KEY_PRESS);
+        /* The jobs queued by the key repeat are sent with one flush. */
+        do {
+            if (job == &xsend_quit_job) {
+                quit = TRUE;
+                break;
+            }
+            xsend_key_events_queue (display, job->events, job->n_events);
+            g_free (job->events);
+            g_slice_free (XSendJob, job);
+        } while ((job = (XSendJob *) g_async_queue_try_pop (xsend_worker.queue)) != NULL);
+        XSync (display, False);
+        /* MappingNotify is sent to every client. The modifier keys
+         * are looked up with the refreshed keymap. */
+        while (XPending (display)) {
+            XNextEvent (display, &xevent);
+            if (xevent.type == MappingNotify) {
+                XRefreshKeyboardMapping (&xevent.xmapping);
+            }
+        }
+        input_pad_gdk_xstats_scope_end (&scope);
+        g_atomic_int_set (&xsend_worker.busy, 0);
+    }
+    input_pad_gdk_xstats_detach_display (display);
+    XCloseDisplay (display);
+    return NULL;
+}
+
+static gboolean
+xsend_worker_start (Display *main_display)
+{
+    Display *display;
+    GError *error = NULL;
+
+    if (xsend_worker.thread) {
+        return TRUE;
+    }
+    if (xsend_worker.failed) {
+        return FALSE;
+    }
+    xsend_worker.main_display = main_display;
+    display = XOpenDisplay (DisplayString (main_display));
+    if (display == NULL) {
+        g_warning ("Could not open the display for XTEST: %s",
+                   DisplayString (main_display));
+        xsend_worker.failed = TRUE;
+        return FALSE;
+    }
+    input_pad_gdk_xstats_attach_display (display);
+    xsend_worker.queue = g_async_queue_new ();
+    xsend_worker.thread = g_thread_try_new ("input-pad-xtest",
+                                            xsend_worker_thread,
+                                            display, &error);
+    if (xsend_worker.thread == NULL) {
+        g_warning ("Could not create the thread for XTEST: %s",
+                   error ? error->message : "");
+        g_clear_error (&error);
+        g_async_queue_unref (xsend_worker.queue);
+        xsend_worker.queue = NULL;
+        input_pad_gdk_xstats_detach_display (display);
+        XCloseDisplay (display);
+        xsend_worker.failed = TRUE;
+        return FALSE;
     }
     return TRUE;
 }
 
+static void
+xsend_worker_stop (void)
+{
+    if (xsend_worker.thread == NULL) {
+        return;
+    }
+    g_async_queue_push (xsend_worker.queue, &xsend_quit_job);
+    g_thread_join (xsend_worker.thread);
+    xsend_worker.thread = NULL;
+    g_async_queue_unref (xsend_worker.queue);
+    xsend_worker.queue = NULL;
+}
+
+/* Takes events. The events are sent on the main thread if the worker
+ * thread is not available. */
+static int
+xsend_key_events_async (Display        *display,
+                        XSendKeyEvent  *events,
+                        guint           n_events)
+{
+    XSendJob *job;
+    int retval;
+
+    if (!xsend_worker_start (display)) {
+        retval = xsend_key_events (display, events, n_events);
+        g_free (events);
+        return retval;
+    }
+    job = g_slice_new (XSendJob);
+    job->events = events;
+    job->n_events = n_events;
+    g_async_queue_push (xsend_worker.queue, job);
+    return TRUE;
+}
+
+/* Maps str to the keys on the group of state. The chars which are not
+ * on the keyboard are bound to the spare keycodes. Returns NULL if
+ * no keycode is available. */
+static XSendKeyEvent *
+string_to_key_events (Display      *display,
+                      const gchar  *str,
+                      guint         state,
+                      guint        *n_eventsp)
+{
+    XSendKeyEvent *events;
+    SpareKeycode saved_keys[SPARE_KEYCODES_MAX];
+    const gchar *p;
+    guint group = XkbGroupForCoreState (state);
+    guint serial;
+    guint saved_serial;
+    guint n = 0;
+    guint i;
+    gunichar ch;
+    KeySym keysym;
+    KeyCode keycode;
+    gboolean rebound = FALSE;
+
+    /* The bindings are restored if a char cannot be sent since
+     * the events to bind the keycodes are not sent then. */
+    spare_keycodes_init (display);
+    for (i = 0; i < spare_keycodes.n_keys; i++) {
+        saved_keys[i] = spare_keycodes.keys[i];
+    }
+    saved_serial = spare_keycodes.serial;
+    serial = spare_keycodes.serial + 1;
+
+    events = g_new0 (XSendKeyEvent, g_utf8_strlen (str, -1) + 1);
+    state &= ~(ShiftMask | LockMask);
+    for (p = str; *p; p = g_utf8_next_char (p)) {
+        ch = g_utf8_get_char (p);
+        if (ch == '\n') {
+            keysym = XK_Return;
+        } else if (ch == '\t') {
+            keysym = XK_Tab;
+        } else {
+            keysym = (KeySym) gdk_unicode_to_keyval (ch);
+        }
+        /* The bound spare keycodes are looked up before the keymap
+         * so that they are not bound again while they are in use. */
+        if ((keycode = spare_keycodes_lookup (keysym)) != 0) {
+            events[n].state = state;
+            events[n].keycode = keycode;
+            n++;
+            continue;
+        }
+        keycode = xdisplay_cache_keysym_to_keycode (display, keysym);
+        if (keycode != 0 &&
+            XkbKeycodeToKeysym (display, keycode, group, 0) == keysym) {
+            events[n].state = state;
+        } else if (keycode != 0 &&
+                   XkbKeycodeToKeysym (display, keycode, group, 1) == keysym) {
+            events[n].state = state | ShiftMask;
+        } else if (keysym != NoSymbol &&
+                   (keycode = spare_keycodes_bind (display, keysym, serial,
+                                                   &rebound)) != 0) {
+            events[n].state = state;
+            events[n].bind = rebound;
+            events[n].bind_keysym = keysym;
+        } else {
+            for (i = 0; i < spare_keycodes.n_keys; i++) {
+                spare_keycodes.keys[i] = saved_keys[i];
+            }
+            spare_keycodes.serial = saved_serial;
+            g_free (events);
+            return NULL;
+        }
+        events[n].keycode = keycode;
+        n++;
+    }
+    *n_eventsp = n;
+    return events;
+}
+
 static void
 signal_exit_cb (int signal_id)
 {
+    XSendKeyEvent *events;
+    guint n_events = 0;
+
+    if (saved_display == NULL && g_atomic_int_get (&xsend_worker.busy)) {
+        saved_display = xsend_worker.main_display;
+    }
     if (saved_display != NULL) {
         xsend_key_state (saved_display,
                          ControlMask | Mod1Mask | Mod4Mask | ShiftMask | LockMask,
                          FALSE);
         saved_display = NULL;
     }
+    events = spare_keycodes_unbind (&n_events);
+    if (events) {
+        xsend_key_events (spare_keycodes.display, events, n_events);
+        g_free (events);
+    }
     signal (signal_id, SIG_DFL);
     raise (signal_id);
 }
@@ -96,25 +709,189 @@ send_key_event (GdkWindow      *gdkwindow,
                 guint           state)
 {
     Display    *display;
-    KeyCode     keycode_real;
+    XSendKeyEvent *event;
 
     display = GDK_WINDOW_XDISPLAY (gdkwindow);
-    if (state != 0) {
-        xsend_key_state (display, state, True);
-    }
+    event = g_new0 (XSendKeyEvent, 1);
     if (keycode != 0) {
-        keycode_real = (KeyCode) keycode;
-    } else {
-        keycode_real = XKeysymToKeycode (display, (KeySym) keysym);
+        event->keycode = (KeyCode) keycode;
+    } else if ((event->keycode = spare_keycodes_lookup ((KeySym) keysym)) == 0) {
+        event->keycode = xdisplay_cache_keysym_to_keycode (display,
+                                                           (KeySym) keysym);
     }
-    XTestFakeKeyEvent (display, keycode_real, True, CurrentTime);
-    XSync (display, False);
-    XTestFakeKeyEvent (display, keycode_real, False, CurrentTime);
-    XSync (display, False);
-    if (state != 0) {
-        xsend_key_state (display, state, False);
+    event->state = state;
+
+    return xsend_key_events_async (display, event, 1);
+}
+
+static int
+send_string_event (GdkWindow      *gdkwindow,
+                   const gchar    *str,
+                   guint           state)
+{
+    Display    *display;
+    XSendKeyEvent *events;
+    guint n_events = 0;
+
+    if (str == NULL || *str == '\0') {
+        return FALSE;
+    }
+    display = GDK_WINDOW_XDISPLAY (gdkwindow);
+    events = string_to_key_events (display, str, state, &n_events);
+    if (events == NULL) {
+        return FALSE;
+    }
+    return xsend_key_events_async (display, events, n_events);
+}
+
+static gboolean on_paste_restore_timeout (gpointer data);
+
+static void
+paste_get_func (GtkClipboard       *clipboard,
+                GtkSelectionData   *selection_data,
+                guint               info,
+                gpointer            data)
+{
+    gtk_selection_data_set_text (selection_data,
+                                 paste.text ? paste.text : "", -1);
+    if (paste.text == NULL || paste.served) {
+        return;
+    }
+    /* The texts are restored after the reply is sent and the fallback
+     * timeout is not needed any more. */
+    paste.served = TRUE;
+    if (paste.restore_id != 0) {
+        g_source_remove (paste.restore_id);
+    }
+    paste.restore_id = gdk_threads_add_idle (on_paste_restore_timeout,
+                                             NULL);
+}
+
+static void
+paste_clear_func (GtkClipboard *clipboard,
+                  gpointer      data)
+{
+    paste.owned[GPOINTER_TO_UINT (data)] = FALSE;
+}
+
+/* Only the texts are restored. The selections which are owned by
+ * other clients after the paste are not changed. */
+static void
+paste_restore (void)
+{
+    int i;
+
+    if (paste.restore_id != 0) {
+        g_source_remove (paste.restore_id);
+        paste.restore_id = 0;
     }
+    /* The pending requests are ignored. */
+    paste.serial++;
+    paste.served = FALSE;
+    for (i = 0; i < PASTE_N_SELECTIONS; i++) {
+        if (paste.owned[i]) {
+            paste.owned[i] = FALSE;
+            if (paste.saved_texts[i]) {
+                gtk_clipboard_set_text (paste.clipboards[i],
+                                        paste.saved_texts[i], -1);
+            } else {
+                gtk_clipboard_clear (paste.clipboards[i]);
+            }
+        }
+        g_free (paste.saved_texts[i]);
+        paste.saved_texts[i] = NULL;
+    }
+    g_free (paste.text);
+    paste.text = NULL;
+}
+
+static gboolean
+on_paste_restore_timeout (gpointer data)
+{
+    paste.restore_id = 0;
+    paste_restore ();
+    return FALSE;
+}
+
+static void
+paste_send (void)
+{
+    GtkTargetList *target_list;
+    GtkTargetEntry *targets;
+    XSendKeyEvent *event;
+    int n_targets = 0;
+    int i;
+
+    target_list = gtk_target_list_new (NULL, 0);
+    gtk_target_list_add_text_targets (target_list, 0);
+    targets = gtk_target_table_new_from_list (target_list, &n_targets);
+    for (i = 0; i < PASTE_N_SELECTIONS; i++) {
+        paste.owned[i] =
+            gtk_clipboard_set_with_data (paste.clipboards[i],
+                                         targets, n_targets,
+                                         paste_get_func,
+                                         paste_clear_func,
+                                         GUINT_TO_POINTER (i));
+    }
+    gtk_target_table_free (targets, n_targets);
+    gtk_target_list_unref (target_list);
+
+    /* The selections need to be owned before the worker thread sends
+     * the key with the other connection. */
+    XSync (paste.display, False);
+
+    event = g_new0 (XSendKeyEvent, 1);
+    event->keycode = xdisplay_cache_keysym_to_keycode (paste.display,
+                                                       XK_Insert);
+    event->state = ShiftMask;
+    xsend_key_events_async (paste.display, event, 1);
 
+    paste.restore_id = gdk_threads_add_timeout (PASTE_RESTORE_TIMEOUT,
+                                                on_paste_restore_timeout,
+                                                NULL);
+}
+
+static void
+on_paste_text_received (GtkClipboard   *clipboard,
+                        const gchar    *text,
+                        gpointer        data)
+{
+    int i;
+
+    if (GPOINTER_TO_UINT (data) != paste.serial) {
+        return;
+    }
+    for (i = 0; i < PASTE_N_SELECTIONS; i++) {
+        if (paste.clipboards[i] == clipboard) {
+            paste.saved_texts[i] = g_strdup (text);
+        }
+    }
+    if (++paste.n_received < PASTE_N_SELECTIONS) {
+        return;
+    }
+    paste_send ();
+}
+
+static int
+send_paste_event (GdkWindow      *gdkwindow,
+                  const gchar    *str)
+{
+    GdkDisplay *display = gdk_window_get_display (gdkwindow);
+    int i;
+
+    paste_restore ();
+    paste.display = GDK_WINDOW_XDISPLAY (gdkwindow);
+    paste.text = g_strdup (str);
+    paste.n_received = 0;
+    paste.clipboards[0] = gtk_clipboard_get_for_display (display,
+                                                         GDK_SELECTION_CLIPBOARD);
+    paste.clipboards[1] = gtk_clipboard_get_for_display (display,
+                                                         GDK_SELECTION_PRIMARY);
+    for (i = 0; i < PASTE_N_SELECTIONS; i++) {
+        gtk_clipboard_request_text (paste.clipboards[i],
+                                    on_paste_text_received,
+                                    GUINT_TO_POINTER (paste.serial));
+    }
     return TRUE;
 }
 
@@ -124,15 +901,17 @@ send_key_event (GdkWindow      *gdkwindow,
 static gboolean
 have_extension (InputPadGtkWindow *window)
 {
-    int opcode = 0;
-    int event  = 0;
-    int error  = 0;
+    static gboolean warned = FALSE;
 
     g_return_val_if_fail (window != NULL &&
                           INPUT_PAD_IS_GTK_WINDOW (window), FALSE);
 
-    if (!XQueryExtension (GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET (window))),
-                         "XTEST", &opcode, &event, &error)) {
+    xdisplay_cache_init (GDK_WINDOW_XDISPLAY (gtk_widget_get_window (GTK_WIDGET (window))));
+    if (!xdisplay_cache.have_xtest) {
+        if (warned) {
+            return FALSE;
+        }
+        warned = TRUE;
         g_warning ("Could not find XTEST module. Maybe you did not install "
                    "libXtst library.\n"
                    "%% xdpyinfo | grep XTEST");
@@ -158,15 +937,44 @@ on_window_button_pressed (InputPadGtkWindow    *window,
             send_key_event (gtk_widget_get_window (GTK_WIDGET (window)), keysym, keycode, state);
             return TRUE;
         } else {
-            return FALSE;
+            /* The char is sent with a spare keycode. */
+            return send_string_event (gtk_widget_get_window (GTK_WIDGET (window)),
+                                      str, state);
         }
     } else if (type == INPUT_PAD_TABLE_TYPE_KEYSYMS) {
         send_key_event (gtk_widget_get_window (GTK_WIDGET (window)), keysym, keycode, state);
         return TRUE;
+    } else if (type == INPUT_PAD_TABLE_TYPE_STRINGS ||
+               type == INPUT_PAD_TABLE_TYPE_COMMANDS) {
+        if (paste.threshold > 0 && str != NULL &&
+            g_utf8_strlen (str, -1) >= paste.threshold) {
+            return send_paste_event (gtk_widget_get_window (GTK_WIDGET (window)),
+                                     str);
+        }
+        /* The string is printed by the default handler if a char
+         * is not on the keyboard. */
+        return send_string_event (gtk_widget_get_window (GTK_WIDGET (window)),
+                                  str, state);
     }
     return FALSE;
 }
 
+static void
+on_window_destroy (InputPadGtkWindow    *window,
+                   gpointer              data)
+{
+    XSendKeyEvent *events;
+    guint n_events = 0;
+
+    paste_restore ();
+    events = spare_keycodes_unbind (&n_events);
+    if (events) {
+        xsend_key_events_async (spare_keycodes.display, events, n_events);
+    }
+    xsend_worker_stop ();
+    xdisplay_cache_fini ();
+}
+
 static void
 on_window_reorder_button_pressed (InputPadGtkWindow    *window,
                                   gpointer              data)
@@ -182,6 +990,14 @@ on_window_reorder_button_pressed (InputPadGtkWindow    *window,
 gboolean
 input_pad_module_init (InputPadGtkWindow *window)
 {
+    const gchar *threshold = g_getenv ("INPUT_PAD_PASTE_THRESHOLD");
+
+    /* The strings longer than the threshold are pasted. 0 disables
+     * the paste. */
+    paste.threshold = PASTE_THRESHOLD_DEFAULT;
+    if (threshold) {
+        paste.threshold = (guint) g_ascii_strtoull (threshold, NULL, 10);
+    }
     signal (SIGINT, signal_exit_cb);
     return TRUE;
 }
@@ -198,6 +1014,8 @@ input_pad_module_setup (InputPadGtkWindow *window)
     g_signal_connect (G_OBJECT (window),
                       "reorder-button-pressed",
                       G_CALLBACK (on_window_reorder_button_pressed), NULL);
+    g_signal_connect (G_OBJECT (window), "destroy",
+                      G_CALLBACK (on_window_destroy), NULL);
     return TRUE;
 }
 